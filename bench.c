@@ -0,0 +1,573 @@
+/* Standalone benchmark for the http.parser module.
+ *
+ * Embeds Lua with a counting allocator, replays a corpus of requests and
+ * responses through parser:execute() and prints one JSON object per
+ * scenario and byte scanner (see lhp.scanner()) so the results can be
+ * compared between commits and against the scalar scanner, which only
+ * differs where the module lowercases or decodes bytes.  Then
+ * lhp.parse_batch() is timed with 1 up to as many threads as there
+ * are CPUs to show how it scales.  Last the bytes held by an idle
+ * keep-alive parser are reported before and after parser:hibernate():
+ *
+ *   lhp_bench [iterations-scale]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+#include <lauxlib.h>
+#include <lua.h>
+#include <lualib.h>
+#include "lhp-batch.h"
+
+#ifndef LHP_BENCH_REVISION
+#define LHP_BENCH_REVISION "unknown"
+#endif
+
+LUALIB_API int luaopen_http_parser(lua_State* L);
+
+typedef struct bench_alloc {
+    size_t count;   /* number of allocations and growing reallocations. */
+    size_t bytes;   /* bytes requested by them. */
+    size_t live;    /* bytes allocated now. */
+} bench_alloc;
+
+static void* bench_allocf(void* ud, void* ptr, size_t osize, size_t nsize) {
+    bench_alloc* counts = (bench_alloc*)ud;
+    void*        data;
+
+    if ( 0 == nsize ) {
+        if ( NULL != ptr ) counts->live -= osize;
+        free(ptr);
+        return NULL;
+    }
+    /* osize is a type tag rather than a size when ptr is NULL in 5.2+. */
+    if ( NULL == ptr || nsize > osize ) {
+        counts->count++;
+        counts->bytes += NULL == ptr ? nsize : nsize - osize;
+    }
+    data = realloc(ptr, nsize);
+    if ( NULL != data ) {
+        counts->live += nsize;
+        if ( NULL != ptr ) counts->live -= osize;
+    }
+    return data;
+}
+
+static double bench_now(void) {
+#ifdef _WIN32
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (double)now.QuadPart / (double)freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+/* Runs one scenario: run(type, chunks, reps, scanner, lowercase, form,
+ * lazy) feeds every string of the chunks array to one parser, reps
+ * times, and returns the number of messages and events seen by the
+ * callbacks, or nothing if the scanner is not supported.  With
+ * lowercase the parser lowercases header fields, with form bodies are
+ * decoded by a query_decoder and with lazy the parser uses
+ * lazy_headers and looks up two headers per message.
+ */
+static const char* bench_driver_lua =
+    "local lhp = require 'http.parser'\n"
+    "return function(type, chunks, reps, scanner, lowercase, form, lazy)\n"
+    "    if not pcall(lhp.scanner, scanner) then return end\n"
+    "    local messages, events = 0, 0\n"
+    "    local function event() events = events + 1 end\n"
+    "    local decoder = lhp.query_decoder()\n"
+    "    local function body(chunk)\n"
+    "        decoder:feed(chunk)\n"
+    "        events = events + 1\n"
+    "    end\n"
+    "    local function headers(h)\n"
+    "        if h then h:get('host') h:get('content-type') end\n"
+    "        events = events + 1\n"
+    "    end\n"
+    "    local parser = lhp[type]{\n"
+    "        lowercase_headers   = lowercase,\n"
+    "        lazy_headers        = lazy,\n"
+    "        on_message_begin    = event,\n"
+    "        on_url              = event,\n"
+    "        on_status           = event,\n"
+    "        on_header           = event,\n"
+    "        on_headers_complete = headers,\n"
+    "        on_body             = form and body or event,\n"
+    "        on_chunk_header     = event,\n"
+    "        on_chunk_complete   = event,\n"
+    "        on_message_complete = function()\n"
+    "            messages = messages + 1\n"
+    "            events = events + 1\n"
+    "        end,\n"
+    "    }\n"
+    "    local n = #chunks\n"
+    "    for i = 1, reps do\n"
+    "        for j = 1, n do\n"
+    "            local chunk = chunks[j]\n"
+    "            if parser:execute(chunk) ~= #chunk then\n"
+    "                error('parse error: ' .. select(2, parser:error()))\n"
+    "            end\n"
+    "        end\n"
+    "    end\n"
+    "    return messages, events\n"
+    "end\n";
+
+/* Runs the batch scenario: run_batch(buffers, reps, threads) parses
+ * the buffers with parse_batch() reps times and returns the number of
+ * messages.
+ */
+static const char* bench_batch_lua =
+    "local lhp = require 'http.parser'\n"
+    "return function(buffers, reps, threads)\n"
+    "    local messages = 0\n"
+    "    local options = { threads = threads }\n"
+    "    for i = 1, reps do\n"
+    "        local results = lhp.parse_batch(buffers, options)\n"
+    "        for j = 1, #results do\n"
+    "            if results[j].error then\n"
+    "                error('parse error: ' .. results[j].error)\n"
+    "            end\n"
+    "            messages = messages + #results[j]\n"
+    "        end\n"
+    "    end\n"
+    "    return messages\n"
+    "end\n";
+
+/* The idle scenario: make(n, input, auto) returns n parsers of one
+ * factory that each parsed input, with the hibernate option if auto,
+ * and sleep(parsers) calls hibernate() on all of them.
+ */
+static const char* bench_idle_lua =
+    "local lhp = require 'http.parser'\n"
+    "local idle = {}\n"
+    "function idle.make(n, input, auto)\n"
+    "    local factory = lhp.factory{\n"
+    "        on_message = function() end,\n"
+    "        hibernate  = auto,\n"
+    "    }\n"
+    "    local parsers = {}\n"
+    "    for i = 1, n do\n"
+    "        local parser = factory:request()\n"
+    "        if parser:execute(input) ~= #input then\n"
+    "            error('parse error: ' .. select(2, parser:error()))\n"
+    "        end\n"
+    "        parsers[i] = parser\n"
+    "    end\n"
+    "    return parsers\n"
+    "end\n"
+    "function idle.sleep(parsers)\n"
+    "    for i = 1, #parsers do parsers[i]:hibernate() end\n"
+    "end\n"
+    "return idle\n";
+
+/* Number of idle parsers measured at scale 1. */
+#define BENCH_IDLE_PARSERS 10000
+
+/* The batch is this many connection buffers of 32 pipelined requests. */
+#define BENCH_BATCH_BUFFERS 256
+#define BENCH_BATCH_REPS    50
+
+typedef struct bench_scenario {
+    const char* name;
+    const char* type;       /* "request" or "response". */
+    int         reps;       /* repetitions at scale 1. */
+    void      (*build)(luaL_Buffer* b);
+    int         bytewise;   /* feed the input one byte at a time. */
+    int         lowercase;  /* set lowercase_headers. */
+    int         form;       /* decode the body with a query_decoder. */
+    int         lazy;       /* set lazy_headers. */
+} bench_scenario;
+
+static void build_small_get(luaL_Buffer* b) {
+    luaL_addstring(b,
+        "GET /index.html?q=1 HTTP/1.1\r\n"
+        "Host: www.example.com\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:60.0) Gecko/20100101 Firefox/60.0\r\n"
+        "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+        "Accept-Language: en-US,en;q=0.5\r\n"
+        "Accept-Encoding: gzip, deflate\r\n"
+        "Connection: keep-alive\r\n"
+        "\r\n");
+}
+
+static void build_large_cookie(luaL_Buffer* b) {
+    int i;
+    luaL_addstring(b,
+        "GET /account HTTP/1.1\r\n"
+        "Host: www.example.com\r\n"
+        "Cookie: ");
+    for ( i = 0; i < 64; i++ ) {
+        char pair[80];
+        sprintf(pair, "%stracking_id_%02d=0123456789abcdef0123456789abcdef0123456789",
+                i ? "; " : "", i);
+        luaL_addstring(b, pair);
+    }
+    luaL_addstring(b, "\r\n\r\n");
+}
+
+static void build_chunked_response(luaL_Buffer* b) {
+    int i, j;
+    luaL_addstring(b,
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: application/json\r\n"
+        "Transfer-Encoding: chunked\r\n"
+        "\r\n");
+    for ( i = 0; i < 16; i++ ) {
+        luaL_addstring(b, "400\r\n");
+        for ( j = 0; j < 1024 / 16; j++ ) {
+            luaL_addstring(b, "0123456789abcdef");
+        }
+        luaL_addstring(b, "\r\n");
+    }
+    luaL_addstring(b, "0\r\n\r\n");
+}
+
+static void build_pipelined(luaL_Buffer* b) {
+    int i;
+    for ( i = 0; i < 32; i++ ) {
+        luaL_addstring(b,
+            "GET /api/items/42 HTTP/1.1\r\n"
+            "Host: api.example.com\r\n"
+            "Accept: */*\r\n"
+            "\r\n");
+    }
+}
+
+static void build_many_headers(luaL_Buffer* b) {
+    int i;
+    luaL_addstring(b, "GET /api/items HTTP/1.1\r\n");
+    for ( i = 0; i < 32; i++ ) {
+        char header[80];
+        sprintf(header, "X-Forwarded-Application-Trace-Header-%02d: %d\r\n", i, i);
+        luaL_addstring(b, header);
+    }
+    luaL_addstring(b, "\r\n");
+}
+
+static void build_form_post(luaL_Buffer* b) {
+    char head[128];
+    int  i;
+    /* 128 fields of 64 bytes. */
+    sprintf(head,
+            "POST /submit HTTP/1.1\r\n"
+            "Content-Type: application/x-www-form-urlencoded\r\n"
+            "Content-Length: %d\r\n"
+            "\r\n", 128 * 64);
+    luaL_addstring(b, head);
+    for ( i = 0; i < 128; i++ ) {
+        char field[65];
+        sprintf(field, "field_%03d=some+value+with+an+escaped%%2Fslash+and+some+more+text%s",
+                i, i == 127 ? "_" : "&");
+        luaL_addstring(b, field);
+    }
+}
+
+static const bench_scenario bench_scenarios[] = {
+    { "small_get",        "request",  20000, build_small_get,        0, 0, 0, 0 },
+    { "large_cookie",     "request",  10000, build_large_cookie,     0, 0, 0, 0 },
+    { "chunked_response", "response", 10000, build_chunked_response, 0, 0, 0, 0 },
+    { "pipelined",        "request",   2000, build_pipelined,        0, 0, 0, 0 },
+    { "fragmented",       "request",    500, build_small_get,        1, 0, 0, 0 },
+    { "many_headers",     "request",  10000, build_many_headers,     0, 1, 0, 0 },
+    { "form_post",        "request",   5000, build_form_post,        0, 0, 1, 0 },
+    { "lazy_headers",     "request",  10000, build_many_headers,     0, 0, 0, 1 },
+};
+
+/* Each scenario runs with every scanner the CPU supports. */
+static const char* bench_scanners[] = { "scalar", "sse2", "avx2" };
+
+/* Push the chunks array of scenario and return the input length. */
+static size_t bench_push_chunks(lua_State* L, const bench_scenario* scenario) {
+    luaL_Buffer b;
+    const char* str;
+    size_t      len;
+    size_t      i;
+
+    lua_newtable(L);
+    luaL_buffinit(L, &b);
+    scenario->build(&b);
+    luaL_pushresult(&b);
+    str = lua_tolstring(L, -1, &len);
+    if ( scenario->bytewise ) {
+        for ( i = 0; i < len; i++ ) {
+            lua_pushlstring(L, str + i, 1);
+            lua_rawseti(L, -3, (int)i + 1);
+        }
+        lua_pop(L, 1);
+    } else {
+        lua_rawseti(L, -2, 1);
+    }
+    return len;
+}
+
+static int bench_run(lua_State* L, bench_alloc* counts, const bench_scenario* scenario,
+                     const char* scanner, double scale, const char* revision) {
+    int         reps = (int)(scenario->reps * scale);
+    size_t      len;
+    size_t      count;
+    size_t      bytes;
+    double      start, elapsed;
+    double      messages, events;
+
+    if ( reps < 1 ) reps = 1;
+
+    lua_pushvalue(L, 1); /* the driver */
+    lua_pushstring(L, scenario->type);
+    len = bench_push_chunks(L, scenario);
+    lua_pushinteger(L, reps);
+    lua_pushstring(L, scanner);
+    lua_pushboolean(L, scenario->lowercase);
+    lua_pushboolean(L, scenario->form);
+    lua_pushboolean(L, scenario->lazy);
+
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    count = counts->count;
+    bytes = counts->bytes;
+    start = bench_now();
+
+    if ( 0 != lua_pcall(L, 7, 2, 0) ) {
+        fprintf(stderr, "%s: %s\n", scenario->name, lua_tostring(L, -1));
+        lua_pop(L, 1);
+        return 1;
+    }
+
+    elapsed  = bench_now() - start;
+    count    = counts->count - count;
+    bytes    = counts->bytes - bytes;
+    if ( lua_isnil(L, -2) ) {
+        /* The scanner is not supported. */
+        lua_pop(L, 2);
+        return 0;
+    }
+    messages = lua_tonumber(L, -2);
+    events   = lua_tonumber(L, -1);
+    lua_pop(L, 2);
+
+    if ( messages < 1 ) messages = 1;
+    printf("{\"revision\":\"%s\",\"scenario\":\"%s\",\"scanner\":\"%s\",\"reps\":%d,"
+           "\"seconds\":%.6f,\"mb_per_sec\":%.3f,\"messages_per_sec\":%.1f,"
+           "\"events_per_sec\":%.1f,\"allocs_per_message\":%.3f,"
+           "\"alloc_bytes_per_message\":%.1f}\n",
+           revision, scenario->name, scanner, reps, elapsed,
+           (double)len * reps / elapsed / (1024 * 1024),
+           messages / elapsed, events / elapsed,
+           count / messages, bytes / messages);
+    fflush(stdout);
+    return 0;
+}
+
+/* Push the buffers array of the batch scenario and return its length
+ * in bytes.
+ */
+static size_t bench_push_batch(lua_State* L) {
+    size_t total = 0;
+    int    i, j;
+
+    lua_createtable(L, BENCH_BATCH_BUFFERS, 0);
+    for ( i = 0; i < BENCH_BATCH_BUFFERS; i++ ) {
+        luaL_Buffer b;
+        luaL_buffinit(L, &b);
+        for ( j = 0; j < 32; j++ ) {
+            char request[128];
+            sprintf(request,
+                    "GET /api/connections/%d/items/%d HTTP/1.1\r\n"
+                    "Host: api.example.com\r\n"
+                    "Accept: */*\r\n"
+                    "\r\n", i, j);
+            luaL_addstring(&b, request);
+        }
+        luaL_pushresult(&b);
+        total += lua_objlen(L, -1);
+        lua_rawseti(L, -2, i + 1);
+    }
+    return total;
+}
+
+/* Time parse_batch() with threads threads.  The driver is at idx.
+ * Stores the seconds taken in *elapsed.
+ */
+static int bench_run_batch(lua_State* L, int idx, int threads, double scale,
+                           const char* revision, double* elapsed) {
+    int    reps = (int)(BENCH_BATCH_REPS * scale);
+    size_t len;
+    double start;
+    double messages;
+
+    if ( reps < 1 ) reps = 1;
+
+    lua_pushvalue(L, idx);
+    len = bench_push_batch(L);
+    lua_pushinteger(L, reps);
+    lua_pushinteger(L, threads);
+
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    start = bench_now();
+    if ( 0 != lua_pcall(L, 3, 1, 0) ) {
+        fprintf(stderr, "batch: %s\n", lua_tostring(L, -1));
+        lua_pop(L, 1);
+        return 1;
+    }
+    *elapsed = bench_now() - start;
+    messages = lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    printf("{\"revision\":\"%s\",\"scenario\":\"batch\",\"threads\":%d,"
+           "\"buffers\":%d,\"reps\":%d,\"seconds\":%.6f,\"mb_per_sec\":%.3f,"
+           "\"messages_per_sec\":%.1f}\n",
+           revision, threads, BENCH_BATCH_BUFFERS, reps, *elapsed,
+           (double)len * reps / *elapsed / (1024 * 1024), messages / *elapsed);
+    fflush(stdout);
+    return 0;
+}
+
+/* Bytes allocated by L after a full garbage collection. */
+static size_t bench_live(lua_State* L, const bench_alloc* counts) {
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    return counts->live;
+}
+
+/* Measure the bytes held per idle keep-alive parser that parsed a
+ * request with a large cookie and body: as it is, after hibernate()
+ * and with the hibernate option.  The idle module is at idx.
+ */
+static int bench_run_idle(lua_State* L, int idx, const bench_alloc* counts, double scale,
+                          const char* revision) {
+    int    n = (int)(BENCH_IDLE_PARSERS * scale);
+    size_t base, awake, hibernated, automatic;
+
+    if ( n < 1 ) n = 1;
+
+    lua_pushstring(L,
+        "POST /upload HTTP/1.1\r\n"
+        "Host: www.example.com\r\n"
+        "Content-Type: application/octet-stream\r\n"
+        "Content-Length: 2048\r\n");
+    {
+        luaL_Buffer b;
+        int         i;
+        luaL_buffinit(L, &b);
+        luaL_addstring(&b, "Cookie: ");
+        for ( i = 0; i < 2048; i++ ) luaL_addchar(&b, 'c');
+        luaL_addstring(&b, "\r\n\r\n");
+        for ( i = 0; i < 2048; i++ ) luaL_addchar(&b, 'b');
+        luaL_pushresult(&b);
+    }
+    lua_concat(L, 2);
+    /* Stack: input */
+
+    base = bench_live(L, counts);
+    lua_getfield(L, idx, "make");
+    lua_pushinteger(L, n);
+    lua_pushvalue(L, -3);
+    lua_pushboolean(L, 0);
+    if ( 0 != lua_pcall(L, 3, 1, 0) ) goto fail;
+    awake = bench_live(L, counts) - base;
+
+    lua_getfield(L, idx, "sleep");
+    lua_pushvalue(L, -2);
+    if ( 0 != lua_pcall(L, 1, 0, 0) ) goto fail;
+    hibernated = bench_live(L, counts) - base;
+    lua_pop(L, 1);
+
+    base = bench_live(L, counts);
+    lua_getfield(L, idx, "make");
+    lua_pushinteger(L, n);
+    lua_pushvalue(L, -3);
+    lua_pushboolean(L, 1);
+    if ( 0 != lua_pcall(L, 3, 1, 0) ) goto fail;
+    automatic = bench_live(L, counts) - base;
+    lua_pop(L, 2);
+
+    printf("{\"revision\":\"%s\",\"scenario\":\"idle\",\"parsers\":%d,"
+           "\"bytes_per_parser\":%.1f,\"bytes_per_parser_hibernated\":%.1f,"
+           "\"bytes_per_parser_auto\":%.1f}\n",
+           revision, n, (double)awake / n, (double)hibernated / n, (double)automatic / n);
+    fflush(stdout);
+    return 0;
+
+fail:
+    fprintf(stderr, "idle: %s\n", lua_tostring(L, -1));
+    lua_settop(L, idx);
+    return 1;
+}
+
+int main(int argc, char** argv) {
+    bench_alloc counts = { 0, 0, 0 };
+    double      scale = argc > 1 ? atof(argv[1]) : 1.0;
+    int         failed = 0;
+    size_t      i, j;
+    const char* revision = LHP_BENCH_REVISION;
+    lua_State*  L = lua_newstate(bench_allocf, &counts);
+
+    if ( NULL == L ) {
+        fprintf(stderr, "cannot create the Lua state\n");
+        return 1;
+    }
+    if ( scale <= 0 ) scale = 1.0;
+    if ( NULL != getenv("LHP_BENCH_REVISION") ) {
+        revision = getenv("LHP_BENCH_REVISION");
+    }
+
+    luaL_openlibs(L);
+
+    /* Make require 'http.parser' load the linked in module. */
+    lua_getglobal(L, "package");
+    lua_getfield(L, -1, "preload");
+    lua_pushcfunction(L, luaopen_http_parser);
+    lua_setfield(L, -2, "http.parser");
+    lua_pop(L, 2);
+
+    if ( 0 != luaL_loadstring(L, bench_driver_lua) ||
+         0 != lua_pcall(L, 0, 1, 0) ) {
+        fprintf(stderr, "%s\n", lua_tostring(L, -1));
+        lua_close(L);
+        return 1;
+    }
+
+    for ( i = 0; i < sizeof(bench_scenarios)/sizeof(*bench_scenarios); i++ ) {
+        for ( j = 0; j < sizeof(bench_scanners)/sizeof(*bench_scanners); j++ ) {
+            failed |= bench_run(L, &counts, &bench_scenarios[i], bench_scanners[j],
+                                scale, revision);
+        }
+    }
+
+    /* 1, 2, 4, ... threads and then all of the CPUs. */
+    if ( 0 != luaL_loadstring(L, bench_batch_lua) ||
+         0 != lua_pcall(L, 0, 1, 0) ) {
+        fprintf(stderr, "%s\n", lua_tostring(L, -1));
+        lua_close(L);
+        return 1;
+    }
+    {
+        int    cpus = lhp_batch_cpus();
+        int    threads;
+        double elapsed;
+
+        for ( threads = 1; ; threads *= 2 ) {
+            if ( threads > cpus ) threads = cpus;
+            failed |= bench_run_batch(L, lua_gettop(L), threads, scale, revision, &elapsed);
+            if ( threads == cpus ) break;
+        }
+    }
+
+    if ( 0 != luaL_loadstring(L, bench_idle_lua) ||
+         0 != lua_pcall(L, 0, 1, 0) ) {
+        fprintf(stderr, "%s\n", lua_tostring(L, -1));
+        lua_close(L);
+        return 1;
+    }
+    failed |= bench_run_idle(L, lua_gettop(L), &counts, scale, revision);
+
+    lua_close(L);
+    return failed;
+}
@@ -1,6 +1,6 @@
 #!/usr/bin/env lua
-local socket = require"socket"
-local time = socket.gettime
+local has_socket, socket = pcall(require, "socket")
+local time = has_socket and socket.gettime or os.clock
 local clock = os.clock
 local quiet = false
 local disable_gc = true
@@ -180,6 +180,62 @@ local function init_parser(reqs)
     return parser
 end
 
+-- Same as init_parser(), but dispatches execute_into() records in a
+-- flat loop instead of having the parser call closures.
+local function init_events_parser(reqs)
+    local ev = lhp.events
+    local ON_MESSAGE_BEGIN, ON_URL, ON_HEADER = ev.on_message_begin, ev.on_url, ev.on_header
+    local ON_HEADERS_COMPLETE, ON_BODY = ev.on_headers_complete, ev.on_body
+    local ON_MESSAGE_COMPLETE = ev.on_message_complete
+    local events = {}
+    local cur    = nil
+    local parser = lhp.request{}
+
+    local wrapper = {}
+    function wrapper:execute(data)
+        local bytes_read, count = parser:execute_into(data, events)
+        for i=1, count * 3, 3 do
+            local code, arg1, arg2 = events[i], events[i+1], events[i+2]
+            if code == ON_HEADER then
+                cur.headers[arg1] = arg2
+            elseif code == ON_BODY then
+                if not cur.body then
+                    cur.body = arg1
+                elseif nil ~= arg1 then
+                    cur.body = cur.body .. arg1
+                end
+            elseif code == ON_URL then
+                cur.url = arg1
+                cur.path, cur.query_string, cur.fragment = parse_path_query_fragment(arg1)
+            elseif code == ON_MESSAGE_BEGIN then
+                assert(cur == nil)
+                cur = { headers = {} }
+            elseif code == ON_HEADERS_COMPLETE then
+                cur.method = parser:method()
+            elseif code == ON_MESSAGE_COMPLETE then
+                assert(nil ~= cur)
+                if reqs then table.insert(reqs, cur) end
+                cur = nil
+            end
+        end
+        return bytes_read
+    end
+    function wrapper:reset()
+        parser:reset()
+    end
+    return wrapper
+end
+
+-- Same as init_parser(), but the parser builds the request table.
+local function init_message_parser(reqs)
+    local cb = {}
+    function cb.on_message(msg)
+        msg.path, msg.query_string, msg.fragment = parse_path_query_fragment(msg.url)
+        if reqs then table.insert(reqs, msg) end
+    end
+    return lhp.request(cb)
+end
+
 local function null_cb()
 end
 local null_cbs = {
@@ -242,11 +298,11 @@ local function apply_client(N, client, parser, requests)
     end
 end
 
-local function apply_client_memtest(name, client, N)
+local function apply_client_memtest(name, client, init, N)
     local start_mem, end_mem
     
     local reqs = {}
-    local parser = init_parser(reqs)
+    local parser = init(reqs)
     full_gc()
     start_mem = (collectgarbage"count" * 1024)
     --print(name, 'start memory size: ', start_mem)
@@ -272,10 +328,10 @@ local function apply_client_memtest(name, client, N)
     full_gc()
 end
 
-local function apply_client_speedtest(name, client, N)
+local function apply_client_speedtest(name, client, init, N)
     local start_mem, end_mem
  
-    local parser = init_parser()
+    local parser = init()
     full_gc()
     start_mem = (collectgarbage"count" * 1024)
     --print(name, 'start memory size: ', start_mem)
@@ -293,7 +349,12 @@ local function apply_client_speedtest(name, client, N)
     full_gc()
 end
 
-local function per_parser_overhead(N)
+local null_factory = lhp.factory(null_cbs)
+local function init_factory_parser()
+    return null_factory:request()
+end
+
+local function per_parser_overhead(name, init, N)
     local start_mem, end_mem
     local parsers = {}
  
@@ -304,34 +365,116 @@ local function per_parser_overhead(N)
     full_gc()
     start_mem = (collectgarbage"count" * 1024)
     --print('overhead: start memory size: ', start_mem)
+    if disable_gc then collectgarbage"stop" end
+    local start = time()
     for i=1,N do
-        parsers[i] = init_null_parser()
+        parsers[i] = init()
     end
+    local diff = time() - start
+    collectgarbage"restart"
     full_gc()
     end_mem = (collectgarbage"count" * 1024)
     --print('overhead: end   memory size: ', end_mem)
-    print('overhead: total memory used: ', (end_mem - start_mem) / N, ' bytes per parser')
+    printf('overhead: %s: %.1f bytes, %.1f ns per parser',
+        name, (end_mem - start_mem) / N, diff * 1e9 / N)
    
     parsers = nil
     full_gc()
 end
 
+-- Feed each request one byte at a time and report how much Lua memory
+-- the parser allocates per request.  With GC stopped every fragment
+-- buffered as a Lua string would show up here.
+local function fragmented_alloc(N)
+    local start_mem, end_mem
+    local bytes = {}
+
+    for x=1,#data_list do
+        local data = tconcat(data_list[x])
+        for i=1,#data do
+            bytes[#bytes+1] = data:sub(i,i)
+        end
+    end
+    local parser = init_null_parser()
+
+    full_gc()
+    collectgarbage"stop"
+    start_mem = (collectgarbage"count" * 1024)
+    for i=1,N do
+        for x=1,#bytes do
+            parser:execute(bytes[x])
+        end
+        parser:reset()
+    end
+    end_mem = (collectgarbage"count" * 1024)
+    collectgarbage"restart"
+    printf('fragmented: N=%d, %.1f input bytes, %.1f Lua bytes allocated per request',
+        N, #bytes / #data_list, (end_mem - start_mem) / (N * #data_list))
+    print()
+
+    parser = nil
+    full_gc()
+end
+
+-- Parse reads holding `depth` pipelined requests each, once through
+-- the callbacks and once with execute_all().
+local function pipelined(N, depth)
+    local read = string.rep(tconcat(requests.httperf), depth)
+    local msgs = {}
+    local count = 0
+
+    local parser = lhp.request{
+        on_message_complete = function() count = count + 1 end,
+    }
+    local diff1, diff2 = bench('pipelined callbacks', N, function(N)
+        for i=1,N do parser:execute(read) end
+    end)
+    assert(count == N * depth)
+    printf("requests/sec: %10.1f (%10.1f) requests/sec", N*depth/diff1, N*depth/diff2)
+
+    parser = lhp.request{}
+    count = 0
+    diff1, diff2 = bench('pipelined execute_all', N, function(N)
+        for i=1,N do
+            local _, got = parser:execute_all(read, msgs)
+            count = count + #got
+        end
+    end)
+    assert(count == N * depth)
+    printf("requests/sec: %10.1f (%10.1f) requests/sec", N*depth/diff1, N*depth/diff2)
+    print()
+
+    full_gc()
+end
+
 local clients = {
-    good = { cb = good_client, mem_N=1, speed_N=N*10},
-    bad = { cb = bad_client, mem_N=1, speed_N=N},
+    good = { cb = good_client, init = init_parser, mem_N=1, speed_N=N*10},
+    bad = { cb = bad_client, init = init_parser, mem_N=1, speed_N=N},
+    good_events = { cb = good_client, init = init_events_parser, mem_N=1, speed_N=N*10},
+    bad_events = { cb = bad_client, init = init_events_parser, mem_N=1, speed_N=N},
+    good_message = { cb = good_client, init = init_message_parser, mem_N=1, speed_N=N*10},
+    bad_message = { cb = bad_client, init = init_message_parser, mem_N=1, speed_N=N},
 }
 
 print('memory test')
 for name,client in pairs(clients) do
-    apply_client_memtest(name, client.cb, client.mem_N)
+    apply_client_memtest(name, client.cb, client.init, client.mem_N)
 end
 
 print('speed test')
 for name,client in pairs(clients) do
-    apply_client_speedtest(name, client.cb, client.speed_N)
+    apply_client_speedtest(name, client.cb, client.init, client.speed_N)
 end
 
 print('overhead test')
-per_parser_overhead(N)
+per_parser_overhead('request', init_null_parser, N)
+per_parser_overhead('factory', init_factory_parser, N)
+print()
+
+print('fragmented allocation test')
+fragmented_alloc(math.floor(N / 10))
+
+print('pipelined test')
+pipelined(N, 32)
 
 
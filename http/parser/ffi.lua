@@ -0,0 +1,147 @@
+-- LuaJIT FFI binding to the raw C interface of http.parser (lhp-raw.h).
+--
+-- Parses straight from a (const char*, size_t) buffer, e.g. one filled
+-- by a socket read into cdata, without creating Lua strings.  Events
+-- are written into an array of (type, in_buffer, offset, length)
+-- records that is reused for every call.
+
+local ffi = require 'ffi'
+require 'http.parser' -- make sure the module is loaded
+
+ffi.cdef[[
+typedef struct lhp_raw_event {
+    uint32_t    type;
+    uint32_t    in_buffer;
+    size_t      offset;
+    size_t      length;
+} lhp_raw_event;
+
+typedef struct lhp_raw_parser lhp_raw_parser;
+
+lhp_raw_parser* lhp_raw_new(int response);
+void            lhp_raw_free(lhp_raw_parser* parser);
+void            lhp_raw_reset(lhp_raw_parser* parser);
+size_t          lhp_raw_execute(lhp_raw_parser* parser, const char* data, size_t len,
+                                lhp_raw_event* events, size_t nevents, size_t* count);
+const char*     lhp_raw_buffer(const lhp_raw_parser* parser);
+int             lhp_raw_errno(const lhp_raw_parser* parser);
+const char*     lhp_raw_errno_name(const lhp_raw_parser* parser);
+const char*     lhp_raw_method(const lhp_raw_parser* parser);
+int             lhp_raw_status_code(const lhp_raw_parser* parser);
+int             lhp_raw_http_major(const lhp_raw_parser* parser);
+int             lhp_raw_http_minor(const lhp_raw_parser* parser);
+int             lhp_raw_should_keep_alive(const lhp_raw_parser* parser);
+int             lhp_raw_is_upgrade(const lhp_raw_parser* parser);
+]]
+
+-- The symbols live in the http.parser shared library, or in the
+-- executable if the module was linked in statically.
+local function load_lib()
+    local path = package.searchpath and package.searchpath('http.parser', package.cpath)
+    if path then
+        local ok, lib = pcall(ffi.load, path)
+        if ok then return lib end
+    end
+    return ffi.C
+end
+
+local C = load_lib()
+
+local M = {
+    MESSAGE_BEGIN    = 1,
+    URL              = 2,
+    STATUS           = 3,
+    HEADER_FIELD     = 4,
+    HEADER_VALUE     = 5,
+    HEADERS_COMPLETE = 6,
+    BODY             = 7,
+    MESSAGE_COMPLETE = 8,
+    CHUNK_HEADER     = 9,
+    CHUNK_COMPLETE   = 10,
+}
+
+local DEFAULT_MAX_EVENTS = 256
+
+local parser = {}
+parser.__index = parser
+
+local function new(response, max_events)
+    max_events = max_events or DEFAULT_MAX_EVENTS
+    assert(max_events >= 2, "max_events must be at least 2")
+    local raw = C.lhp_raw_new(response)
+    if raw == nil then error("out of memory") end
+    return setmetatable({
+        raw        = ffi.gc(raw, C.lhp_raw_free),
+        events     = ffi.new("lhp_raw_event[?]", max_events),
+        max_events = max_events,
+        count_box  = ffi.new("size_t[1]"),
+        data       = nil,
+    }, parser)
+end
+
+-- parser = ffi_parser.request([max_events])
+function M.request(max_events)
+    return new(0, max_events)
+end
+
+-- parser = ffi_parser.response([max_events])
+function M.response(max_events)
+    return new(1, max_events)
+end
+
+-- bytes_read, count = parser:execute(ptr, len)
+--
+-- ptr may be a Lua string or any cdata convertible to const char*.
+-- parser.events[0] .. parser.events[count - 1] hold the events.
+function parser:execute(ptr, len)
+    len = len or #ptr
+    self.data = ptr -- keep it alive for parser:string()
+    local n = C.lhp_raw_execute(self.raw, ptr, len, self.events, self.max_events, self.count_box)
+    return tonumber(n), tonumber(self.count_box[0])
+end
+
+-- Pointer to the bytes of event i.
+function parser:pointer(i)
+    local ev = self.events[i]
+    if ev.in_buffer ~= 0 then
+        return C.lhp_raw_buffer(self.raw) + ev.offset
+    end
+    return ffi.cast("const char*", self.data) + ev.offset
+end
+
+-- Copy the bytes of event i into a Lua string.
+function parser:string(i)
+    return ffi.string(self:pointer(i), self.events[i].length)
+end
+
+function parser:reset()
+    C.lhp_raw_reset(self.raw)
+    self.data = nil
+end
+
+function parser:error()
+    local errno = C.lhp_raw_errno(self.raw)
+    return errno, ffi.string(C.lhp_raw_errno_name(self.raw))
+end
+
+function parser:method()
+    return ffi.string(C.lhp_raw_method(self.raw))
+end
+
+function parser:status_code()
+    return C.lhp_raw_status_code(self.raw)
+end
+
+function parser:version()
+    return C.lhp_raw_http_major(self.raw), C.lhp_raw_http_minor(self.raw)
+end
+
+function parser:should_keep_alive()
+    return C.lhp_raw_should_keep_alive(self.raw) ~= 0
+end
+
+function parser:is_upgrade()
+    return C.lhp_raw_is_upgrade(self.raw) ~= 0
+end
+
+return M
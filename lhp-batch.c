@@ -0,0 +1,341 @@
+/* Implementation of lhp-batch.h, see there for the interface.
+ */
+#include <stdlib.h>
+#include <string.h>
+#if !defined(_WIN32) && !defined(LHP_NO_THREADS)
+#define LHP_THREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
+#include "lhp-batch.h"
+#include "http-parser/http_parser.h"
+
+/* The http_parser of one item, which its callbacks get. */
+typedef struct lhp_batch_parser {
+    http_parser     parser;     /* embedded http_parser. */
+    lhp_batch_item* item;
+    int             failed;     /* a record could not be allocated. */
+} lhp_batch_parser;
+
+/* Make room for one more element of size in the array at *ptr holding
+ * len of cap.  Returns -1 if out of memory.
+ */
+static int lhp_batch_grow(void** ptr, size_t len, size_t* cap, size_t size) {
+    size_t new_cap;
+    void*  data;
+
+    if ( len < *cap ) return 0;
+    new_cap = *cap ? *cap * 2 : 16;
+    data    = realloc(*ptr, new_cap * size);
+    if ( NULL == data ) return -1;
+    *ptr = data;
+    *cap = new_cap;
+    return 0;
+}
+
+static lhp_batch_message* lhp_batch_current(lhp_batch_parser* p) {
+    return &(p->item->messages[p->item->nmessages - 1]);
+}
+
+static int lhp_batch_message_begin_cb(http_parser* parser) {
+    lhp_batch_parser*  p = (lhp_batch_parser*)parser;
+    lhp_batch_item*    item = p->item;
+    lhp_batch_message* m;
+
+    if ( 0 != lhp_batch_grow((void**)&(item->messages), item->nmessages,
+                             &(item->messages_cap), sizeof(lhp_batch_message)) ) {
+        p->failed = 1;
+        return -1;
+    }
+    m = &(item->messages[item->nmessages++]);
+    memset(m, 0, sizeof(lhp_batch_message));
+    m->first_event = item->nevents;
+    return 0;
+}
+
+/* Record the piece str of the type token, merged with the previous
+ * record if it continues it.
+ */
+static int lhp_batch_data_cb(http_parser* parser, uint32_t type, const char* str, size_t len) {
+    lhp_batch_parser* p = (lhp_batch_parser*)parser;
+    lhp_batch_item*   item = p->item;
+    size_t            offset = str - item->data;
+    lhp_raw_event*    ev;
+
+    if ( item->nevents > lhp_batch_current(p)->first_event ) {
+        ev = &(item->events[item->nevents - 1]);
+        if ( type == ev->type && ev->offset + ev->length == offset ) {
+            ev->length += len;
+            return 0;
+        }
+    }
+    if ( 0 != lhp_batch_grow((void**)&(item->events), item->nevents,
+                             &(item->events_cap), sizeof(lhp_raw_event)) ) {
+        p->failed = 1;
+        return -1;
+    }
+    ev = &(item->events[item->nevents++]);
+    ev->type      = type;
+    ev->in_buffer = 0;
+    ev->offset    = offset;
+    ev->length    = len;
+    return 0;
+}
+
+static int lhp_batch_url_cb(http_parser* parser, const char* str, size_t len) {
+    return lhp_batch_data_cb(parser, LHP_RAW_URL, str, len);
+}
+
+static int lhp_batch_status_cb(http_parser* parser, const char* str, size_t len) {
+    return lhp_batch_data_cb(parser, LHP_RAW_STATUS, str, len);
+}
+
+static int lhp_batch_header_field_cb(http_parser* parser, const char* str, size_t len) {
+    return lhp_batch_data_cb(parser, LHP_RAW_HEADER_FIELD, str, len);
+}
+
+static int lhp_batch_header_value_cb(http_parser* parser, const char* str, size_t len) {
+    return lhp_batch_data_cb(parser, LHP_RAW_HEADER_VALUE, str, len);
+}
+
+static int lhp_batch_body_cb(http_parser* parser, const char* str, size_t len) {
+    return lhp_batch_data_cb(parser, LHP_RAW_BODY, str, len);
+}
+
+static int lhp_batch_headers_complete_cb(http_parser* parser) {
+    lhp_batch_message* m = lhp_batch_current((lhp_batch_parser*)parser);
+
+    m->method      = parser->method;
+    m->status_code = parser->status_code;
+    m->http_major  = parser->http_major;
+    m->http_minor  = parser->http_minor;
+    m->upgrade     = parser->upgrade;
+    return 0;
+}
+
+/* Pause so lhp_batch_parse() learns where the message ends. */
+static int lhp_batch_message_complete_cb(http_parser* parser) {
+    lhp_batch_parser*  p = (lhp_batch_parser*)parser;
+    lhp_batch_message* m = lhp_batch_current(p);
+
+    m->keep_alive = http_should_keep_alive(parser);
+    m->nevents    = p->item->nevents - m->first_event;
+    http_parser_pause(parser, 1);
+    return 0;
+}
+
+static const http_parser_settings lhp_batch_settings = {
+    lhp_batch_message_begin_cb,
+    lhp_batch_url_cb,
+    lhp_batch_status_cb,
+    lhp_batch_header_field_cb,
+    lhp_batch_header_value_cb,
+    lhp_batch_headers_complete_cb,
+    lhp_batch_body_cb,
+    lhp_batch_message_complete_cb,
+    NULL,
+    NULL
+};
+
+/* Parse the complete messages of item.  An unfinished message at the
+ * end is dropped, bytes_read tells where it starts.
+ */
+static void lhp_batch_parse(lhp_batch_item* item, int response) {
+    lhp_batch_parser p;
+    size_t           pos = 0;
+
+    item->bytes_read = 0;
+    item->http_errno = HPE_OK;
+    item->nmessages  = 0;
+    item->nevents    = 0;
+
+    http_parser_init(&(p.parser), response ? HTTP_RESPONSE : HTTP_REQUEST);
+    p.item   = item;
+    p.failed = 0;
+
+    while ( pos < item->len ) {
+        pos += http_parser_execute(&(p.parser), &lhp_batch_settings,
+                                   item->data + pos, item->len - pos);
+        if ( HPE_PAUSED != HTTP_PARSER_ERRNO(&(p.parser)) ) {
+            item->http_errno = p.failed ? HPE_UNKNOWN : HTTP_PARSER_ERRNO(&(p.parser));
+            break;
+        }
+        /* A message is complete. */
+        http_parser_pause(&(p.parser), 0);
+        lhp_batch_current(&p)->end = pos;
+        item->bytes_read = pos;
+        /* The rest is not HTTP. */
+        if ( p.parser.upgrade ) break;
+    }
+
+    /* Drop the unfinished message. */
+    if ( item->nmessages && 0 == lhp_batch_current(&p)->end ) {
+        item->nevents = lhp_batch_current(&p)->first_event;
+        item->nmessages--;
+    }
+}
+
+void lhp_batch_item_free(lhp_batch_item* item) {
+    free(item->messages);
+    free(item->events);
+    item->messages     = NULL;
+    item->nmessages    = 0;
+    item->messages_cap = 0;
+    item->events       = NULL;
+    item->nevents      = 0;
+    item->events_cap   = 0;
+}
+
+#ifdef LHP_THREADS
+struct lhp_batch_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t  work;       /* a batch was posted, or stop was set. */
+    pthread_cond_t  done;       /* a worker left the batch. */
+    pthread_t       threads[LHP_BATCH_MAX_THREADS - 1];
+    int             nthreads;
+    int             stop;
+    /* The current batch, guarded by lock. */
+    unsigned        generation; /* incremented for every batch. */
+    lhp_batch_item* items;
+    size_t          nitems;
+    size_t          next;       /* next item to parse. */
+    int             response;
+    int             wanted;     /* workers the batch may use. */
+    int             joined;     /* workers that took part. */
+    int             active;     /* workers still parsing. */
+};
+
+/* Parse items of the current batch until there are none left.  Called
+ * and returns with the lock held.
+ */
+static void lhp_batch_work(lhp_batch_pool* pool) {
+    while ( pool->next < pool->nitems ) {
+        lhp_batch_item* item = &(pool->items[pool->next++]);
+        int             response = pool->response;
+
+        pthread_mutex_unlock(&(pool->lock));
+        lhp_batch_parse(item, response);
+        pthread_mutex_lock(&(pool->lock));
+    }
+}
+
+static void* lhp_batch_worker(void* arg) {
+    lhp_batch_pool* pool = (lhp_batch_pool*)arg;
+    unsigned        seen = 0; /* batches start at generation 1. */
+
+    pthread_mutex_lock(&(pool->lock));
+    for ( ;; ) {
+        while ( ! pool->stop &&
+                (seen == pool->generation || pool->joined >= pool->wanted) ) {
+            pthread_cond_wait(&(pool->work), &(pool->lock));
+        }
+        if ( pool->stop ) break;
+
+        seen = pool->generation;
+        pool->joined++;
+        pool->active++;
+        lhp_batch_work(pool);
+        if ( 0 == --pool->active ) pthread_cond_signal(&(pool->done));
+    }
+    pthread_mutex_unlock(&(pool->lock));
+    return NULL;
+}
+
+lhp_batch_pool* lhp_batch_pool_new(void) {
+    lhp_batch_pool* pool = (lhp_batch_pool*)calloc(1, sizeof(lhp_batch_pool));
+    if ( NULL == pool ) return NULL;
+    pthread_mutex_init(&(pool->lock), NULL);
+    pthread_cond_init(&(pool->work), NULL);
+    pthread_cond_init(&(pool->done), NULL);
+    return pool;
+}
+
+void lhp_batch_pool_free(lhp_batch_pool* pool) {
+    int i;
+
+    if ( NULL == pool ) return;
+    pthread_mutex_lock(&(pool->lock));
+    pool->stop = 1;
+    pthread_cond_broadcast(&(pool->work));
+    pthread_mutex_unlock(&(pool->lock));
+    for ( i = 0; i < pool->nthreads; i++ ) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_cond_destroy(&(pool->done));
+    pthread_cond_destroy(&(pool->work));
+    pthread_mutex_destroy(&(pool->lock));
+    free(pool);
+}
+
+void lhp_batch_run(lhp_batch_pool* pool, lhp_batch_item* items, size_t nitems,
+                   int response, int threads) {
+    size_t i;
+
+    if ( threads > LHP_BATCH_MAX_THREADS ) threads = LHP_BATCH_MAX_THREADS;
+    if ( (size_t)threads > nitems ) threads = (int)nitems;
+    if ( NULL == pool || threads <= 1 ) {
+        for ( i = 0; i < nitems; i++ ) lhp_batch_parse(&(items[i]), response);
+        return;
+    }
+
+    pthread_mutex_lock(&(pool->lock));
+    while ( pool->nthreads < threads - 1 ) {
+        if ( 0 != pthread_create(&(pool->threads[pool->nthreads]), NULL,
+                                 lhp_batch_worker, pool) ) {
+            break;
+        }
+        pool->nthreads++;
+    }
+
+    pool->generation++;
+    pool->items    = items;
+    pool->nitems   = nitems;
+    pool->next     = 0;
+    pool->response = response;
+    pool->wanted   = threads - 1;
+    pool->joined   = 0;
+    pthread_cond_broadcast(&(pool->work));
+
+    /* The calling thread takes part too. */
+    lhp_batch_work(pool);
+    while ( pool->active > 0 ) {
+        pthread_cond_wait(&(pool->done), &(pool->lock));
+    }
+
+    /* Workers that wake up late find nothing to do. */
+    pool->items  = NULL;
+    pool->nitems = 0;
+    pool->next   = 0;
+    pthread_mutex_unlock(&(pool->lock));
+}
+
+int lhp_batch_cpus(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+#else
+/* A placeholder, items are parsed by the calling thread. */
+struct lhp_batch_pool {
+    int         unused;
+};
+
+lhp_batch_pool* lhp_batch_pool_new(void) {
+    return (lhp_batch_pool*)calloc(1, sizeof(lhp_batch_pool));
+}
+
+void lhp_batch_pool_free(lhp_batch_pool* pool) {
+    free(pool);
+}
+
+void lhp_batch_run(lhp_batch_pool* pool, lhp_batch_item* items, size_t nitems,
+                   int response, int threads) {
+    size_t i;
+    (void)pool;
+    (void)threads;
+    for ( i = 0; i < nitems; i++ ) lhp_batch_parse(&(items[i]), response);
+}
+
+int lhp_batch_cpus(void) {
+    return 1;
+}
+#endif
@@ -0,0 +1,78 @@
+/* Parse many independent buffers at once on a pool of threads, for
+ * lhp.parse_batch().
+ *
+ * Nothing here touches a lua_State: each buffer gets its own
+ * http_parser and its messages are recorded as offsets and lengths
+ * into the buffer, which the caller turns into Lua tables once the
+ * whole batch is done.  Without pthreads (Windows, or -DLHP_NO_THREADS)
+ * the buffers are parsed one after another on the calling thread.
+ */
+#ifndef LHP_BATCH_H
+#define LHP_BATCH_H
+
+#include <stddef.h>
+#include "lhp-raw.h"
+
+/* Most threads a batch may use, the calling thread included. */
+#define LHP_BATCH_MAX_THREADS 64
+
+/* A complete message of a buffer.  Its URL (or STATUS), HEADER_FIELD,
+ * HEADER_VALUE and BODY tokens are the nevents records from
+ * first_event in the events of its item, with offsets into the
+ * buffer.  Adjacent pieces of a token are merged; the pieces of a
+ * chunked body and the lines of a folded header value are separate
+ * records.
+ */
+typedef struct lhp_batch_message {
+    int         method;     /* http_method of a request. */
+    int         status_code; /* of a response. */
+    int         http_major;
+    int         http_minor;
+    int         keep_alive;
+    int         upgrade;
+    size_t      first_event;
+    size_t      nevents;
+    size_t      end;        /* offset just past the message. */
+} lhp_batch_message;
+
+/* One buffer of a batch.  The caller sets data and len, the rest is
+ * filled by lhp_batch_run() and freed by lhp_batch_item_free().
+ */
+typedef struct lhp_batch_item {
+    const char*        data;
+    size_t             len;
+    size_t             bytes_read; /* end of the last complete message. */
+    int                http_errno; /* 0 unless parsing failed. */
+    lhp_batch_message* messages;
+    size_t             nmessages;
+    size_t             messages_cap;
+    lhp_raw_event*     events;
+    size_t             nevents;
+    size_t             events_cap;
+} lhp_batch_item;
+
+typedef struct lhp_batch_pool lhp_batch_pool;
+
+/* Returns a pool without threads, they are started as batches need
+ * them, or NULL if out of memory.
+ */
+lhp_batch_pool* lhp_batch_pool_new(void);
+
+/* Stop and join the threads and free the pool. */
+void lhp_batch_pool_free(lhp_batch_pool* pool);
+
+/* Parse the nitems buffers as requests, or responses if response is
+ * not 0, with up to threads threads including the calling one, which
+ * returns once all are parsed.  An item whose records could not be
+ * allocated fails with HPE_UNKNOWN.
+ */
+void lhp_batch_run(lhp_batch_pool* pool, lhp_batch_item* items, size_t nitems,
+                   int response, int threads);
+
+/* Free what lhp_batch_run() allocated for item. */
+void lhp_batch_item_free(lhp_batch_item* item);
+
+/* Number of online CPUs, at least 1. */
+int lhp_batch_cpus(void);
+
+#endif /* LHP_BATCH_H */
@@ -0,0 +1,257 @@
+/* Implementation of lhp-raw.h, see there for the interface.
+ */
+#define LHP_RAW_BUILD
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lhp-raw.h"
+#include "http-parser/http_parser.h"
+
+struct lhp_raw_parser {
+    http_parser    parser;      /* embedded http_parser. */
+    lhp_raw_event* events;      /* the caller's array during execute. */
+    size_t         nevents;
+    size_t         count;
+    const char*    input;       /* the data being executed. */
+    lhp_raw_event  pending;     /* the data token being collected, if type != 0. */
+    size_t         pending_end; /* where in input a piece must start to extend it. */
+    char*          buf;         /* split tokens. */
+    size_t         buf_len;
+    size_t         buf_cap;
+};
+
+static int lhp_raw_buf_append(lhp_raw_parser* p, const char* str, size_t len) {
+    if ( p->buf_cap - p->buf_len < len ) {
+        size_t cap = p->buf_cap ? p->buf_cap : 64;
+        char*  buf;
+        while ( cap - p->buf_len < len ) cap *= 2;
+        buf = (char*)realloc(p->buf, cap);
+        if ( NULL == buf ) return -1;
+        p->buf     = buf;
+        p->buf_cap = cap;
+    }
+    memcpy(p->buf + p->buf_len, str, len);
+    p->buf_len += len;
+    return 0;
+}
+
+/* Append a record, pausing the parser while there is not room for the
+ * records the next callback may add.
+ */
+static void lhp_raw_emit(lhp_raw_parser* p, uint32_t type, uint32_t in_buffer, size_t offset, size_t length) {
+    lhp_raw_event* ev = &(p->events[p->count++]);
+
+    assert(p->count <= p->nevents);
+
+    ev->type      = type;
+    ev->in_buffer = in_buffer;
+    ev->offset    = offset;
+    ev->length    = length;
+
+    if ( p->nevents - p->count < 2 && HPE_OK == HTTP_PARSER_ERRNO(&(p->parser)) ) {
+        http_parser_pause(&(p->parser), 1);
+    }
+}
+
+static void lhp_raw_finish_pending(lhp_raw_parser* p) {
+    if ( p->pending.type ) {
+        lhp_raw_emit(p, p->pending.type, p->pending.in_buffer,
+                     p->pending.offset, p->pending.length);
+        p->pending.type = 0;
+    }
+}
+
+static int lhp_raw_cb(http_parser* parser, uint32_t type) {
+    lhp_raw_parser* p = (lhp_raw_parser*)parser;
+    lhp_raw_finish_pending(p);
+    lhp_raw_emit(p, type, 0, 0, LHP_RAW_CHUNK_HEADER == type ?
+                 (size_t)parser->content_length : 0);
+    return 0;
+}
+
+/* Collect the piece str of the type token.  Only a piece that follows
+ * on directly extends the pending token, the lines of a folded header
+ * value are separate pieces with the line break between them.
+ */
+static int lhp_raw_data_cb(http_parser* parser, uint32_t type, const char* str, size_t len) {
+    lhp_raw_parser* p = (lhp_raw_parser*)parser;
+    size_t          offset = str - p->input;
+
+    if ( type == p->pending.type && offset == p->pending_end ) {
+        if ( p->pending.in_buffer ) {
+            if ( 0 != lhp_raw_buf_append(p, str, len) ) return -1;
+        }
+        p->pending.length += len;
+        p->pending_end    += len;
+        return 0;
+    }
+
+    lhp_raw_finish_pending(p);
+    p->pending.type      = type;
+    p->pending.in_buffer = 0;
+    p->pending.offset    = offset;
+    p->pending.length    = len;
+    p->pending_end       = offset + len;
+    return 0;
+}
+
+static int lhp_raw_message_begin_cb(http_parser* parser) {
+    return lhp_raw_cb(parser, LHP_RAW_MESSAGE_BEGIN);
+}
+
+static int lhp_raw_url_cb(http_parser* parser, const char* str, size_t len) {
+    return lhp_raw_data_cb(parser, LHP_RAW_URL, str, len);
+}
+
+static int lhp_raw_status_cb(http_parser* parser, const char* str, size_t len) {
+    return lhp_raw_data_cb(parser, LHP_RAW_STATUS, str, len);
+}
+
+static int lhp_raw_header_field_cb(http_parser* parser, const char* str, size_t len) {
+    return lhp_raw_data_cb(parser, LHP_RAW_HEADER_FIELD, str, len);
+}
+
+static int lhp_raw_header_value_cb(http_parser* parser, const char* str, size_t len) {
+    return lhp_raw_data_cb(parser, LHP_RAW_HEADER_VALUE, str, len);
+}
+
+static int lhp_raw_headers_complete_cb(http_parser* parser) {
+    return lhp_raw_cb(parser, LHP_RAW_HEADERS_COMPLETE);
+}
+
+static int lhp_raw_body_cb(http_parser* parser, const char* str, size_t len) {
+    lhp_raw_parser* p = (lhp_raw_parser*)parser;
+    lhp_raw_finish_pending(p);
+    lhp_raw_emit(p, LHP_RAW_BODY, 0, str - p->input, len);
+    return 0;
+}
+
+static int lhp_raw_message_complete_cb(http_parser* parser) {
+    return lhp_raw_cb(parser, LHP_RAW_MESSAGE_COMPLETE);
+}
+
+static int lhp_raw_chunk_header_cb(http_parser* parser) {
+    return lhp_raw_cb(parser, LHP_RAW_CHUNK_HEADER);
+}
+
+static int lhp_raw_chunk_complete_cb(http_parser* parser) {
+    return lhp_raw_cb(parser, LHP_RAW_CHUNK_COMPLETE);
+}
+
+static const http_parser_settings lhp_raw_settings = {
+    lhp_raw_message_begin_cb,
+    lhp_raw_url_cb,
+    lhp_raw_status_cb,
+    lhp_raw_header_field_cb,
+    lhp_raw_header_value_cb,
+    lhp_raw_headers_complete_cb,
+    lhp_raw_body_cb,
+    lhp_raw_message_complete_cb,
+    lhp_raw_chunk_header_cb,
+    lhp_raw_chunk_complete_cb
+};
+
+LHP_RAW_API lhp_raw_parser* lhp_raw_new(int response) {
+    lhp_raw_parser* p = (lhp_raw_parser*)calloc(1, sizeof(lhp_raw_parser));
+    if ( NULL == p ) return NULL;
+    http_parser_init(&(p->parser), response ? HTTP_RESPONSE : HTTP_REQUEST);
+    return p;
+}
+
+LHP_RAW_API void lhp_raw_free(lhp_raw_parser* p) {
+    if ( NULL == p ) return;
+    free(p->buf);
+    free(p);
+}
+
+LHP_RAW_API void lhp_raw_reset(lhp_raw_parser* p) {
+    http_parser_init(&(p->parser), (enum http_parser_type)p->parser.type);
+    p->pending.type = 0;
+    p->buf_len      = 0;
+}
+
+LHP_RAW_API size_t lhp_raw_execute(lhp_raw_parser* p, const char* data, size_t len,
+                                   lhp_raw_event* events, size_t nevents, size_t* count) {
+    size_t result;
+
+    *count = 0;
+    if ( nevents < 2 ) return 0;
+
+    /* Only a pending token is still needed from the buffer. */
+    if ( p->pending.type && p->pending.in_buffer ) {
+        memmove(p->buf, p->buf + p->pending.offset, p->pending.length);
+        p->pending.offset = 0;
+        p->buf_len        = p->pending.length;
+    } else {
+        p->buf_len = 0;
+    }
+
+    p->events  = events;
+    p->nevents = nevents;
+    p->count   = 0;
+    p->input   = data;
+
+    result = http_parser_execute(&(p->parser), &lhp_raw_settings, data, len);
+
+    /* Paused by lhp_raw_emit() because the events array is full. */
+    if ( HPE_PAUSED == HTTP_PARSER_ERRNO(&(p->parser)) ) {
+        http_parser_pause(&(p->parser), 0);
+    }
+
+    /* Keep the unfinished token for the next call. */
+    if ( p->pending.type && ! p->pending.in_buffer ) {
+        size_t offset = p->buf_len;
+        if ( 0 != lhp_raw_buf_append(p, data + p->pending.offset, p->pending.length) ) {
+            p->parser.http_errno = HPE_UNKNOWN;
+            p->pending.type = 0;
+        } else {
+            p->pending.in_buffer = 1;
+            p->pending.offset    = offset;
+        }
+    }
+    /* The next call goes on at result, a token ending there continues
+     * at the start of its data. */
+    p->pending_end = p->pending_end == result ? 0 : (size_t)-1;
+
+    *count     = p->count;
+    p->events  = NULL;
+    p->nevents = 0;
+    p->input   = NULL;
+    return result;
+}
+
+LHP_RAW_API const char* lhp_raw_buffer(const lhp_raw_parser* p) {
+    return p->buf;
+}
+
+LHP_RAW_API int lhp_raw_errno(const lhp_raw_parser* p) {
+    return p->parser.http_errno;
+}
+
+LHP_RAW_API const char* lhp_raw_errno_name(const lhp_raw_parser* p) {
+    return http_errno_name((enum http_errno)p->parser.http_errno);
+}
+
+LHP_RAW_API const char* lhp_raw_method(const lhp_raw_parser* p) {
+    return http_method_str((enum http_method)p->parser.method);
+}
+
+LHP_RAW_API int lhp_raw_status_code(const lhp_raw_parser* p) {
+    return p->parser.status_code;
+}
+
+LHP_RAW_API int lhp_raw_http_major(const lhp_raw_parser* p) {
+    return p->parser.http_major;
+}
+
+LHP_RAW_API int lhp_raw_http_minor(const lhp_raw_parser* p) {
+    return p->parser.http_minor;
+}
+
+LHP_RAW_API int lhp_raw_should_keep_alive(const lhp_raw_parser* p) {
+    return http_should_keep_alive(&(p->parser));
+}
+
+LHP_RAW_API int lhp_raw_is_upgrade(const lhp_raw_parser* p) {
+    return p->parser.upgrade;
+}
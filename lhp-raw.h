@@ -0,0 +1,97 @@
+/* A plain C interface to the http parser that needs no lua_State.
+ *
+ * It is compiled into the http.parser module so that LuaJIT code can
+ * reach it through the FFI (see http/parser/ffi.lua) and parse from a
+ * (const char*, size_t) buffer without creating Lua strings.  Events
+ * are written as lhp_raw_event records into an array owned by the
+ * caller.  This ABI is stable: new event types and functions may be
+ * added, but existing ones don't change.
+ *
+ * Keep the ffi.cdef in http/parser/ffi.lua in sync with this file.
+ */
+#ifndef LHP_RAW_H
+#define LHP_RAW_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(_WIN32) && defined(LHP_RAW_BUILD)
+#define LHP_RAW_API __declspec(dllexport)
+#else
+#define LHP_RAW_API extern
+#endif
+
+/* lhp_raw_event.type values. */
+enum lhp_raw_event_type {
+    LHP_RAW_MESSAGE_BEGIN    = 1,
+    LHP_RAW_URL              = 2,
+    LHP_RAW_STATUS           = 3,
+    LHP_RAW_HEADER_FIELD     = 4,
+    LHP_RAW_HEADER_VALUE     = 5,
+    LHP_RAW_HEADERS_COMPLETE = 6,
+    LHP_RAW_BODY             = 7,
+    LHP_RAW_MESSAGE_COMPLETE = 8,
+    LHP_RAW_CHUNK_HEADER     = 9,
+    LHP_RAW_CHUNK_COMPLETE   = 10
+};
+
+/* One event.  URL, STATUS, HEADER_FIELD, HEADER_VALUE and BODY events
+ * have their bytes at offset and length: in the data passed to
+ * lhp_raw_execute() if in_buffer is 0, otherwise in
+ * lhp_raw_buffer(parser).  Except for BODY, which is reported piece
+ * by piece, these are complete tokens even when the token was split
+ * across lhp_raw_execute() calls.  Each line of a folded header
+ * value is a HEADER_VALUE event of its own.  CHUNK_HEADER events have
+ * the chunk size in length.  Both locations are only valid until the
+ * next call on the parser.
+ */
+typedef struct lhp_raw_event {
+    uint32_t    type;
+    uint32_t    in_buffer;
+    size_t      offset;
+    size_t      length;
+} lhp_raw_event;
+
+typedef struct lhp_raw_parser lhp_raw_parser;
+
+/* Returns a new parser for requests (response is 0) or responses, or
+ * NULL if out of memory.
+ */
+LHP_RAW_API lhp_raw_parser* lhp_raw_new(int response);
+LHP_RAW_API void            lhp_raw_free(lhp_raw_parser* parser);
+LHP_RAW_API void            lhp_raw_reset(lhp_raw_parser* parser);
+
+/* Parse len bytes of data, writing at most nevents (at least 2) events
+ * into events and their number into *count.  Returns the number of
+ * bytes parsed.  That is less than len if the events array filled up,
+ * in which case call again with the rest of the data once the events
+ * are handled, or if parsing failed, see lhp_raw_errno().  Pass len 0
+ * to signal the end of the input.
+ */
+LHP_RAW_API size_t lhp_raw_execute(lhp_raw_parser* parser, const char* data, size_t len,
+                                   lhp_raw_event* events, size_t nevents, size_t* count);
+
+/* Base of the events that have in_buffer set. */
+LHP_RAW_API const char* lhp_raw_buffer(const lhp_raw_parser* parser);
+
+/* The http_parser errno, 0 if there is no error. */
+LHP_RAW_API int         lhp_raw_errno(const lhp_raw_parser* parser);
+LHP_RAW_API const char* lhp_raw_errno_name(const lhp_raw_parser* parser);
+
+/* Information about the current message, valid from HEADERS_COMPLETE. */
+LHP_RAW_API const char* lhp_raw_method(const lhp_raw_parser* parser);
+LHP_RAW_API int         lhp_raw_status_code(const lhp_raw_parser* parser);
+LHP_RAW_API int         lhp_raw_http_major(const lhp_raw_parser* parser);
+LHP_RAW_API int         lhp_raw_http_minor(const lhp_raw_parser* parser);
+LHP_RAW_API int         lhp_raw_should_keep_alive(const lhp_raw_parser* parser);
+LHP_RAW_API int         lhp_raw_is_upgrade(const lhp_raw_parser* parser);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LHP_RAW_H */
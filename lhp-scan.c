@@ -0,0 +1,180 @@
+/* Implementation of lhp-scan.h.
+ *
+ * The SSE2 versions are built whenever the target has SSE2 (always on
+ * x86-64).  With GCC and clang the AVX2 versions are built with a
+ * target attribute, so they don't need -mavx2, and are only used if
+ * the CPU reports AVX2 support.  Other compilers get them only when
+ * compiling for AVX2 anyway.  Define LHP_NO_SIMD to build the scalar
+ * versions only.
+ */
+#include <string.h>
+#include "lhp-scan.h"
+
+#ifndef LHP_NO_SIMD
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define LHP_SSE2
+#include <emmintrin.h>
+#endif
+#if defined(LHP_SSE2) && (defined(__GNUC__) || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define LHP_AVX2
+#define LHP_AVX2_RUNTIME
+#define LHP_TARGET_AVX2 __attribute__((target("avx2")))
+#include <immintrin.h>
+#elif defined(LHP_SSE2) && defined(__AVX2__)
+#define LHP_AVX2
+#define LHP_TARGET_AVX2
+#include <immintrin.h>
+#endif
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+static unsigned lhp_ctz(unsigned mask) {
+    unsigned long idx;
+    _BitScanForward(&idx, mask);
+    return (unsigned)idx;
+}
+#else
+#define lhp_ctz(mask) ((unsigned)__builtin_ctz(mask))
+#endif
+
+struct lhp_scanner {
+    const char* name;
+    size_t    (*scan)(const char* str, size_t len, char a, char b);
+    void      (*lowercase)(char* str, size_t len);
+};
+
+static size_t lhp_scan_scalar(const char* str, size_t len, char a, char b) {
+    size_t i;
+    for ( i = 0; i < len; i++ ) {
+        if ( a == str[i] || b == str[i] ) return i;
+    }
+    return len;
+}
+
+static void lhp_lowercase_scalar(char* str, size_t len) {
+    for ( ; len; str++, len-- ) {
+        if ( *str >= 'A' && *str <= 'Z' ) *str |= 0x20;
+    }
+}
+
+#ifdef LHP_SSE2
+static size_t lhp_scan_sse2(const char* str, size_t len, char a, char b) {
+    __m128i va = _mm_set1_epi8(a);
+    __m128i vb = _mm_set1_epi8(b);
+    size_t  i;
+
+    for ( i = 0; i + 16 <= len; i += 16 ) {
+        __m128i  v    = _mm_loadu_si128((const __m128i*)(str + i));
+        unsigned mask = (unsigned)_mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)));
+        if ( mask ) return i + lhp_ctz(mask);
+    }
+    return i + lhp_scan_scalar(str + i, len - i, a, b);
+}
+
+/* Bytes are compared as signed, so those >= 0x80 are never letters. */
+static void lhp_lowercase_sse2(char* str, size_t len) {
+    __m128i before_a = _mm_set1_epi8('A' - 1);
+    __m128i after_z  = _mm_set1_epi8('Z' + 1);
+    __m128i bit      = _mm_set1_epi8(0x20);
+    size_t  i;
+
+    for ( i = 0; i + 16 <= len; i += 16 ) {
+        __m128i v     = _mm_loadu_si128((const __m128i*)(str + i));
+        __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, before_a),
+                                      _mm_cmplt_epi8(v, after_z));
+        _mm_storeu_si128((__m128i*)(str + i),
+                         _mm_or_si128(v, _mm_and_si128(upper, bit)));
+    }
+    lhp_lowercase_scalar(str + i, len - i);
+}
+#endif
+
+#ifdef LHP_AVX2
+LHP_TARGET_AVX2
+static size_t lhp_scan_avx2(const char* str, size_t len, char a, char b) {
+    __m256i va = _mm256_set1_epi8(a);
+    __m256i vb = _mm256_set1_epi8(b);
+    size_t  i;
+
+    for ( i = 0; i + 32 <= len; i += 32 ) {
+        __m256i  v    = _mm256_loadu_si256((const __m256i*)(str + i));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)));
+        if ( mask ) return i + lhp_ctz(mask);
+    }
+    return i + lhp_scan_sse2(str + i, len - i, a, b);
+}
+
+LHP_TARGET_AVX2
+static void lhp_lowercase_avx2(char* str, size_t len) {
+    __m256i before_a = _mm256_set1_epi8('A' - 1);
+    __m256i after_z  = _mm256_set1_epi8('Z' + 1);
+    __m256i bit      = _mm256_set1_epi8(0x20);
+    size_t  i;
+
+    for ( i = 0; i + 32 <= len; i += 32 ) {
+        __m256i v     = _mm256_loadu_si256((const __m256i*)(str + i));
+        __m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(v, before_a),
+                                         _mm256_cmpgt_epi8(after_z, v));
+        _mm256_storeu_si256((__m256i*)(str + i),
+                            _mm256_or_si256(v, _mm256_and_si256(upper, bit)));
+    }
+    lhp_lowercase_sse2(str + i, len - i);
+}
+#endif
+
+/* Slowest first. */
+static const lhp_scanner lhp_scanners[] = {
+    { "scalar", lhp_scan_scalar, lhp_lowercase_scalar },
+#ifdef LHP_SSE2
+    { "sse2",   lhp_scan_sse2,   lhp_lowercase_sse2 },
+#endif
+#ifdef LHP_AVX2
+    { "avx2",   lhp_scan_avx2,   lhp_lowercase_avx2 },
+#endif
+};
+
+#define LHP_SCANNERS_LEN (sizeof(lhp_scanners)/sizeof(*lhp_scanners))
+
+/* The cpu model __builtin_cpu_supports() reads is filled in by a
+ * constructor of libgcc before any Lua runs, so it is only read here.
+ */
+static int lhp_scanner_supported(const lhp_scanner* scanner) {
+#ifdef LHP_AVX2_RUNTIME
+    if ( lhp_scan_avx2 == scanner->scan ) {
+        return __builtin_cpu_supports("avx2");
+    }
+#endif
+    (void)scanner;
+    return 1;
+}
+
+const lhp_scanner* lhp_scanner_find(const char* name) {
+    size_t i = LHP_SCANNERS_LEN;
+
+    while ( i-- ) {
+        const lhp_scanner* scanner = &lhp_scanners[i];
+        if ( NULL != name && 0 != strcmp(name, scanner->name) ) continue;
+        if ( ! lhp_scanner_supported(scanner) ) {
+            if ( NULL != name ) return NULL;
+            continue;
+        }
+        return scanner;
+    }
+    return NULL;
+}
+
+const char* lhp_scanner_name(const lhp_scanner* scanner) {
+    return scanner->name;
+}
+
+size_t lhp_scan(const lhp_scanner* scanner, const char* str, size_t len, char a, char b) {
+    return scanner->scan(str, len, a, b);
+}
+
+void lhp_lowercase(const lhp_scanner* scanner, char* str, size_t len) {
+    scanner->lowercase(str, len);
+}
@@ -0,0 +1,30 @@
+/* Byte scanning loops of the http.parser module, with SSE2 and AVX2
+ * versions picked at run time by what the CPU supports.
+ */
+#ifndef LHP_SCAN_H
+#define LHP_SCAN_H
+
+#include <stddef.h>
+
+/* The scanners are constant, so any thread may use any of them.  The
+ * caller keeps the one it picked, nothing here is process wide.
+ */
+typedef struct lhp_scanner lhp_scanner;
+
+/* Returns the scanner called name, or the fastest one if name is
+ * NULL.  NULL if there is no such scanner or the CPU can't run it.
+ */
+const lhp_scanner* lhp_scanner_find(const char* name);
+
+/* Name of scanner: "scalar", "sse2" or "avx2". */
+const char* lhp_scanner_name(const lhp_scanner* scanner);
+
+/* Returns the index of the first a or b byte in the len bytes at str,
+ * or len if there is none.
+ */
+size_t lhp_scan(const lhp_scanner* scanner, const char* str, size_t len, char a, char b);
+
+/* Lowercase the ASCII letters of the len bytes at str in place. */
+void lhp_lowercase(const lhp_scanner* scanner, char* str, size_t len);
+
+#endif /* LHP_SCAN_H */
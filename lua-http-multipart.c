@@ -0,0 +1,614 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+#include <lauxlib.h>
+#include <lua.h>
+#include <lualib.h>
+#include "lhp-scan.h"
+
+/* A streaming multipart/form-data (RFC 2046 and 7578) parser.  The
+ * body is fed in chunks of any size, typically straight from on_body,
+ * and part headers and data are reported through callbacks.  Part
+ * data is passed on as it arrives, or written to a file with
+ * parser:sink(), so a part is never held in memory as a whole.
+ */
+
+#if LUA_VERSION_NUM >= 502
+#define lua_setfenv         lua_setuservalue
+#define lua_getfenv         lua_getuservalue
+#endif
+
+#define MULTIPART_MT "http.multipart{parser}"
+
+#define check_multipart(L, narg)                                \
+    ((lhm_parser*)luaL_checkudata((L), (narg), MULTIPART_MT))
+
+/* The Lua stack indices during feed */
+#define ST_CHUNK_IDX  2
+#define ST_FENV_IDX   3
+
+/* Callbacks are stored in the fenv at their cb_id. */
+#define CB_ON_PART_BEGIN        1
+#define CB_ON_HEADER            2
+#define CB_ON_HEADERS_COMPLETE  3
+#define CB_ON_DATA              4
+#define CB_ON_PART_COMPLETE     5
+#define CB_ON_COMPLETE          6
+#define CB_LEN                  (sizeof(lhm_callback_names)/sizeof(*lhm_callback_names))
+
+static const char *lhm_callback_names[] = {
+    "on_part_begin",
+    "on_header",
+    "on_headers_complete",
+    "on_data",
+    "on_part_complete",
+    "on_complete",
+};
+
+/* The sink of the current part, if any. */
+#define FENV_SINK_IDX           (CB_LEN + 1)
+
+/* RFC 2046 limits boundaries to 70 bytes.  The delimiter searched for
+ * in the body is CRLF "--" boundary.
+ */
+#define LHM_MAX_BOUNDARY 70
+#define LHM_MAX_DELIM    (LHM_MAX_BOUNDARY + 4)
+
+#define LHM_DEFAULT_MAX_HEADER_SIZE (8 * 1024)
+
+/* Parser states. */
+#define LHM_PREAMBLE      0 /* before the first delimiter. */
+#define LHM_BOUNDARY      1 /* after a delimiter. */
+#define LHM_BOUNDARY_DASH 2 /* after a delimiter and "-". */
+#define LHM_BOUNDARY_PAD  3 /* in the whitespace after a delimiter. */
+#define LHM_BOUNDARY_LF   4 /* after a delimiter line and CR. */
+#define LHM_HEADERS       5 /* in the part headers. */
+#define LHM_DATA          6 /* in the part data. */
+#define LHM_EPILOGUE      7 /* after the close delimiter. */
+#define LHM_ERROR         8
+
+/* A growable byte buffer allocated with the allocator of the
+ * lua_State, for header lines split across chunks.
+ */
+typedef struct lhm_buf {
+    char*       data;
+    size_t      len;
+    size_t      cap;
+} lhm_buf;
+
+typedef struct lhm_parser {
+    int         state;      /* LHM_* state. */
+    int         lowercase;  /* lowercase header fields. */
+    const lhp_scanner* scanner; /* the fastest the CPU supports. */
+    const char* error;      /* why the parser is in LHM_ERROR. */
+    size_t      max_header_size;
+    size_t      header_size; /* header bytes of the current part so far. */
+    lhm_buf     line;       /* the current header line. */
+    size_t      dlen;
+    char        delim[LHM_MAX_DELIM];
+    size_t      hlen;
+    char        held[LHM_MAX_DELIM]; /* chunk tail that may start a delimiter. */
+} lhm_parser;
+
+static int lhm_buf_append(lua_State* L, lhm_buf* buf, const char* str, size_t len) {
+    if ( buf->cap - buf->len < len ) {
+        void*     ud;
+        lua_Alloc allocf = lua_getallocf(L, &ud);
+        size_t    cap = buf->cap ? buf->cap : 64;
+        char*     data;
+
+        while ( cap - buf->len < len ) cap *= 2;
+        data = (char*)allocf(ud, buf->data, buf->cap, cap);
+        if ( NULL == data ) return -1;
+        buf->data = data;
+        buf->cap  = cap;
+    }
+    memcpy(buf->data + buf->len, str, len);
+    buf->len += len;
+    return 0;
+}
+
+static void lhm_buf_free(lua_State* L, lhm_buf* buf) {
+    void*     ud;
+    lua_Alloc allocf;
+
+    if ( NULL != buf->data ) {
+        allocf = lua_getallocf(L, &ud);
+        allocf(ud, buf->data, buf->cap, 0);
+    }
+    buf->data = NULL;
+    buf->len  = 0;
+    buf->cap  = 0;
+}
+
+/* Stop the parser with the error message. */
+static int lhm_fail(lhm_parser* mp, const char* error) {
+    mp->state = LHM_ERROR;
+    mp->error = error;
+    return -1;
+}
+
+/* Call the cb_id callback, if there is one, with the nargs arguments
+ * on the top of the stack.
+ */
+static void lhm_call(lua_State* L, int cb_id, int nargs) {
+    lua_rawgeti(L, ST_FENV_IDX, cb_id);
+    if ( lua_isnil(L, -1) ) {
+        lua_pop(L, nargs + 1);
+        return;
+    }
+    lua_insert(L, -(nargs + 1));
+    lua_call(L, nargs, 0);
+}
+
+/* Returns the FILE* of the file handle at idx, NULL if it is closed.
+ */
+static FILE* lhm_tofile(lua_State* L, int idx) {
+    FILE* file = NULL;
+    int   is_file;
+
+    if ( ! lua_getmetatable(L, idx) ) lua_pushnil(L);
+    luaL_getmetatable(L, LUA_FILEHANDLE);
+    is_file = lua_istable(L, -1) && lua_rawequal(L, -1, -2);
+    lua_pop(L, 2);
+    if ( ! is_file ) luaL_argerror(L, idx, "file handle expected");
+
+#if LUA_VERSION_NUM >= 502
+    {
+        luaL_Stream* stream = (luaL_Stream*)lua_touserdata(L, idx);
+        if ( NULL != stream->closef ) file = stream->f;
+    }
+#else
+    file = *(FILE**)lua_touserdata(L, idx);
+#endif
+    return file;
+}
+
+static int lhm_write_fd(int fd, const char* str, size_t len) {
+    while ( len > 0 ) {
+#ifdef _WIN32
+        int n = _write(fd, str, len > 0x40000000 ? 0x40000000 : (unsigned)len);
+#else
+        ssize_t n = write(fd, str, len);
+        if ( n < 0 && EINTR == errno ) continue;
+#endif
+        if ( n < 0 ) return -1;
+        str += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Pass len bytes of part data on, to the sink or to on_data.  Data
+ * before the first delimiter is dropped.
+ */
+static int lhm_data(lua_State* L, lhm_parser* mp, const char* str, size_t len) {
+    if ( 0 == len || LHM_DATA != mp->state ) return 0;
+
+    lua_rawgeti(L, ST_FENV_IDX, FENV_SINK_IDX);
+    if ( lua_isnil(L, -1) ) {
+        lua_pop(L, 1);
+        lua_pushlstring(L, str, len);
+        lhm_call(L, CB_ON_DATA, 1);
+        return 0;
+    }
+
+    if ( lua_isnumber(L, -1) ) {
+        int fd = (int)lua_tointeger(L, -1);
+        lua_pop(L, 1);
+        if ( 0 != lhm_write_fd(fd, str, len) ) {
+            return lhm_fail(mp, "writing to the sink failed");
+        }
+    } else {
+        FILE* file = lhm_tofile(L, -1);
+        lua_pop(L, 1);
+        if ( NULL == file ) return lhm_fail(mp, "the sink is a closed file");
+        if ( fwrite(str, 1, len, file) != len ) {
+            return lhm_fail(mp, "writing to the sink failed");
+        }
+    }
+    return 0;
+}
+
+/* A delimiter ended the preamble or the current part. */
+static void lhm_delimiter(lua_State* L, lhm_parser* mp) {
+    int in_part = LHM_DATA == mp->state;
+
+    mp->state = LHM_BOUNDARY;
+    if ( in_part ) {
+        lhm_call(L, CB_ON_PART_COMPLETE, 0);
+        lua_pushnil(L);
+        lua_rawseti(L, ST_FENV_IDX, FENV_SINK_IDX);
+    }
+}
+
+/* Search the len bytes at str for the delimiter, passing the bytes
+ * before it to lhm_data().  A chunk tail that may be the start of a
+ * delimiter is held back until the next chunk tells.  Sets *used to
+ * the bytes consumed, which are all of them unless a delimiter was
+ * found.
+ */
+static int lhm_search(lua_State* L, lhm_parser* mp, const char* str, size_t len, size_t* used) {
+    const char* delim = mp->delim;
+    size_t      dlen  = mp->dlen;
+    size_t      pos;
+
+    if ( mp->hlen ) {
+        /* Look for a delimiter starting in the held bytes. */
+        char   tmp[2 * LHM_MAX_DELIM];
+        size_t hlen = mp->hlen;
+        size_t n = len < dlen - 1 ? len : dlen - 1;
+
+        memcpy(tmp, mp->held, hlen);
+        memcpy(tmp + hlen, str, n);
+        mp->hlen = 0;
+
+        for ( pos = 0; pos < hlen; pos++ ) {
+            size_t avail = hlen + n - pos;
+            if ( avail >= dlen ) {
+                if ( 0 != memcmp(tmp + pos, delim, dlen) ) continue;
+                if ( 0 != lhm_data(L, mp, tmp, pos) ) return -1;
+                lhm_delimiter(L, mp);
+                *used = pos + dlen - hlen;
+                return 0;
+            }
+            /* All of the chunk is in tmp, keep holding. */
+            if ( 0 != memcmp(tmp + pos, delim, avail) ) continue;
+            if ( 0 != lhm_data(L, mp, tmp, pos) ) return -1;
+            memcpy(mp->held, tmp + pos, avail);
+            mp->hlen = avail;
+            *used = len;
+            return 0;
+        }
+        if ( 0 != lhm_data(L, mp, tmp, hlen) ) return -1;
+    }
+
+    /* Every delimiter starts with CR. */
+    for ( pos = 0; ; pos++ ) {
+        size_t avail;
+
+        pos += lhp_scan(mp->scanner, str + pos, len - pos, '\r', '\r');
+        if ( pos == len ) break;
+
+        avail = len - pos;
+        if ( avail >= dlen ) {
+            if ( 0 != memcmp(str + pos, delim, dlen) ) continue;
+            if ( 0 != lhm_data(L, mp, str, pos) ) return -1;
+            lhm_delimiter(L, mp);
+            *used = pos + dlen;
+            return 0;
+        }
+        if ( 0 != memcmp(str + pos, delim, avail) ) continue;
+        if ( 0 != lhm_data(L, mp, str, pos) ) return -1;
+        memcpy(mp->held, str + pos, avail);
+        mp->hlen = avail;
+        *used = len;
+        return 0;
+    }
+
+    if ( 0 != lhm_data(L, mp, str, len) ) return -1;
+    *used = len;
+    return 0;
+}
+
+/* Report the complete header line in mp->line, or the end of the
+ * headers if it is empty.
+ */
+static int lhm_header_line(lua_State* L, lhm_parser* mp) {
+    char*  line = mp->line.data;
+    size_t len  = mp->line.len;
+    size_t colon;
+    size_t start, end;
+
+    mp->line.len = 0;
+    if ( len && '\r' == line[len - 1] ) len--;
+
+    if ( 0 == len ) {
+        mp->state = LHM_DATA;
+        lhm_call(L, CB_ON_HEADERS_COMPLETE, 0);
+        return 0;
+    }
+
+    colon = lhp_scan(mp->scanner, line, len, ':', ':');
+    if ( 0 == colon || colon == len ) {
+        return lhm_fail(mp, "invalid part header");
+    }
+
+    start = colon + 1;
+    end   = len;
+    while ( start < end && (' ' == line[start] || '\t' == line[start]) ) start++;
+    while ( end > start && (' ' == line[end - 1] || '\t' == line[end - 1]) ) end--;
+
+    if ( mp->lowercase ) lhp_lowercase(mp->scanner, line, colon);
+    lua_pushlstring(L, line, colon);
+    lua_pushlstring(L, line + start, end - start);
+    lhm_call(L, CB_ON_HEADER, 2);
+    return 0;
+}
+
+/* Start the headers of a new part. */
+static void lhm_part_begin(lua_State* L, lhm_parser* mp) {
+    mp->state       = LHM_HEADERS;
+    mp->header_size = 0;
+    mp->line.len    = 0;
+    lhm_call(L, CB_ON_PART_BEGIN, 0);
+}
+
+/* Run the parser over the len bytes at str. */
+static int lhm_execute(lua_State* L, lhm_parser* mp, const char* str, size_t len) {
+    size_t i = 0;
+
+    while ( i < len ) {
+        char c;
+        size_t used;
+
+        switch ( mp->state ) {
+        case LHM_PREAMBLE:
+        case LHM_DATA:
+            if ( 0 != lhm_search(L, mp, str + i, len - i, &used) ) return -1;
+            i += used;
+            break;
+        case LHM_BOUNDARY:
+        case LHM_BOUNDARY_PAD:
+            c = str[i++];
+            if ( '-' == c && LHM_BOUNDARY == mp->state ) {
+                mp->state = LHM_BOUNDARY_DASH;
+            } else if ( ' ' == c || '\t' == c ) {
+                mp->state = LHM_BOUNDARY_PAD;
+            } else if ( '\r' == c ) {
+                mp->state = LHM_BOUNDARY_LF;
+            } else {
+                return lhm_fail(mp, "invalid boundary line");
+            }
+            break;
+        case LHM_BOUNDARY_DASH:
+            if ( '-' != str[i++] ) return lhm_fail(mp, "invalid boundary line");
+            mp->state = LHM_EPILOGUE;
+            lhm_call(L, CB_ON_COMPLETE, 0);
+            break;
+        case LHM_BOUNDARY_LF:
+            if ( '\n' != str[i++] ) return lhm_fail(mp, "invalid boundary line");
+            lhm_part_begin(L, mp);
+            break;
+        case LHM_HEADERS:
+            used = lhp_scan(mp->scanner, str + i, len - i, '\n', '\n');
+            mp->header_size += used;
+            if ( mp->max_header_size && mp->header_size > mp->max_header_size ) {
+                return lhm_fail(mp, "part headers are larger than max_header_size");
+            }
+            if ( 0 != lhm_buf_append(L, &(mp->line), str + i, used) ) {
+                return luaL_error(L, "out of memory");
+            }
+            i += used;
+            if ( i < len ) {
+                i++; /* the LF */
+                if ( 0 != lhm_header_line(L, mp) ) return -1;
+            }
+            break;
+        case LHM_EPILOGUE:
+            i = len;
+            break;
+        default:
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Push nil, error message and return 2. */
+static int lhm_push_error(lua_State* L, lhm_parser* mp) {
+    lua_pushnil(L);
+    lua_pushstring(L, mp->error);
+    return 2;
+}
+
+/* parser:feed(chunk) parses the next chunk of the body.  A nil chunk
+ * ends the body, see parser:finish().  Returns true, or nil and an
+ * error message if the body is invalid.
+ */
+static int lhm_feed(lua_State* L) {
+    lhm_parser* mp = check_multipart(L, 1);
+    const char* str;
+    size_t      len;
+
+    if ( lua_isnoneornil(L, ST_CHUNK_IDX) ) {
+        if ( LHM_EPILOGUE != mp->state && LHM_ERROR != mp->state ) {
+            lhm_fail(mp, "the body ended before the close delimiter");
+        }
+    } else {
+        str = luaL_checklstring(L, ST_CHUNK_IDX, &len);
+        if ( LHM_ERROR != mp->state ) {
+            lua_settop(L, ST_CHUNK_IDX);
+            lua_getfenv(L, 1);
+            assert(lua_gettop(L) == ST_FENV_IDX);
+
+            /* Errors are left in mp->state. */
+            lhm_execute(L, mp, str, len);
+        }
+    }
+
+    if ( LHM_ERROR == mp->state ) return lhm_push_error(L, mp);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/* parser:finish() checks that the body ended with the close delimiter.
+ */
+static int lhm_finish(lua_State* L) {
+    check_multipart(L, 1);
+    lua_settop(L, 1);
+    return lhm_feed(L);
+}
+
+/* parser:sink(sink) writes the data of the current part to sink, a
+ * Lua file handle or a file descriptor number, instead of passing it
+ * to on_data.  The sink is dropped at the end of the part.  nil
+ * removes it.
+ */
+static int lhm_sink(lua_State* L) {
+    check_multipart(L, 1);
+    if ( ! lua_isnoneornil(L, 2) && ! lua_isnumber(L, 2) ) {
+        if ( NULL == lhm_tofile(L, 2) ) luaL_argerror(L, 2, "closed file");
+    }
+    lua_settop(L, 2);
+    lua_getfenv(L, 1);
+    lua_pushvalue(L, 2);
+    lua_rawseti(L, -2, FENV_SINK_IDX);
+    return 0;
+}
+
+/* parser:error() returns the error message, or nil. */
+static int lhm_error(lua_State* L) {
+    lhm_parser* mp = check_multipart(L, 1);
+    if ( LHM_ERROR != mp->state ) return 0;
+    lua_pushstring(L, mp->error);
+    return 1;
+}
+
+static int lhm__gc(lua_State* L) {
+    lhm_parser* mp = check_multipart(L, 1);
+    lhm_buf_free(L, &(mp->line));
+    return 0;
+}
+
+static int lhm__tostring(lua_State* L) {
+    lhm_parser* mp = check_multipart(L, 1);
+    lua_pushfstring(L, MULTIPART_MT" %p", mp);
+    return 1;
+}
+
+/* multipart.new(boundary, callbacks) */
+static int lhm_new(lua_State* L) {
+    lhm_parser* mp;
+    size_t      blen;
+    const char* boundary = luaL_checklstring(L, 1, &blen);
+    int         cb_id;
+
+    luaL_argcheck(L, blen >= 1 && blen <= LHM_MAX_BOUNDARY, 1,
+                  "boundary must be 1 to 70 bytes");
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_settop(L, 2);
+
+    mp = (lhm_parser*)lua_newuserdata(L, sizeof(lhm_parser));
+    memset(mp, 0, sizeof(lhm_parser));
+    mp->state   = LHM_PREAMBLE;
+    mp->scanner = lhp_scanner_find(NULL);
+
+    memcpy(mp->delim, "\r\n--", 4);
+    memcpy(mp->delim + 4, boundary, blen);
+    mp->dlen = blen + 4;
+
+    /* As if the body started with CRLF, so a delimiter at its very
+     * start is found. */
+    memcpy(mp->held, "\r\n", 2);
+    mp->hlen = 2;
+
+    lua_getfield(L, 2, "lowercase_headers");
+    mp->lowercase = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    lua_getfield(L, 2, "max_header_size");
+    if ( lua_isnil(L, -1) ) {
+        mp->max_header_size = LHM_DEFAULT_MAX_HEADER_SIZE;
+    } else {
+        lua_Number n = luaL_checknumber(L, -1);
+        luaL_argcheck(L, n >= 0, 2, "max_header_size must be non-negative");
+        mp->max_header_size = (size_t)n;
+    }
+    lua_pop(L, 1);
+
+    luaL_getmetatable(L, MULTIPART_MT);
+    lua_setmetatable(L, -2);
+
+    /* Copy the callbacks to the fenv. */
+    lua_createtable(L, CB_LEN + 1, 0);
+    for ( cb_id = 1; cb_id <= (int)CB_LEN; cb_id++ ) {
+        lua_getfield(L, 2, lhm_callback_names[cb_id - 1]);
+        if ( ! lua_isnil(L, -1) && ! lua_isfunction(L, -1) ) {
+            return luaL_error(L, "%s must be a function", lhm_callback_names[cb_id - 1]);
+        }
+        lua_rawseti(L, -2, cb_id);
+    }
+    lua_setfenv(L, -2);
+
+    return 1;
+}
+
+/* multipart.boundary(content_type) returns the boundary parameter of
+ * a Content-Type header value, or nil.
+ */
+static int lhm_boundary(lua_State* L) {
+    size_t      len;
+    const char* str = luaL_checklstring(L, 1, &len);
+    const char* end = str + len;
+
+    while ( NULL != (str = (const char*)memchr(str, ';', end - str)) ) {
+        char lower[8];
+        int  i;
+
+        str++;
+        while ( str < end && (' ' == *str || '\t' == *str) ) str++;
+        if ( end - str < 10 || '=' != str[8] ) continue;
+
+        for ( i = 0; i < 8; i++ ) lower[i] = str[i] | 0x20;
+        if ( 0 != memcmp(lower, "boundary", 8) ) continue;
+
+        str += 9;
+        if ( '"' == *str ) {
+            const char* close = (const char*)memchr(str + 1, '"', end - str - 1);
+            if ( NULL == close ) return 0;
+            lua_pushlstring(L, str + 1, close - str - 1);
+        } else {
+            const char* value = str;
+            while ( str < end && ';' != *str && ' ' != *str && '\t' != *str ) str++;
+            lua_pushlstring(L, value, str - value);
+        }
+        return 1;
+    }
+    return 0;
+}
+
+LUALIB_API int luaopen_http_multipart(lua_State* L) {
+    /* parser metatable init */
+    luaL_newmetatable(L, MULTIPART_MT);
+
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+
+    lua_pushcfunction(L, lhm__tostring);
+    lua_setfield(L, -2, "__tostring");
+
+    lua_pushcfunction(L, lhm__gc);
+    lua_setfield(L, -2, "__gc");
+
+    lua_pushcfunction(L, lhm_feed);
+    lua_setfield(L, -2, "feed");
+
+    lua_pushcfunction(L, lhm_finish);
+    lua_setfield(L, -2, "finish");
+
+    lua_pushcfunction(L, lhm_sink);
+    lua_setfield(L, -2, "sink");
+
+    lua_pushcfunction(L, lhm_error);
+    lua_setfield(L, -2, "error");
+
+    lua_pop(L, 1);
+
+    /* export http.multipart */
+    lua_newtable(L);
+
+    lua_pushcfunction(L, lhm_new);
+    lua_setfield(L, -2, "new");
+
+    lua_pushcfunction(L, lhm_boundary);
+    lua_setfield(L, -2, "boundary");
+
+    return 1;
+}
@@ -1,26 +1,93 @@
 #include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+#ifdef LHP_STATS_TIMING
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+#endif
+#ifdef LHP_ZLIB
+#include <zlib.h>
+#endif
 #include <lauxlib.h>
 #include <lua.h>
+#include <lualib.h>
 #include "http-parser/http_parser.h"
+#include "lhp-batch.h"
+#include "lhp-scan.h"
 
 #if LUA_VERSION_NUM >= 502
 #define lua_setfenv         lua_setuservalue
 #define lua_getfenv         lua_getuservalue
+#define lua_objlen          lua_rawlen
 #endif
 
 #define PARSER_MT "http.parser{parser}"
+#define FACTORY_MT "http.parser{factory}"
+#define BYTEBUF_MT "http.parser{buffer}"
+#define QUERY_MT "http.parser{query}"
+#define HEADERS_MT "http.parser{headers}"
+#define BATCH_MT "http.parser{batch}"
+#define POOL_MT "http.parser{pool}"
+
+/* The parse_batch() thread pool of the lua_State is a userdata in the
+ * registry at POOL_KEY.
+ */
+#define POOL_KEY "http.parser{threads}"
+
+/* The byte scanner lhp.scanner() picked for the lua_State is a light
+ * userdata in the registry at SCANNER_KEY.  Parsers keep the one that
+ * was picked when they were made.
+ */
+#define SCANNER_KEY "http.parser{scanner}"
 
 #define check_parser(L, narg)                                   \
     ((lhttp_parser*)luaL_checkudata((L), (narg), PARSER_MT))
 
+#define check_factory(L, narg)                                  \
+    ((lhp_factory*)luaL_checkudata((L), (narg), FACTORY_MT))
+
+#define check_bytebuf(L, narg)                                   \
+    ((lhp_bytebuf*)luaL_checkudata((L), (narg), BYTEBUF_MT))
+
+#define check_headers(L, narg)                                  \
+    ((lhp_headers*)luaL_checkudata((L), (narg), HEADERS_MT))
+
+#define check_query(L, narg)                                    \
+    ((lhp_buf*)luaL_checkudata((L), (narg), QUERY_MT))
+
 /* The Lua stack indices */
+#define ST_INPUT_IDX  2
 #define ST_FENV_IDX   3
-#define ST_BUFFER_IDX 4
-#define ST_LEN        ST_BUFFER_IDX
+#define ST_LEN        ST_FENV_IDX
+
+/* In callback mode events pile up on the Lua stack until execute
+ * returns.  Once the stack holds this many slots the parser is paused
+ * so the lua stub can run the callbacks and resume where it stopped,
+ * which keeps well clear of the LUAI_MAXCSTACK limit of Lua 5.1 and
+ * LuaJIT.
+ */
+#define LHP_MAX_STACK 1024
+
+/* execute_into() keeps the caller's events table just above the
+ * fenv instead of the result place-holder.
+ */
+#define ST_EVENTS_IDX (ST_LEN+1)
 
 /* Callback identifiers are indices into the fenv table where the
- * callback is saved.  If you add/remove/change anything about these,
- * be sure to update lhp_callback_names and FLAG_GET_BUF_CB_ID.
+ * callback is saved.  Parsers made by a factory share the fenv of the
+ * factory, so nothing specific to one parser may be stored in it.
+ * If you add/remove/change anything about these, be sure to update
+ * lhp_callback_names and FLAG_GET_BUF_CB_ID.
  */
 #define CB_ON_MESSAGE_BEGIN      1
 #define CB_ON_URL                2
@@ -31,6 +98,7 @@
 #define CB_ON_MESSAGE_COMPLETE   7
 #define CB_ON_CHUNK_HEADER       8
 #define CB_ON_CHUNK_COMPLETE     9
+#define CB_ON_MESSAGE           10
 #define CB_LEN                   (sizeof(lhp_callback_names)/sizeof(*lhp_callback_names))
 
 static const char *lhp_callback_names[] = {
@@ -44,11 +112,12 @@ static const char *lhp_callback_names[] = {
     "on_message_complete",
     "on_chunk_header",
     "on_chunk_complete",
+    "on_message",
 };
 
 /* Non-callback FENV indices. */
-#define FENV_BUFFER_IDX         CB_LEN + 1
-#define FENV_LEN                FENV_BUFFER_IDX
+#define FENV_HEADERS_IDX        CB_LEN + 1
+#define FENV_LEN                FENV_HEADERS_IDX
 
 #define FLAGS_BUF_CB_ID_BITS 3
 #define FLAGS_BUF_CB_ID_MASK ((1<<(FLAGS_BUF_CB_ID_BITS))-1)
@@ -66,7 +135,8 @@ static const char *lhp_callback_names[] = {
  * data is buffered for that callback.
  *
  * The FLAG_*_HFIELD() macros test/set/remove the bit that signifies
- * that the first element of the buffer is the header field key.
+ * that the first hfield_len bytes of the buffer are the header field
+ * key.
  */
 #define FLAG_HAS_CB(flags, cb_id)  ( (flags) &   CB_ID_TO_CB_BIT(cb_id) )
 #define FLAG_SET_CB(flags, cb_id)  ( (flags) |=  CB_ID_TO_CB_BIT(cb_id) )
@@ -81,6 +151,202 @@ static const char *lhp_callback_names[] = {
 #define FLAG_SET_HFIELD(flags)     ( (flags) |= FLAGS_CB_ID_FIRST_BIT )
 #define FLAG_RM_HFIELD(flags)      ( (flags) &= ~FLAGS_CB_ID_FIRST_BIT )
 
+/* The FLAG_*_SKIP() macros test/set/remove the bit that signifies that
+ * the value of the current header is dropped because its field is not
+ * in the headers allowlist.  It is the bit after the last callback.
+ */
+#define FLAGS_SKIP_BIT             CB_ID_TO_CB_BIT(CB_LEN + 1)
+#define FLAG_HAS_SKIP(flags)       ( (flags) & FLAGS_SKIP_BIT )
+#define FLAG_SET_SKIP(flags)       ( (flags) |= FLAGS_SKIP_BIT )
+#define FLAG_RM_SKIP(flags)        ( (flags) &= ~FLAGS_SKIP_BIT )
+
+/* When an on_message callback is registered (or in execute_all) the
+ * parser aggregates messages: the events of the callbacks in
+ * FLAGS_COLLECTED_CBS are collected into a message table instead of
+ * being delivered, the body is accumulated like with accumulate_body,
+ * and the finished table is delivered as on_message(message).  See
+ * LHP_AGGREGATE().
+ */
+#define FLAGS_COLLECTED_CBS ( CB_ID_TO_CB_BIT(CB_ON_URL)    | \
+                              CB_ID_TO_CB_BIT(CB_ON_STATUS) | \
+                              CB_ID_TO_CB_BIT(CB_ON_HEADER) )
+
+/* Common header field names.  A Lua string for each of them is created
+ * once by luaopen_http_parser() and kept in the header names table,
+ * which is upvalue 1 of every C function that runs the parser.  The
+ * canonical names are at [idx] and the lowercase ones at
+ * [LHP_HEADER_NAMES_LEN + idx].
+ */
+static const char *lhp_header_names[] = {
+    "Accept",
+    "Accept-Charset",
+    "Accept-Encoding",
+    "Accept-Language",
+    "Accept-Ranges",
+    "Age",
+    "Authorization",
+    "Cache-Control",
+    "Connection",
+    "Content-Disposition",
+    "Content-Encoding",
+    "Content-Language",
+    "Content-Length",
+    "Content-Type",
+    "Cookie",
+    "Date",
+    "ETag",
+    "Expect",
+    "Expires",
+    "Host",
+    "If-Modified-Since",
+    "If-None-Match",
+    "Keep-Alive",
+    "Last-Modified",
+    "Location",
+    "Origin",
+    "Pragma",
+    "Range",
+    "Referer",
+    "Server",
+    "Set-Cookie",
+    "Transfer-Encoding",
+    "Upgrade",
+    "User-Agent",
+    "Vary",
+    "Via",
+    "X-Forwarded-For",
+    "X-Requested-With",
+};
+#define LHP_HEADER_NAMES_LEN     (sizeof(lhp_header_names)/sizeof(*lhp_header_names))
+#define ST_NAMES_IDX             lua_upvalueindex(1)
+
+/* Perfect hash over lhp_header_names ignoring case.  lhp_header_slots
+ * maps a hash to the 1-based index into lhp_header_names, or 0.  If you
+ * change the names both need to be regenerated.
+ */
+#define LHP_HEADER_HASH(str, len)                                      \
+    ( ( (len)                                                          \
+        + ((unsigned char)(str)[0]         | 0x20) * 21                \
+        + ((unsigned char)(str)[(len) - 1] | 0x20) * 24                \
+        + ((unsigned char)(str)[(len) / 2] | 0x20) ) & 127 )
+
+static const unsigned char lhp_header_slots[128] = {
+     0, 19,  0,  0,  0,  0,  0,  0, 15, 37, 33,  0,  0,  0,  0, 21,
+     0,  3,  0, 12, 18,  0,  0, 14,  0,  0, 13, 30, 38,  0,  0,  0,
+     0,  0,  0,  0, 16,  0,  0,  0, 25,  0, 23,  0,  0,  0,  0,  8,
+     0,  0, 36,  0,  0, 27,  0,  0, 24,  0,  0,  7, 11,  0,  0,  0,
+     1,  0,  0,  0,  0, 28,  2,  0,  0,  0,  0,  0,  0,  0,  0, 22,
+     0,  0,  0,  0,  0,  0, 17,  6, 26,  0,  0,  0,  9,  0,  0, 20,
+    31,  0,  0,  0, 34,  0,  0,  0,  4,  0, 32, 10,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0, 29,  5,  0,  0,  0,  0, 35,  0,  0,  0,
+};
+
+/* The header fields given as the headers option, compiled into an
+ * open addressing hash set of lowercase names.  It is a userdata kept
+ * in the fenv at FENV_HEADERS_IDX, followed in memory by nslots slots
+ * and then the names.
+ */
+typedef struct lhp_header_slot {
+    size_t      off;        /* offset of the name after the slots. */
+    size_t      len;        /* name length, 0 if the slot is empty. */
+} lhp_header_slot;
+
+typedef struct lhp_header_set {
+    size_t      nslots;     /* a power of 2, at least twice the names. */
+} lhp_header_set;
+
+#define LHP_HEADER_SET_SLOTS(set) ((lhp_header_slot*)((set) + 1))
+#define LHP_HEADER_SET_NAMES(set) ((char*)(LHP_HEADER_SET_SLOTS(set) + (set)->nslots))
+
+/* A header recorded by lazy_headers: the field and then the value are
+ * the bytes at off.  hash is lhp_header_set_hash() of the field, set
+ * once the headers are complete.
+ */
+typedef struct lhp_header_span {
+    size_t      off;
+    size_t      field_len;
+    size_t      value_len;
+    size_t      hash;
+} lhp_header_span;
+
+/* The headers object of lazy_headers.  It is a userdata followed in
+ * memory by count spans, an open addressing index of nslots 1-based
+ * span numbers (0 for an empty slot) and then the header bytes.
+ */
+typedef struct lhp_headers {
+    size_t      count;
+    size_t      nslots;     /* a power of 2, at least twice count. */
+} lhp_headers;
+
+#define LHP_HEADERS_SPANS(h) ((lhp_header_span*)((h) + 1))
+#define LHP_HEADERS_INDEX(h) ((unsigned*)(LHP_HEADERS_SPANS(h) + (h)->count))
+#define LHP_HEADERS_BYTES(h) ((char*)(LHP_HEADERS_INDEX(h) + (h)->nslots))
+
+/* Options read from the callbacks table, see lhp_get_options(). */
+#define OPT_LOWERCASE_HEADERS    0x1
+#define OPT_BODY_SLICES          0x2
+#define OPT_ACCUMULATE_BODY      0x4
+#define OPT_SPLIT_URL            0x8
+#define OPT_DECODE_URL           0x10
+#define OPT_DECODE_BODY          0x20
+#define OPT_LAZY_HEADERS         0x40
+#define OPT_HIBERNATE            0x80
+
+/* Numeric limits read from the callbacks table, see lhp_get_limits().
+ * 0 means no limit.
+ */
+typedef struct lhp_limits {
+    size_t      max_url_size;    /* bytes of the request url. */
+    size_t      max_header_size; /* bytes of all header fields and values. */
+    size_t      max_headers;     /* number of headers. */
+    uint64_t    max_body_size;   /* bytes of the body. */
+    uint64_t    max_decoded_size; /* bytes of the body after decode_body. */
+} lhp_limits;
+
+/* Errors detected by this module rather than by http_parser.  The
+ * parser:error() code of LHP_ERR_x is HPE_UNKNOWN + LHP_ERR_x, and its
+ * name and description are at lhp_errors[LHP_ERR_x - 1].
+ */
+#define LHP_ERR_BODY_SINK        1
+#define LHP_ERR_BODY_TOO_LARGE   2
+#define LHP_ERR_URL_TOO_LARGE    3
+#define LHP_ERR_HEADER_TOO_LARGE 4
+#define LHP_ERR_TOO_MANY_HEADERS 5
+#define LHP_ERR_INVALID_URL      6
+#define LHP_ERR_DECODED_TOO_LARGE 7
+#define LHP_ERR_DECODE           8
+#define LHP_ERR_NO_MEMORY        9
+
+static const char *lhp_errors[][2] = {
+    { "LHP_BODY_SINK", "writing the body to the body_sink failed" },
+    { "LHP_BODY_TOO_LARGE", "the body is larger than max_body_size" },
+    { "LHP_URL_TOO_LARGE", "the url is larger than max_url_size" },
+    { "LHP_HEADER_TOO_LARGE", "the headers are larger than max_header_size" },
+    { "LHP_TOO_MANY_HEADERS", "there are more than max_headers headers" },
+    { "LHP_INVALID_URL", "the url could not be split by split_url" },
+    { "LHP_DECODED_TOO_LARGE", "the decoded body is larger than max_decoded_size" },
+    { "LHP_DECODE", "the body could not be decoded by decode_body" },
+    { "LHP_NO_MEMORY", "out of memory while buffering the message" },
+};
+
+/* Body bytes written to a body_sink fd are batched into up to this many
+ * iovecs.  They point into the input, so they are written before
+ * execute returns.
+ */
+#define LHP_SINK_IOV 16
+
+/* Where the body goes during an execute when a body_sink is set.  It
+ * lives on the C stack of lhp_run().
+ */
+typedef struct lhp_sink {
+    FILE*        file;      /* Lua file handle, or NULL to use fd. */
+    int          fd;
+#ifndef _WIN32
+    int          niov;
+    struct iovec iov[LHP_SINK_IOV];
+#endif
+} lhp_sink;
+
 static void lhp_pushint64(lua_State *L, int64_t v){
     // compilers usially remove constant condition on compile time
     if(sizeof(lua_Integer) >= sizeof(int64_t)){
@@ -90,141 +356,799 @@ static void lhp_pushint64(lua_State *L, int64_t v){
     lua_pushnumber(L, (lua_Number)v);
 }
 
+/* Where events go during the current execute.  In callback mode they
+ * are left on the Lua stack for the lua stub to call, in events mode
+ * they are stored in the table passed to execute_into() and in
+ * messages mode only aggregated messages are stored, in the array
+ * passed to execute_all().
+ */
+#define LHP_MODE_CALLBACKS 0
+#define LHP_MODE_EVENTS    1
+#define LHP_MODE_MESSAGES  2
+
+/* Each execute_into() record is (event code, arg1, arg2). */
+#define EV_STRIDE 3
+
+/* A growable byte buffer allocated with the allocator of the
+ * lua_State, so tokens split across execute calls never become Lua
+ * strings until they are complete.
+ */
+typedef struct lhp_buf {
+    char*       data;
+    size_t      len;
+    size_t      cap;
+} lhp_buf;
+
+#define LHP_BUF_MIN_CAP 64
+
+/* The lhp.buffer() userdata: an lhp_buf whose first head bytes were
+ * consumed.  They are reclaimed by moving the rest down when appending
+ * would otherwise grow the buffer.
+ */
+typedef struct lhp_bytebuf {
+    lhp_buf     buf;
+    size_t      head;
+} lhp_bytebuf;
+
+/* An accumulated body buffer larger than this is freed once the body
+ * is delivered rather than kept for the next message.
+ */
+#define LHP_BODY_KEEP_CAP (64 * 1024)
+
+/* max_decoded_size when none is given. */
+#define LHP_MAX_DECODED_SIZE (64 * 1024 * 1024)
+
+#ifdef LHP_ZLIB
+/* Content codings inflated by decode_body. */
+#define LHP_CODING_NONE    0
+#define LHP_CODING_GZIP    1
+#define LHP_CODING_DEFLATE 2
+
+/* Room for the start of the Content-Encoding value, enough for any
+ * coding decode_body knows.
+ */
+#define LHP_CODING_VALUE 8
+
+/* Inflated body bytes are delivered in pieces of up to this size. */
+#define LHP_INFLATE_WINDOW (32 * 1024)
+
+/* The zlib stream and output window of a decode_body parser, allocated
+ * when its first coded body begins and reused for the next ones.
+ */
+typedef struct lhp_inflate {
+    z_stream    zs;
+    int         init;       /* inflateInit2 was called on zs. */
+    int         nhead;      /* bytes held in head, 2 once the wrapper is known. */
+    unsigned char head[2];  /* start of a deflate body, see lhp_inflate_head(). */
+    int         done;       /* the end of the stream was reached. */
+    uint64_t    decoded;    /* decoded bytes of the current body. */
+    /* Left by a pause for the next round of execute: body bytes not
+     * inflated yet, at pending_off in the input, and whether zlib may
+     * hold more output. */
+    size_t      pending_off;
+    size_t      pending_len;
+    int         full;
+    char        window[LHP_INFLATE_WINDOW];
+} lhp_inflate;
+#endif
+
+/* Instrumentation counters, compiled in with -DLHP_STATS.  Each parser
+ * counts into its own lhp_stats and into the module wide one, which is
+ * a userdata in the registry at STATS_KEY.  -DLHP_STATS_TIMING also
+ * measures the time spent in C parsing and in the callbacks.
+ */
+#ifdef LHP_STATS_TIMING
+#ifndef LHP_STATS
+#define LHP_STATS
+#endif
+#endif
+
+#ifdef LHP_STATS
+#define STATS_KEY "http.parser{stats}"
+
+typedef struct lhp_stats {
+    uint64_t    bytes;          /* bytes parsed. */
+    uint64_t    messages;       /* messages completed. */
+    uint64_t    events[CB_LEN]; /* events delivered, by cb_id - 1. */
+    uint64_t    fragments;      /* token pieces appended to a buffered token. */
+    uint64_t    strings;        /* Lua strings created for tokens and bodies. */
+    uint64_t    buffered;       /* bytes copied into the token or body buffer. */
+    uint64_t    peak_buffer;    /* largest token or body buffer length. */
+#ifdef LHP_STATS_TIMING
+    uint64_t    parse_ns;       /* nanoseconds spent in http_parser_execute. */
+    uint64_t    callback_ns;    /* nanoseconds spent running callbacks. */
+#endif
+} lhp_stats;
+
+#define LHP_STAT_ADD(lparser, field, n) do {    \
+        (lparser)->stats.field   += (n);        \
+        (lparser)->global->field += (n);        \
+    } while (0)
+#define LHP_STAT_MAX(lparser, field, v) do {                            \
+        if ( (v) > (lparser)->stats.field )   (lparser)->stats.field = (v);   \
+        if ( (v) > (lparser)->global->field ) (lparser)->global->field = (v); \
+    } while (0)
+#else
+#define LHP_STAT_ADD(lparser, field, n) ((void)0)
+#define LHP_STAT_MAX(lparser, field, v) ((void)0)
+#endif
+
 typedef struct lhttp_parser {
     http_parser parser;     /* embedded http_parser. */
     int         flags;      /* See above flag test/set/remove macros. */
-    int         buf_len;    /* number of buffered chunks for current callback. */
+    int         options;    /* OPT_* bits. */
+    const lhp_scanner* scanner; /* see SCANNER_KEY. */
+    int         mode;       /* LHP_MODE_* for the current execute. */
+    int         nevents;    /* number of records written by execute_into(). */
+    int         shared;     /* fenv is the prototype of a factory. */
+    lhp_header_set* headers; /* allowlist in the fenv, or NULL for all. */
+    int         message;    /* registry ref of the message being aggregated. */
+    int         body_sink;  /* registry ref of the body_sink, or LUA_NOREF. */
+    int         error;      /* LHP_ERR_* or 0. */
+    lhp_sink*   sink;       /* body_sink of the current execute, or NULL. */
+    size_t      hfield_len; /* length of the header field key in buf. */
+    const char* input;      /* start of the string being executed. */
+    lhp_buf     buf;        /* buffered bytes for the current callback. */
+    lhp_buf     body;       /* accumulated body of the current message. */
+    lhp_buf     hspans;     /* lazy_headers: lhp_header_span records. */
+    lhp_buf     hbytes;     /* lazy_headers: their bytes. */
+    uint64_t    body_read;  /* body bytes of the current message so far. */
+    size_t      url_size;   /* url bytes of the current message so far. */
+    size_t      header_size; /* header bytes of the current message so far. */
+    size_t      nheaders;   /* headers of the current message so far. */
+    int         in_value;   /* the last header data was a value. */
+    int         in_message; /* between message begin and complete. */
+    lhp_limits  limits;
+#ifdef LHP_ZLIB
+    int         coding;     /* LHP_CODING_* of the current body. */
+    int         ce_match;   /* bytes of "content-encoding" matched by the
+                             * current header field, -1 if it differs. */
+    size_t      ce_len;     /* bytes of the Content-Encoding value. */
+    char        ce_value[LHP_CODING_VALUE];
+    lhp_inflate* inflate;   /* NULL until a coded body is seen. */
+#endif
+#ifdef LHP_STATS
+    lhp_stats   stats;
+    lhp_stats*  global;     /* the module wide stats. */
+#endif
+#ifdef LHP_STATS_TIMING
+    uint64_t    callbacks_start; /* when the callbacks started, or 0. */
+#endif
 } lhttp_parser;
 
-/* Concatinate and remove elements from the table at idx starting at
- * element begin and going to length len.  The final concatinated string
- * is on the top of the stack.
+/* A factory validates a callbacks table once into a prototype fenv,
+ * which every parser it creates shares.
  */
-static int lhp_table_concat_and_clear(lua_State *L, int idx, int begin, int len) {
-    luaL_Buffer   buff;
-    int           real_len = len-begin+1;
+typedef struct lhp_factory {
+    int         flags;      /* FLAG_*_CB() bits of the prototype. */
+    int         options;    /* OPT_* bits. */
+    lhp_header_set* headers; /* allowlist in the fenv, or NULL for all. */
+    lhp_limits  limits;
+} lhp_factory;
+
+/* Make room for extra more bytes in buf.  Returns -1 if out of memory.
+ */
+static int lhp_buf_reserve(lua_State* L, lhp_buf* buf, size_t extra) {
+    void*     ud;
+    lua_Alloc allocf;
+    size_t    cap;
+    char*     data;
+
+    if ( buf->cap - buf->len >= extra ) return 0;
+
+    cap = buf->cap ? buf->cap : LHP_BUF_MIN_CAP;
+    while ( cap - buf->len < extra ) {
+        if ( cap > ((size_t)-1) / 2 ) return -1;
+        cap *= 2;
+    }
 
-    /* Empty table? */
-    if ( !real_len ) {
-        lua_pushliteral(L, "");
-        return 0;
+    allocf = lua_getallocf(L, &ud);
+    data   = (char*)allocf(ud, buf->data, buf->cap, cap);
+    if ( NULL == data ) return -1;
+
+    buf->data = data;
+    buf->cap  = cap;
+    return 0;
+}
+
+static int lhp_buf_append(lua_State* L, lhp_buf* buf, const char* str, size_t len) {
+    if ( 0 != lhp_buf_reserve(L, buf, len) ) return -1;
+    memcpy(buf->data + buf->len, str, len);
+    buf->len += len;
+    return 0;
+}
+
+/* Grow buf to hold exactly size more bytes, for a known final size.
+ */
+static int lhp_buf_presize(lua_State* L, lhp_buf* buf, size_t size) {
+    void*     ud;
+    lua_Alloc allocf;
+    char*     data;
+
+    if ( buf->cap - buf->len >= size ) return 0;
+    if ( size > ((size_t)-1) - buf->len ) return -1;
+
+    allocf = lua_getallocf(L, &ud);
+    data   = (char*)allocf(ud, buf->data, buf->cap, buf->len + size);
+    if ( NULL == data ) return -1;
+
+    buf->data = data;
+    buf->cap  = buf->len + size;
+    return 0;
+}
+
+static void lhp_buf_free(lua_State* L, lhp_buf* buf) {
+    void*     ud;
+    lua_Alloc allocf;
+
+    if ( NULL != buf->data ) {
+        allocf = lua_getallocf(L, &ud);
+        allocf(ud, buf->data, buf->cap, 0);
     }
+    buf->data = NULL;
+    buf->len  = 0;
+    buf->cap  = 0;
+}
 
-    /* One element? */
-    if ( 1 == real_len ) {
-        lua_rawgeti(L, idx, begin);
-        /* remove values from buffer. */
-        lua_pushnil(L);
-        lua_rawseti(L, idx, begin);
-        return 0;
+/* Shrink buf to its contents, or free it if it is empty.  Returns the
+ * number of bytes released.
+ */
+static size_t lhp_buf_shrink(lua_State* L, lhp_buf* buf) {
+    size_t    cap = buf->cap;
+    void*     ud;
+    lua_Alloc allocf;
+    char*     data;
+
+    if ( 0 == buf->len ) {
+        lhp_buf_free(L, buf);
+        return cap;
     }
+    if ( buf->len == cap ) return 0;
 
-    /* do a table concat. */
-    luaL_buffinit(L, &buff);
-    for(; begin <= len; begin++) {
-        lua_rawgeti(L, idx, begin);
-        luaL_addvalue(&buff);
-        /* remove values from buffer. */
-        lua_pushnil(L);
-        lua_rawseti(L, idx, begin);
+    allocf = lua_getallocf(L, &ud);
+    data   = (char*)allocf(ud, buf->data, cap, buf->len);
+    if ( NULL == data ) return 0; /* keep the larger block. */
+
+    buf->data = data;
+    buf->cap  = buf->len;
+    return cap - buf->len;
+}
+
+#define LHP_AGGREGATE(lparser) \
+    ( LHP_MODE_MESSAGES == (lparser)->mode || FLAG_HAS_CB((lparser)->flags, CB_ON_MESSAGE) )
+#define LHP_COLLECTS(lparser, cb_id) \
+    ( LHP_AGGREGATE(lparser) && (FLAGS_COLLECTED_CBS & CB_ID_TO_CB_BIT(cb_id)) )
+
+/* In events mode every event is reported, whether or not a callback
+ * was registered for it, and in messages mode only messages are.
+ * Aggregating parsers need all the events they collect.
+ */
+#define LHP_HAS_CB(lparser, cb_id) \
+    ( LHP_MODE_EVENTS == (lparser)->mode \
+      || ( LHP_MODE_CALLBACKS == (lparser)->mode && FLAG_HAS_CB((lparser)->flags, cb_id) ) \
+      || LHP_COLLECTS(lparser, cb_id) \
+      || ( LHP_MODE_MESSAGES == (lparser)->mode && CB_ON_MESSAGE == (cb_id) ) )
+
+static void lhp_push_method(lua_State* L, unsigned int method) {
+    switch(method) {
+    case HTTP_DELETE:    lua_pushliteral(L, "DELETE"); break;
+    case HTTP_GET:       lua_pushliteral(L, "GET"); break;
+    case HTTP_HEAD:      lua_pushliteral(L, "HEAD"); break;
+    case HTTP_POST:      lua_pushliteral(L, "POST"); break;
+    case HTTP_PUT:       lua_pushliteral(L, "PUT"); break;
+    case HTTP_CONNECT:   lua_pushliteral(L, "CONNECT"); break;
+    case HTTP_OPTIONS:   lua_pushliteral(L, "OPTIONS"); break;
+    case HTTP_TRACE:     lua_pushliteral(L, "TRACE"); break;
+    case HTTP_COPY:      lua_pushliteral(L, "COPY"); break;
+    case HTTP_LOCK:      lua_pushliteral(L, "LOCK"); break;
+    case HTTP_MKCOL:     lua_pushliteral(L, "MKCOL"); break;
+    case HTTP_MOVE:      lua_pushliteral(L, "MOVE"); break;
+    case HTTP_PROPFIND:  lua_pushliteral(L, "PROPFIND"); break;
+    case HTTP_PROPPATCH: lua_pushliteral(L, "PROPPATCH"); break;
+    case HTTP_UNLOCK:    lua_pushliteral(L, "UNLOCK"); break;
+    default:
+        lua_pushnumber(L, method);
+    }
+}
+
+/* Push the message being aggregated, creating it if this is the first
+ * event of the message.  The message is kept in the registry rather
+ * than the fenv, which may be shared with other parsers.
+ */
+static void lhp_push_message(lhttp_parser* lparser) {
+    lua_State* L = (lua_State*)lparser->parser.data;
+
+    if ( LUA_NOREF != lparser->message ) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, lparser->message);
+        return;
+    }
+
+    lua_createtable(L, 0, 8);
+    lua_newtable(L);
+    lua_setfield(L, -2, "headers");
+    lua_pushvalue(L, -1);
+    lparser->message = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+/* Forget the message being aggregated, if any.
+ */
+static void lhp_drop_message(lua_State* L, lhttp_parser* lparser) {
+    luaL_unref(L, LUA_REGISTRYINDEX, lparser->message);
+    lparser->message = LUA_NOREF;
+}
+
+/* Pop the nargs arguments of the cb_id event into the message being
+ * aggregated.  Repeated headers are joined with ", ".
+ */
+static void lhp_collect(lhttp_parser* lparser, int cb_id, int nargs) {
+    lua_State* L = (lua_State*)lparser->parser.data;
+
+    lhp_push_message(lparser);
+    lua_insert(L, -(nargs + 1));
+    /* Stack: message, <args> */
+
+    switch ( cb_id ) {
+    case CB_ON_URL:
+        if ( 3 == nargs ) {
+            lua_setfield(L, -4, "fragment");
+            lua_setfield(L, -3, "query");
+            lua_setfield(L, -2, "path");
+        } else {
+            lua_setfield(L, -2, "url");
+        }
+        break;
+    case CB_ON_STATUS:
+        lua_setfield(L, -3, "status_text");
+        lua_pop(L, 1); /* status code is set by on_headers_complete. */
+        break;
+    case CB_ON_HEADER:
+        lua_getfield(L, -3, "headers");
+        lua_insert(L, -3);
+        /* Stack: message, headers, field, value */
+        lua_pushvalue(L, -2);
+        lua_rawget(L, -4);
+        if ( ! lua_isnil(L, -1) ) {
+            lua_pushliteral(L, ", ");
+            lua_pushvalue(L, -3);
+            lua_concat(L, 3);
+            lua_replace(L, -2);
+        } else {
+            lua_pop(L, 1);
+        }
+        lua_rawset(L, -3);
+        lua_pop(L, 1);
+        break;
+    default:
+        assert(0 /* not a collected cb_id */);
+        lua_pop(L, nargs);
+    }
+    lua_pop(L, 1);
+}
+
+/* Deliver the event for cb_id whose nargs (1 to 3) arguments are on
+ * the top of the Lua stack.  In callback mode the callback function
+ * is inserted below the arguments for the lua stub to call, in events
+ * mode the (at most 2) arguments are popped into the next record of
+ * the events table.
+ */
+static void lhp_emit(lhttp_parser* lparser, int cb_id, int nargs) {
+    lua_State* L = (lua_State*)lparser->parser.data;
+
+    assert(nargs >= 1 && nargs <= 3);
+
+    LHP_STAT_ADD(lparser, events[cb_id - 1], 1);
+
+    if ( LHP_COLLECTS(lparser, cb_id) ) {
+        lhp_collect(lparser, cb_id, nargs);
+        return;
+    }
+
+    if ( LHP_MODE_EVENTS == lparser->mode ) {
+        int base = EV_STRIDE * lparser->nevents++;
+
+        assert(nargs < EV_STRIDE);
+
+        if ( nargs < 2 ) lua_pushnil(L);
+        lua_rawseti(L, ST_EVENTS_IDX, base + 3);
+        lua_rawseti(L, ST_EVENTS_IDX, base + 2);
+        lua_pushinteger(L, cb_id);
+        lua_rawseti(L, ST_EVENTS_IDX, base + 1);
+        return;
+    }
+
+    if ( LHP_MODE_MESSAGES == lparser->mode ) {
+        assert(CB_ON_MESSAGE == cb_id && 1 == nargs);
+        lua_rawseti(L, ST_EVENTS_IDX, ++lparser->nevents);
+        return;
+    }
+
+    lua_rawgeti(L, ST_FENV_IDX, cb_id);
+    lua_insert(L, -(nargs + 1));
+
+    if ( lua_gettop(L) >= LHP_MAX_STACK &&
+         HPE_OK == HTTP_PARSER_ERRNO(&(lparser->parser)) ) {
+        http_parser_pause(&(lparser->parser), 1);
+    }
+}
+
+/* Returns the 1-based index of str in lhp_header_names, or 0 if it is
+ * not a common header.  If lower, str is already lowercase and is
+ * matched against the lowercase name.
+ */
+static int lhp_header_name_idx(const char* str, size_t len, int lower) {
+    const char* name;
+    size_t      i;
+    int         idx;
+
+    if ( 0 == len ) return 0;
+
+    idx = lhp_header_slots[LHP_HEADER_HASH(str, len)];
+    if ( 0 == idx ) return 0;
+
+    name = lhp_header_names[idx-1];
+    for ( i = 0; i < len; i++ ) {
+        char c = name[i];
+        if ( '\0' == c ) return 0;
+        if ( lower && c >= 'A' && c <= 'Z' ) c |= 0x20;
+        if ( c != str[i] ) return 0;
+    }
+    return '\0' == name[len] ? idx : 0;
+}
+
+/* Push a header field key, reusing the interned string of common
+ * headers.  With OPT_LOWERCASE_HEADERS the key is lowercased in place.
+ */
+static void lhp_push_header_field(lhttp_parser* lparser, char* str, size_t len) {
+    lua_State* L = (lua_State*)lparser->parser.data;
+    int        lower = lparser->options & OPT_LOWERCASE_HEADERS;
+    int        idx;
+
+    if ( lower ) lhp_lowercase(lparser->scanner, str, len);
+
+    idx = lhp_header_name_idx(str, len, lower);
+    if ( idx ) {
+        lua_rawgeti(L, ST_NAMES_IDX, lower ? (int)LHP_HEADER_NAMES_LEN + idx : idx);
+    } else {
+        lua_pushlstring(L, str, len);
+        LHP_STAT_ADD(lparser, strings, 1);
+    }
+}
+
+/* FNV-1a of the lowercased str. */
+static size_t lhp_header_set_hash(const char* str, size_t len) {
+    size_t hash = 2166136261u;
+    for ( ; len; str++, len-- ) {
+        hash ^= (unsigned char)(*str | 0x20);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* Returns non-zero if the header field str is in the set, ignoring
+ * case.
+ */
+static int lhp_header_set_has(const lhp_header_set* set, const char* str, size_t len) {
+    const lhp_header_slot* slots = LHP_HEADER_SET_SLOTS(set);
+    const char*            names = LHP_HEADER_SET_NAMES(set);
+    size_t                 mask  = set->nslots - 1;
+    size_t                 i     = lhp_header_set_hash(str, len) & mask;
+
+    if ( 0 == len ) return 0;
+
+    for ( ; slots[i].len; i = (i + 1) & mask ) {
+        const char* name = names + slots[i].off;
+        size_t      j;
+
+        if ( slots[i].len != len ) continue;
+        for ( j = 0; j < len; j++ ) {
+            char c = str[j];
+            if ( c >= 'A' && c <= 'Z' ) c |= 0x20;
+            if ( c != name[j] ) break;
+        }
+        if ( j == len ) return 1;
     }
-    luaL_pushresult(&buff);
     return 0;
 }
 
-/* Clear all elements in the table at idx starting at
- * element begin and going to length len.
+/* Returns non-zero if the len bytes at a and b are equal ignoring case.
  */
-static int lhp_table_clear(lua_State *L, int idx, int begin, int len) {
-    /* nil all elements. */
-    for(; begin <= len; begin++) {
-        /* remove element from table. */
-        lua_pushnil(L);
-        lua_rawseti(L, idx, begin);
+static int lhp_header_name_eq(const char* a, const char* b, size_t len) {
+    for ( ; len; a++, b++, len-- ) {
+        char ca = *a;
+        char cb = *b;
+        if ( ca >= 'A' && ca <= 'Z' ) ca |= 0x20;
+        if ( cb >= 'A' && cb <= 'Z' ) cb |= 0x20;
+        if ( ca != cb ) return 0;
+    }
+    return 1;
+}
+
+/* Stop the parser with the err LHP_ERR_* error. */
+static int lhp_fail(lhttp_parser* lparser, int err) {
+    lparser->error = err;
+    return -1;
+}
+
+/* Record len more bytes of a header field (hfield is 0) or value for
+ * lazy_headers.  Must run before lhp_header_limits() records which one
+ * came last.  Returns -1 with LHP_ERR_NO_MEMORY if out of memory.
+ */
+static int lhp_lazy_header(lhttp_parser* lparser, const char* str, size_t len, int hfield) {
+    lua_State*       L = (lua_State*)lparser->parser.data;
+    lhp_header_span* span;
+
+    if ( ! hfield && (lparser->in_value || 0 == lparser->nheaders) ) {
+        lhp_header_span next;
+        next.off       = lparser->hbytes.len;
+        next.field_len = 0;
+        next.value_len = 0;
+        next.hash      = 0;
+        if ( 0 != lhp_buf_append(L, &(lparser->hspans), (const char*)&next, sizeof(next)) ) {
+            return lhp_fail(lparser, LHP_ERR_NO_MEMORY);
+        }
+    }
+    if ( 0 == lparser->hspans.len ) return 0;
+
+    span = (lhp_header_span*)(lparser->hspans.data + lparser->hspans.len) - 1;
+    if ( hfield ) {
+        span->value_len += len;
+    } else {
+        span->field_len += len;
+    }
+    if ( 0 != lhp_buf_append(L, &(lparser->hbytes), str, len) ) {
+        return lhp_fail(lparser, LHP_ERR_NO_MEMORY);
+    }
+    return 0;
+}
+
+/* Push the headers object of the recorded headers and forget them.
+ * Headers not in the headers option are left out, and fields are
+ * lowercased with lowercase_headers.
+ */
+static void lhp_push_headers(lhttp_parser* lparser) {
+    lua_State*             L = (lua_State*)lparser->parser.data;
+    const lhp_header_span* spans = (const lhp_header_span*)lparser->hspans.data;
+    size_t                 nspans = lparser->hspans.len / sizeof(lhp_header_span);
+    size_t                 count = 0;
+    size_t                 total = 0;
+    size_t                 nslots = 4;
+    size_t                 off = 0;
+    size_t                 i;
+    lhp_headers*           h;
+    lhp_header_span*       out;
+    unsigned*              index;
+    char*                  bytes;
+
+    for ( i = 0; i < nspans; i++ ) {
+        const char* field = lparser->hbytes.data + spans[i].off;
+        if ( NULL != lparser->headers &&
+             ! lhp_header_set_has(lparser->headers, field, spans[i].field_len) ) {
+            continue;
+        }
+        count++;
+        total += spans[i].field_len + spans[i].value_len;
+    }
+    while ( nslots < 2 * count ) nslots *= 2;
+
+    h = (lhp_headers*)lua_newuserdata(L, sizeof(lhp_headers)
+        + count * sizeof(lhp_header_span) + nslots * sizeof(unsigned) + total);
+    h->count  = count;
+    h->nslots = nslots;
+    out   = LHP_HEADERS_SPANS(h);
+    index = LHP_HEADERS_INDEX(h);
+    bytes = LHP_HEADERS_BYTES(h);
+    memset(index, 0, nslots * sizeof(unsigned));
+
+    for ( i = 0; i < nspans; i++ ) {
+        const char* field = lparser->hbytes.data + spans[i].off;
+        size_t      len = spans[i].field_len + spans[i].value_len;
+        size_t      slot;
+
+        if ( NULL != lparser->headers &&
+             ! lhp_header_set_has(lparser->headers, field, spans[i].field_len) ) {
+            continue;
+        }
+        memcpy(bytes + off, field, len);
+        if ( lparser->options & OPT_LOWERCASE_HEADERS ) {
+            lhp_lowercase(lparser->scanner, bytes + off, spans[i].field_len);
+        }
+        out->off       = off;
+        out->field_len = spans[i].field_len;
+        out->value_len = spans[i].value_len;
+        out->hash      = lhp_header_set_hash(field, spans[i].field_len);
+
+        slot = out->hash & (nslots - 1);
+        while ( index[slot] ) slot = (slot + 1) & (nslots - 1);
+        index[slot] = (unsigned)(out - LHP_HEADERS_SPANS(h)) + 1;
+
+        off += len;
+        out++;
+    }
+
+    luaL_getmetatable(L, HEADERS_MT);
+    lua_setmetatable(L, -2);
+
+    lparser->hspans.len = 0;
+    lparser->hbytes.len = 0;
+}
+
+/* Value of the hex digit c, or -1. */
+static int lhp_hex_value(char c) {
+    if ( c >= '0' && c <= '9' ) return c - '0';
+    if ( c >= 'a' && c <= 'f' ) return c - 'a' + 10;
+    if ( c >= 'A' && c <= 'F' ) return c - 'A' + 10;
+    return -1;
+}
+
+/* Returns the byte scanner of the lua_State, the fastest one the CPU
+ * supports until lhp.scanner() picks another.
+ */
+static const lhp_scanner* lhp_get_scanner(lua_State* L) {
+    const lhp_scanner* scanner;
+
+    lua_getfield(L, LUA_REGISTRYINDEX, SCANNER_KEY);
+    scanner = (const lhp_scanner*)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    if ( NULL == scanner ) {
+        scanner = lhp_scanner_find(NULL);
+        lua_pushlightuserdata(L, (void*)scanner);
+        lua_setfield(L, LUA_REGISTRYINDEX, SCANNER_KEY);
+    }
+    return scanner;
+}
+
+/* Percent-decode the len bytes at str in place.  Invalid escapes are
+ * kept as they are.  Returns the decoded length.
+ */
+static size_t lhp_url_decode(const lhp_scanner* scanner, char* str, size_t len) {
+    size_t i, j;
+
+    /* Nothing moves before the first escape. */
+    i = j = lhp_scan(scanner, str, len, '%', '%');
+    for ( ; i < len; i++, j++ ) {
+        int hi, lo;
+        if ( '%' == str[i] && i + 2 < len &&
+             (hi = lhp_hex_value(str[i+1])) >= 0 &&
+             (lo = lhp_hex_value(str[i+2])) >= 0 ) {
+            str[j] = (char)((hi << 4) | lo);
+            i += 2;
+        } else {
+            str[j] = str[i];
+        }
+    }
+    return j;
+}
+
+/* Push the path, query and fragment of the url of length len at str,
+ * nil for a missing part.  With decode the path and fragment are
+ * percent-decoded, the url bytes are overwritten by that.  Returns -1
+ * if the url can't be split.
+ */
+static int lhp_push_url_parts(lua_State* L, const lhp_scanner* scanner, char* str, size_t len, int decode) {
+    static const int fields[] = { UF_PATH, UF_QUERY, UF_FRAGMENT };
+    struct http_parser_url url;
+    int    i;
+
+    memset(&url, 0, sizeof(url));
+    if ( 0 != http_parser_parse_url(str, len, 0, &url) ) return -1;
+
+    for ( i = 0; i < 3; i++ ) {
+        int    id = fields[i];
+        char*  part = str + url.field_data[id].off;
+        size_t part_len = url.field_data[id].len;
+
+        if ( ! (url.field_set & (1 << id)) ) {
+            lua_pushnil(L);
+            continue;
+        }
+        if ( decode && UF_QUERY != id ) {
+            part_len = lhp_url_decode(scanner, part, part_len);
+        }
+        lua_pushlstring(L, part, part_len);
     }
     return 0;
 }
 
 /* "Flush" the buffer for the callback identified by cb_id.  The
  * CB_ON_HEADER cb_id is flushed by inspecting FLAG_HAS_HFIELD().
- * If that bit is not set, then the buffer is concatinated into
- * a single string element in the buffer and nothing is pushed
- * on the Lua stack.  Otherwise the buffer table is cleared after
- * pushing the following onto the Lua stack:
+ * If that bit is not set, then the buffered bytes are the complete
+ * header field key, so hfield_len is set to mark them and nothing is
+ * emitted.  Otherwise the buffer is cleared after emitting the
+ * CB_ON_HEADER event with these arguments:
+ *
+ *   the first hfield_len bytes of the buffer,
+ *   the remaining bytes of the buffer
  *
- *   CB_ON_HEADER function,
- *   first element of the buffer,
- *   second - length element of the buffer concatinated
+ * If cb_id is not CB_ON_HEADER then the buffer is cleared after
+ * emitting the cb_id event with this argument:
  *
- * If cb_id is not CB_ON_HEADER then the buffer table is cleared after
- * pushing the following onto the Lua stack:
+ *   all the bytes of the buffer
  *
- *   cb_id function,
- *   first - length elements of the buffer concatinated
- *   
+ * See lhp_emit() for where emitted events end up.
  */
 static int lhp_flush(lhttp_parser* lparser, int cb_id) {
     lua_State*    L = (lua_State*)lparser->parser.data;
-    int           begin, len, result, top, save;
+    lhp_buf*      buf = &(lparser->buf);
+    size_t        len = buf->len;
+    int           nargs;
 
     assert(cb_id);
     assert(FLAG_HAS_BUF(lparser->flags, cb_id));
 
     if ( ! lua_checkstack(L, 7) ) return -1;
 
-    len   = lparser->buf_len;
-    begin = 1;
-    top   = lua_gettop(L);
-
     FLAG_RM_BUF(lparser->flags);
     if ( CB_ON_HEADER == cb_id ) {
-        if ( FLAG_HAS_HFIELD(lparser->flags) ) {
-            /* Push <func>, <arg1>[, <arg2>] */
-            lua_rawgeti(L, ST_FENV_IDX, cb_id);
-            lua_rawgeti(L, ST_BUFFER_IDX, 1);
-            lua_pushnil(L);
-            lua_rawseti(L, ST_BUFFER_IDX, 1);
-
-            begin    = 2;
-            save     = 0;
-            lparser->buf_len = 0;
-            FLAG_RM_HFIELD(lparser->flags);
-        } else {
-            /* Save */
-            begin    = 1;
-            save     = 1;
-            lparser->buf_len = 1;
+        if ( ! FLAG_HAS_HFIELD(lparser->flags) ) {
+            /* Save, or drop the header if it is not allowed. */
+            if ( NULL != lparser->headers &&
+                 ! lhp_header_set_has(lparser->headers, buf->data, len) ) {
+                FLAG_SET_SKIP(lparser->flags);
+                buf->len = 0;
+                return 0;
+            }
+            lparser->hfield_len = len;
+            return 0;
         }
+        FLAG_RM_HFIELD(lparser->flags);
+    }
+    buf->len = 0;
+
+    /* Buffered by execute_into(), but flushed by execute() without
+     * a callback registered. */
+    if ( ! LHP_HAS_CB(lparser, cb_id) ) return 0;
+
+    if ( CB_ON_HEADER == cb_id ) {
+        /* Push <arg1>, <arg2> */
+        lhp_push_header_field(lparser, buf->data, lparser->hfield_len);
+        lua_pushlstring(L, buf->data + lparser->hfield_len,
+                        len - lparser->hfield_len);
+        LHP_STAT_ADD(lparser, strings, 1);
+        nargs = 2;
     } else {
-        /* Push <func>[, <arg1>] */
-        lua_rawgeti(L, ST_FENV_IDX, cb_id);
+        /* Push [<arg1>, ]<arg2> */
+        nargs = 1;
         if (CB_ON_STATUS == cb_id){
             lua_pushinteger(L, lparser->parser.status_code);
+            nargs = 2;
         }
-        begin    = 1;
-        save     = 0;
-        lparser->buf_len = 0;
-    }
-
-    result = lhp_table_concat_and_clear(L, ST_BUFFER_IDX, begin, len);
-    if ( 0 != result ) {
-        lua_settop(L, top);
-        return result;
+        if ( CB_ON_URL == cb_id &&
+             (lparser->options & (OPT_SPLIT_URL | OPT_DECODE_URL)) &&
+             LHP_MODE_EVENTS != lparser->mode &&
+             HTTP_CONNECT != lparser->parser.method ) {
+            /* Push <path>, <query>, <fragment> */
+            if ( 0 != lhp_push_url_parts(L, lparser->scanner, buf->data, len,
+                                         lparser->options & OPT_DECODE_URL) ) {
+                lparser->error = LHP_ERR_INVALID_URL;
+                return -1;
+            }
+            LHP_STAT_ADD(lparser, strings, 3);
+            lhp_emit(lparser, cb_id, 3);
+            return 0;
+        }
+        lua_pushlstring(L, buf->data, len);
+        LHP_STAT_ADD(lparser, strings, 1);
     }
 
-    if ( save ) lua_rawseti(L, ST_BUFFER_IDX, 1);
-
+    lhp_emit(lparser, cb_id, nargs);
     return 0;
 }
 
-/* Puts the str of length len into the buffer table and
- * updates buf_len.  It also sets the buf flag for cb_id.
+/* Appends the str of length len to the buffer.  It also sets the buf
+ * flag for cb_id.
  */
 static int lhp_buffer(lhttp_parser* lparser, int cb_id, const char* str, size_t len, int hfield) {
     lua_State* L = (lua_State*)lparser->parser.data;
 
     assert(cb_id);
-    assert(FLAG_HAS_CB(lparser->flags, cb_id));
+    assert(LHP_HAS_CB(lparser, cb_id));
+
+    /* A token split across execute calls is appended to. */
+    if ( FLAG_HAS_BUF(lparser->flags, cb_id) ) {
+        LHP_STAT_ADD(lparser, fragments, 1);
+    }
+    LHP_STAT_ADD(lparser, buffered, len);
+    LHP_STAT_MAX(lparser, peak_buffer, lparser->buf.len + len);
 
     /* insert event chunk into buffer. */
     FLAG_SET_BUF(lparser->flags, cb_id);
@@ -232,29 +1156,34 @@ static int lhp_buffer(lhttp_parser* lparser, int cb_id, const char* str, size_t
         FLAG_SET_HFIELD(lparser->flags);
     }
 
-    lua_pushlstring(L, str, len);
-    lua_rawseti(L, ST_BUFFER_IDX, ++(lparser->buf_len));
-
+    if ( 0 != lhp_buf_append(L, &(lparser->buf), str, len) ) {
+        return lhp_fail(lparser, LHP_ERR_NO_MEMORY);
+    }
     return 0;
 }
 
-/* Push the zero argument event for cb_id.  Post condition:
- *  Lua stack contains <func>, nil
+/* Emit the zero argument event for cb_id.  The event is sent with
+ * a nil argument, except for CB_ON_CHUNK_HEADER which gets the chunk
+ * length.
  */
 static int lhp_push_nil_event(lhttp_parser* lparser, int cb_id) {
     lua_State* L = (lua_State*)lparser->parser.data;
 
-    assert(FLAG_HAS_CB(lparser->flags, cb_id));
+    assert(LHP_HAS_CB(lparser, cb_id));
 
     if ( ! lua_checkstack(L, 5) ) return -1;
 
-    lua_rawgeti(L, ST_FENV_IDX, cb_id);
     if(CB_ON_CHUNK_HEADER == cb_id){
       lhp_pushint64(L, lparser->parser.content_length);
     }
+    else if(CB_ON_MESSAGE_COMPLETE == cb_id && lparser->body.len){
+      lua_pushlstring(L, lparser->body.data, lparser->body.len);
+      LHP_STAT_ADD(lparser, strings, 1);
+    }
     else{
       lua_pushnil(L);
     }
+    lhp_emit(lparser, cb_id, 1);
 
     return 0;
 }
@@ -289,10 +1218,18 @@ static int lhp_http_data_cb(http_parser* parser, int cb_id, const char* str, siz
     int result = lhp_flush_except(lparser, cb_id, hfield);
     if ( 0 != result ) return result;
 
-    if ( ! FLAG_HAS_CB(lparser->flags, cb_id) ) return 0;
-
-    return lhp_buffer(lparser, cb_id, str, len, hfield);
-}
+    if ( ! LHP_HAS_CB(lparser, cb_id) ) return 0;
+
+    if ( CB_ON_HEADER == cb_id ) {
+        if ( ! hfield ) {
+            FLAG_RM_SKIP(lparser->flags);
+        } else if ( FLAG_HAS_SKIP(lparser->flags) ) {
+            return 0;
+        }
+    }
+
+    return lhp_buffer(lparser, cb_id, str, len, hfield);
+}
 
 static int lhp_http_cb(http_parser* parser, int cb_id) {
     lhttp_parser* lparser = (lhttp_parser*)parser;
@@ -300,16 +1237,38 @@ static int lhp_http_cb(http_parser* parser, int cb_id) {
     int result = lhp_flush_except(lparser, cb_id, 0);
     if ( 0 != result ) return result;
 
-    if ( ! FLAG_HAS_CB(lparser->flags, cb_id) ) return 0;
+    if ( ! LHP_HAS_CB(lparser, cb_id) ) return 0;
 
     return lhp_push_nil_event(lparser, cb_id);
 }
 
 static int lhp_message_begin_cb(http_parser* parser) {
+    lhttp_parser* lparser = (lhttp_parser*)parser;
+
+    lparser->url_size    = 0;
+    lparser->header_size = 0;
+    lparser->nheaders    = 0;
+    lparser->in_value    = 0;
+    lparser->in_message  = 1;
+    lparser->hspans.len  = 0;
+    lparser->hbytes.len  = 0;
+#ifdef LHP_ZLIB
+    lparser->coding      = LHP_CODING_NONE;
+    lparser->ce_match    = -1;
+    lparser->ce_len      = 0;
+#endif
+
     return lhp_http_cb(parser, CB_ON_MESSAGE_BEGIN);
 }
 
 static int lhp_url_cb(http_parser* parser, const char* str, size_t len) {
+    lhttp_parser* lparser = (lhttp_parser*)parser;
+
+    lparser->url_size += len;
+    if ( lparser->limits.max_url_size &&
+         lparser->url_size > lparser->limits.max_url_size ) {
+        return lhp_fail(lparser, LHP_ERR_URL_TOO_LARGE);
+    }
     return lhp_http_data_cb(parser, CB_ON_URL, str, len, 0);
 }
 
@@ -317,42 +1276,568 @@ static int lhp_status_cb(http_parser* parser, const char* str, size_t len) {
     return lhp_http_data_cb(parser, CB_ON_STATUS, str, len, 0);
 }
 
+/* Enforce max_header_size and max_headers for len more bytes of a
+ * header field (hfield is 0) or value.
+ */
+static int lhp_header_limits(lhttp_parser* lparser, size_t len, int hfield) {
+    const lhp_limits* limits = &(lparser->limits);
+
+    if ( ! hfield && (lparser->in_value || 0 == lparser->nheaders) ) {
+        lparser->nheaders++;
+        if ( limits->max_headers && lparser->nheaders > limits->max_headers ) {
+            return lhp_fail(lparser, LHP_ERR_TOO_MANY_HEADERS);
+        }
+    }
+    lparser->in_value = hfield;
+
+    lparser->header_size += len;
+    if ( limits->max_header_size &&
+         lparser->header_size > limits->max_header_size ) {
+        return lhp_fail(lparser, LHP_ERR_HEADER_TOO_LARGE);
+    }
+    return 0;
+}
+
+#ifdef LHP_ZLIB
+/* Look for the Content-Encoding header for decode_body in len more
+ * bytes of a header field (hfield is 0) or value.  Must run before
+ * lhp_header_limits() records which one came last.  A repeated
+ * Content-Encoding header makes the value too long to match a coding.
+ */
+static void lhp_coding_header(lhttp_parser* lparser, const char* str, size_t len, int hfield) {
+    static const char name[] = "content-encoding";
+    size_t i;
+
+    if ( ! hfield ) {
+        if ( lparser->in_value || 0 == lparser->nheaders ) lparser->ce_match = 0;
+        if ( lparser->ce_match < 0 ) return;
+        for ( i = 0; i < len; i++ ) {
+            size_t at = lparser->ce_match + i;
+            if ( at >= sizeof(name) - 1 || (str[i] | 0x20) != name[at] ) {
+                lparser->ce_match = -1;
+                return;
+            }
+        }
+        lparser->ce_match += (int)len;
+        return;
+    }
+
+    if ( sizeof(name) - 1 != (size_t)lparser->ce_match ) return;
+    if ( ! lparser->in_value && lparser->ce_len ) {
+        lparser->ce_len = LHP_CODING_VALUE + 1;
+    }
+    for ( i = 0; i < len && lparser->ce_len < LHP_CODING_VALUE; i++ ) {
+        lparser->ce_value[lparser->ce_len++] = str[i] | 0x20;
+    }
+    lparser->ce_len += len - i;
+}
+#endif
+
+/* With lazy_headers the headers are only recorded, on_header is not
+ * called.
+ */
 static int lhp_header_field_cb(http_parser* parser, const char* str, size_t len) {
+    lhttp_parser* lparser = (lhttp_parser*)parser;
+#ifdef LHP_ZLIB
+    if ( lparser->options & OPT_DECODE_BODY ) lhp_coding_header(lparser, str, len, 0);
+#endif
+    if ( lparser->options & OPT_LAZY_HEADERS ) {
+        if ( 0 != lhp_lazy_header(lparser, str, len, 0) ) return -1;
+        return lhp_header_limits(lparser, len, 0);
+    }
+    if ( 0 != lhp_header_limits(lparser, len, 0) ) return -1;
     return lhp_http_data_cb(parser, CB_ON_HEADER, str, len, 0);
 }
 
 static int lhp_header_value_cb(http_parser* parser, const char* str, size_t len) {
+    lhttp_parser* lparser = (lhttp_parser*)parser;
+#ifdef LHP_ZLIB
+    if ( lparser->options & OPT_DECODE_BODY ) lhp_coding_header(lparser, str, len, 1);
+#endif
+    if ( lparser->options & OPT_LAZY_HEADERS ) {
+        if ( 0 != lhp_lazy_header(lparser, str, len, 1) ) return -1;
+        return lhp_header_limits(lparser, len, 1);
+    }
+    if ( 0 != lhp_header_limits(lparser, len, 1) ) return -1;
     return lhp_http_data_cb(parser, CB_ON_HEADER, str, len, 1);
 }
 
+#define LHP_ACCUMULATE(lparser) \
+    ( LHP_AGGREGATE(lparser) || ((lparser)->options & OPT_ACCUMULATE_BODY) )
+
+#ifdef LHP_ZLIB
+/* Returns the LHP_CODING_* of the Content-Encoding value seen. */
+static int lhp_coding(const lhttp_parser* lparser) {
+    size_t len = lparser->ce_len;
+
+    if ( len > LHP_CODING_VALUE ) return LHP_CODING_NONE;
+    while ( len && (' ' == lparser->ce_value[len - 1] ||
+                    '\t' == lparser->ce_value[len - 1]) ) {
+        len--;
+    }
+    if ( (4 == len && 0 == memcmp(lparser->ce_value, "gzip", 4)) ||
+         (6 == len && 0 == memcmp(lparser->ce_value, "x-gzip", 6)) ) {
+        return LHP_CODING_GZIP;
+    }
+    if ( 7 == len && 0 == memcmp(lparser->ce_value, "deflate", 7) ) {
+        return LHP_CODING_DEFLATE;
+    }
+    return LHP_CODING_NONE;
+}
+
+/* Get the zlib stream ready if the body has a coding decode_body
+ * inflates.  The stream detects a gzip or zlib header by itself.
+ */
+static int lhp_coding_begin(lhttp_parser* lparser) {
+    lhp_inflate* inf = lparser->inflate;
+
+    if ( ! (lparser->options & OPT_DECODE_BODY) ) return 0;
+    lparser->coding = lhp_coding(lparser);
+    if ( LHP_CODING_NONE == lparser->coding ) return 0;
+
+    if ( NULL == inf ) {
+        void*     ud;
+        lua_Alloc allocf = lua_getallocf((lua_State*)lparser->parser.data, &ud);
+
+        inf = (lhp_inflate*)allocf(ud, NULL, 0, sizeof(lhp_inflate));
+        if ( NULL == inf ) return -1;
+        memset(&(inf->zs), 0, sizeof(inf->zs));
+        inf->init = 0;
+        lparser->inflate = inf;
+    }
+    if ( ! inf->init ) {
+        if ( Z_OK != inflateInit2(&(inf->zs), MAX_WBITS + 32) ) return -1;
+        inf->init = 1;
+    } else if ( Z_OK != inflateReset2(&(inf->zs), MAX_WBITS + 32) ) {
+        return -1;
+    }
+    inf->nhead       = LHP_CODING_DEFLATE == lparser->coding ? 0 : 2;
+    inf->done        = 0;
+    inf->decoded     = 0;
+    inf->pending_len = 0;
+    inf->full        = 0;
+    return 0;
+}
+
+/* Release the zlib stream and window. */
+static void lhp_inflate_free(lua_State* L, lhttp_parser* lparser) {
+    lhp_inflate* inf = lparser->inflate;
+    void*        ud;
+    lua_Alloc    allocf;
+
+    if ( NULL == inf ) return;
+    if ( inf->init ) inflateEnd(&(inf->zs));
+    allocf = lua_getallocf(L, &ud);
+    allocf(ud, inf, sizeof(lhp_inflate), 0);
+    lparser->inflate = NULL;
+}
+#endif
+
+/* Check the announced body size against max_body_size and reserve
+ * room for the body if it will be accumulated.  The Content-Length is
+ * only trusted up to max_body_size, or LHP_BODY_KEEP_CAP without a
+ * limit, a larger body grows the buffer as it arrives.
+ */
+static int lhp_body_begin(lhttp_parser* lparser) {
+    lua_State* L = (lua_State*)lparser->parser.data;
+    uint64_t   content_length = lparser->parser.content_length;
+    uint64_t   max = lparser->limits.max_body_size;
+
+    lparser->body_read = 0;
+    lparser->body.len  = 0;
+
+#ifdef LHP_ZLIB
+    if ( 0 != lhp_coding_begin(lparser) ) return -1;
+#endif
+
+    /* (uint64_t)-1 is used by http_parser when there is no length. */
+    if ( (uint64_t)-1 == content_length ) return 0;
+
+    if ( max && content_length > max ) {
+        return lhp_fail(lparser, LHP_ERR_BODY_TOO_LARGE);
+    }
+    if ( LHP_ACCUMULATE(lparser) && content_length > 0 &&
+         NULL == lparser->sink ) {
+        uint64_t reserve = max ? max : LHP_BODY_KEEP_CAP;
+        if ( reserve > content_length ) reserve = content_length;
+        if ( reserve > (size_t)-1 ) reserve = LHP_BODY_KEEP_CAP;
+        return lhp_buf_presize(L, &(lparser->body), (size_t)reserve);
+    }
+    return 0;
+}
+
+/* Forget the delivered body, and release the buffer if it is big.
+ */
+static void lhp_body_done(lhttp_parser* lparser) {
+    lparser->body.len = 0;
+    if ( lparser->body.cap > LHP_BODY_KEEP_CAP ) {
+        lhp_buf_free((lua_State*)lparser->parser.data, &(lparser->body));
+    }
+}
+
+/* on_headers_complete with lazy_headers: the headers object is its
+ * argument and the headers of aggregated messages.  Trailers are
+ * recorded too but dropped when the next message begins.
+ */
+static int lhp_lazy_headers_complete(lhttp_parser* lparser) {
+    lua_State* L = (lua_State*)lparser->parser.data;
+    int        emit = LHP_HAS_CB(lparser, CB_ON_HEADERS_COMPLETE);
+
+    int result = lhp_flush_except(lparser, CB_ON_HEADERS_COMPLETE, 0);
+    if ( 0 != result ) return result;
+
+    if ( ! emit && ! LHP_AGGREGATE(lparser) ) {
+        lparser->hspans.len = 0;
+        lparser->hbytes.len = 0;
+        return 0;
+    }
+    if ( ! lua_checkstack(L, 5) ) return -1;
+
+    lhp_push_headers(lparser);
+    if ( LHP_AGGREGATE(lparser) ) {
+        lhp_push_message(lparser);
+        lua_pushvalue(L, -2);
+        lua_setfield(L, -2, "headers");
+        lua_pop(L, 1);
+    }
+    if ( emit ) {
+        lhp_emit(lparser, CB_ON_HEADERS_COMPLETE, 1);
+    } else {
+        lua_pop(L, 1);
+    }
+    return 0;
+}
+
 static int lhp_headers_complete_cb(http_parser* parser) {
+    lhttp_parser* lparser = (lhttp_parser*)parser;
+
+    if ( 0 != lhp_body_begin(lparser) ) return -1;
+
+    if ( LHP_AGGREGATE(lparser) ) {
+        lua_State* L = (lua_State*)parser->data;
+        /* Flush the last header before describing the message. */
+        int result = lhp_flush_except(lparser, CB_ON_HEADERS_COMPLETE, 0);
+        if ( 0 != result ) return result;
+
+        if ( ! lua_checkstack(L, 5) ) return -1;
+
+        lhp_push_message(lparser);
+        if ( HTTP_REQUEST == parser->type ) {
+            lhp_push_method(L, parser->method);
+            lua_setfield(L, -2, "method");
+        } else {
+            lua_pushinteger(L, parser->status_code);
+            lua_setfield(L, -2, "status_code");
+        }
+        lua_pushinteger(L, parser->http_major);
+        lua_setfield(L, -2, "major");
+        lua_pushinteger(L, parser->http_minor);
+        lua_setfield(L, -2, "minor");
+        lua_pushboolean(L, parser->upgrade);
+        lua_setfield(L, -2, "upgrade");
+        lua_pop(L, 1);
+    }
+
+    if ( lparser->options & OPT_LAZY_HEADERS ) return lhp_lazy_headers_complete(lparser);
+
     return lhp_http_cb(parser, CB_ON_HEADERS_COMPLETE);
 }
 
-static int lhp_body_cb(http_parser* parser, const char* str, size_t len) {
+/* Write the queued body bytes to the sink.  Returns -1 on failure.
+ */
+static int lhp_sink_flush(lhttp_parser* lparser) {
+#ifndef _WIN32
+    lhp_sink*     sink = lparser->sink;
+    struct iovec* iov = sink->iov;
+    int           niov = sink->niov;
+
+    sink->niov = 0;
+    while ( niov > 0 ) {
+        ssize_t n = writev(sink->fd, iov, niov);
+        if ( n < 0 ) {
+            if ( EINTR == errno ) continue;
+            return lhp_fail(lparser, LHP_ERR_BODY_SINK);
+        }
+        /* Skip what was written. */
+        while ( niov > 0 && (size_t)n >= iov->iov_len ) {
+            n -= iov->iov_len;
+            iov++;
+            niov--;
+        }
+        if ( niov > 0 ) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+#else
+    (void)lparser;
+#endif
+    return 0;
+}
+
+/* Send len bytes of body to the sink.  Returns -1 on failure.
+ */
+static int lhp_sink_write(lhttp_parser* lparser, const char* str, size_t len) {
+    lhp_sink* sink = lparser->sink;
+
+    if ( NULL != sink->file ) {
+        if ( fwrite(str, 1, len, sink->file) == len ) return 0;
+        return lhp_fail(lparser, LHP_ERR_BODY_SINK);
+    }
+#ifndef _WIN32
+    if ( LHP_SINK_IOV == sink->niov && 0 != lhp_sink_flush(lparser) ) {
+        return -1;
+    }
+    sink->iov[sink->niov].iov_base = (void*)str;
+    sink->iov[sink->niov].iov_len  = len;
+    sink->niov++;
+#else
+    while ( len > 0 ) {
+        int n = _write(sink->fd, str, len > 0x40000000 ? 0x40000000 : (unsigned)len);
+        if ( n < 0 ) {
+            return lhp_fail(lparser, LHP_ERR_BODY_SINK);
+        }
+        str += n;
+        len -= n;
+    }
+#endif
+    return 0;
+}
+
+/* Deliver len bytes of body.  in_input is 0 for bytes that are not in
+ * the string being executed, which must not outlive the call.
+ */
+static int lhp_body_data(lhttp_parser* lparser, const char* str, size_t len, int in_input) {
     /* on_headers_complete did any flushing, so just push the cb */
-    lhttp_parser* lparser = (lhttp_parser*)parser;
-    lua_State*    L = (lua_State*)lparser->parser.data;
+    lua_State* L = (lua_State*)lparser->parser.data;
+
+    if ( NULL != lparser->sink ) {
+        if ( 0 != lhp_sink_write(lparser, str, len) ) return -1;
+        return in_input ? 0 : lhp_sink_flush(lparser);
+    }
+
+    if ( LHP_ACCUMULATE(lparser) ) {
+        LHP_STAT_ADD(lparser, buffered, len);
+        LHP_STAT_MAX(lparser, peak_buffer, lparser->body.len + len);
+        if ( 0 != lhp_buf_append(L, &(lparser->body), str, len) ) {
+            return lhp_fail(lparser, LHP_ERR_NO_MEMORY);
+        }
+        return 0;
+    }
 
-    if ( ! FLAG_HAS_CB(lparser->flags, CB_ON_BODY) ) return 0;
+    if ( ! LHP_HAS_CB(lparser, CB_ON_BODY) ) return 0;
 
     if ( ! lua_checkstack(L, 5) ) return -1;
 
-    lua_rawgeti(L, ST_FENV_IDX, CB_ON_BODY);
+    if ( in_input && (lparser->options & OPT_BODY_SLICES) ) {
+        /* Push [<input>, ]<offset>, <length> */
+        int nargs = 2;
+        if ( LHP_MODE_EVENTS != lparser->mode ) {
+            lua_pushvalue(L, ST_INPUT_IDX);
+            nargs = 3;
+        }
+        lhp_pushint64(L, str - lparser->input + 1);
+        lhp_pushint64(L, len);
+        lhp_emit(lparser, CB_ON_BODY, nargs);
+        return 0;
+    }
+
     lua_pushlstring(L, str, len);
+    LHP_STAT_ADD(lparser, strings, 1);
+    lhp_emit(lparser, CB_ON_BODY, 1);
+
+    return 0;
+}
+
+#ifdef LHP_ZLIB
+/* Some servers send deflate without the zlib header.  The first two
+ * bytes of a deflate body tell a zlib (or gzip) header from raw
+ * deflate, so they are held until both arrived, however the body is
+ * split.  Takes them from *next and *left; returns 1 once zs is set
+ * up and they are its next input, 0 while waiting, -1 on error.
+ */
+static int lhp_inflate_head(lhp_inflate* inf, const char** next, size_t* left) {
+    unsigned char* h = inf->head;
+
+    while ( inf->nhead < 2 && *left ) {
+        h[inf->nhead++] = (unsigned char)**next;
+        (*next)++;
+        (*left)--;
+    }
+    if ( inf->nhead < 2 ) return 0;
+
+    if ( ! (8 == (h[0] & 0x0f) && (h[0] >> 4) <= 7 && 0 == ((h[0] << 8) | h[1]) % 31) &&
+         ! (0x1f == h[0] && 0x8b == h[1]) ) {
+        if ( Z_OK != inflateReset2(&(inf->zs), -MAX_WBITS) ) return -1;
+    }
+    /* Two bytes never fill the window, so zlib takes both at once and
+     * a pause never has to keep them. */
+    inf->zs.next_in  = (Bytef*)h;
+    inf->zs.avail_in = 2;
+    return 1;
+}
+
+/* Inflate len bytes of a coded body through the window into
+ * lhp_body_data().  Bytes after the end of the stream are ignored.
+ * When a callback pauses the parser to unwind the stack, inflating
+ * stops and the rest is kept for lhp_inflate_resume(), so the output
+ * of one execute round is bounded like any other events.
+ */
+static int lhp_inflate_body(lhttp_parser* lparser, const char* str, size_t len) {
+    lhp_inflate* inf = lparser->inflate;
+    z_stream*    zs = &(inf->zs);
+    uint64_t     max = lparser->limits.max_decoded_size;
+    const char*  next = str;
+    size_t       left = len;
+    int          full = inf->full; /* zlib may hold more output. */
+
+    inf->pending_len = 0;
+    inf->full        = 0;
+    zs->avail_in     = 0;
+    if ( inf->nhead < 2 ) {
+        int rc = lhp_inflate_head(inf, &next, &left);
+        if ( rc <= 0 ) return rc;
+    }
+    while ( ! inf->done && (zs->avail_in || left || full) ) {
+        size_t n;
+        int    rc;
+
+        if ( HPE_PAUSED == HTTP_PARSER_ERRNO(&(lparser->parser)) ) {
+            const char* rest = zs->avail_in ? (const char*)zs->next_in : next;
+            inf->pending_off = rest - lparser->input;
+            inf->pending_len = zs->avail_in + left;
+            inf->full        = full;
+            zs->avail_in     = 0;
+            return 0;
+        }
+
+        if ( 0 == zs->avail_in && left ) {
+            n = left > 0x40000000 ? 0x40000000 : left;
+            zs->next_in  = (Bytef*)next;
+            zs->avail_in = (uInt)n;
+            next += n;
+            left -= n;
+        }
+        zs->next_out  = (Bytef*)inf->window;
+        zs->avail_out = LHP_INFLATE_WINDOW;
+
+        rc = inflate(zs, Z_NO_FLUSH);
+        if ( Z_STREAM_END == rc ) {
+            inf->done = 1;
+        } else if ( Z_BUF_ERROR == rc && 0 == zs->avail_in ) {
+            break; /* no more output without more input. */
+        } else if ( Z_OK != rc ) {
+            return lhp_fail(lparser, LHP_ERR_DECODE);
+        }
+
+        full = 0 == zs->avail_out;
+        n = LHP_INFLATE_WINDOW - zs->avail_out;
+        if ( 0 == n ) continue;
+        inf->decoded += n;
+        if ( max && inf->decoded > max ) {
+            return lhp_fail(lparser, LHP_ERR_DECODED_TOO_LARGE);
+        }
+        if ( 0 != lhp_body_data(lparser, inf->window, n, 0) ) return -1;
+    }
+    return 0;
+}
+
+/* Returns non-zero if a pause left body bytes or output to inflate. */
+static int lhp_inflate_pending(const lhttp_parser* lparser) {
+    const lhp_inflate* inf = lparser->inflate;
+    return NULL != inf && LHP_CODING_NONE != lparser->coding &&
+        (inf->pending_len || inf->full);
+}
+
+/* Continue the inflating a pause stopped, before http_parser goes on.
+ */
+static int lhp_inflate_resume(lhttp_parser* lparser) {
+    lhp_inflate* inf = lparser->inflate;
+    return lhp_inflate_body(lparser, lparser->input + inf->pending_off, inf->pending_len);
+}
+
+/* Forget what a pause left, the input it points into is gone. */
+static void lhp_inflate_drop(lhttp_parser* lparser) {
+    if ( NULL == lparser->inflate ) return;
+    lparser->inflate->pending_len = 0;
+    lparser->inflate->full        = 0;
+}
+#endif
+
+static int lhp_body_cb(http_parser* parser, const char* str, size_t len) {
+    lhttp_parser* lparser = (lhttp_parser*)parser;
+
+    lparser->body_read += len;
+    if ( lparser->limits.max_body_size &&
+         lparser->body_read > lparser->limits.max_body_size ) {
+        return lhp_fail(lparser, LHP_ERR_BODY_TOO_LARGE);
+    }
+
+#ifdef LHP_ZLIB
+    if ( LHP_CODING_NONE != lparser->coding ) {
+        return lhp_inflate_body(lparser, str, len);
+    }
+#endif
+    return lhp_body_data(lparser, str, len, 1);
+}
+
+/* Deliver the finished message being aggregated as on_message(message).
+ */
+static int lhp_message_done(lhttp_parser* lparser) {
+    lua_State* L = (lua_State*)lparser->parser.data;
 
+    /* Flush the last trailer. */
+    int result = lhp_flush_except(lparser, CB_ON_MESSAGE, 0);
+    if ( 0 != result ) return result;
+
+    if ( ! lua_checkstack(L, 5) ) return -1;
+
+    lhp_push_message(lparser);
+    lua_pushboolean(L, http_should_keep_alive(&lparser->parser));
+    lua_setfield(L, -2, "keep_alive");
+    if ( lparser->body.len ) {
+        lua_pushlstring(L, lparser->body.data, lparser->body.len);
+        LHP_STAT_ADD(lparser, strings, 1);
+        lua_setfield(L, -2, "body");
+    }
+
+    lhp_drop_message(L, lparser);
+
+    lhp_emit(lparser, CB_ON_MESSAGE, 1);
     return 0;
 }
 
 static int lhp_message_complete_cb(http_parser* parser) {
-    /* Send on_body(nil) message to comply with LTN12 */
     lhttp_parser* lparser = (lhttp_parser*)parser;
-    if( FLAG_HAS_CB(lparser->flags, CB_ON_BODY) ) {
-      int result = lhp_push_nil_event((lhttp_parser*)parser, CB_ON_BODY);
+    int           result;
+
+    LHP_STAT_ADD(lparser, messages, 1);
+#ifdef LHP_ZLIB
+    /* A coded body must hold the whole stream.  A deflate body of one
+     * byte is still held in head. */
+    if ( LHP_CODING_NONE != lparser->coding && ! lparser->inflate->done &&
+         (0 != lparser->inflate->zs.total_in || 1 == lparser->inflate->nhead) ) {
+        return lhp_fail(lparser, LHP_ERR_DECODE);
+    }
+#endif
+    if ( NULL != lparser->sink && 0 != lhp_sink_flush(lparser) ) {
+        return -1;
+    }
+    if ( LHP_AGGREGATE(lparser) ) {
+      result = lhp_message_done(lparser);
+      if ( 0 != result ) return result;
+    } else if( LHP_HAS_CB(lparser, CB_ON_BODY) &&
+               ! (lparser->options & OPT_ACCUMULATE_BODY) ) {
+      /* Send on_body(nil) message to comply with LTN12 */
+      result = lhp_push_nil_event((lhttp_parser*)parser, CB_ON_BODY);
       if ( 0 != result ) return result;
     }
 
-    return lhp_http_cb(parser, CB_ON_MESSAGE_COMPLETE);
+    /* An accumulated body is the argument of on_message_complete. */
+    result = lhp_http_cb(parser, CB_ON_MESSAGE_COMPLETE);
+    lhp_body_done(lparser);
+    lparser->in_message = 0;
+    return result;
 }
 
 static int lhp_chunk_header_cb(http_parser* parser) {
@@ -363,208 +1848,1810 @@ static int lhp_chunk_complete_cb(http_parser* parser) {
     return lhp_http_cb(parser, CB_ON_CHUNK_COMPLETE);
 }
 
-static int lhp_init(lua_State* L, enum http_parser_type type) {
-    int cb_id;
-    /* Stack: callbacks */
+/* Read the non-callback options from the table at idx.  Returns the
+ * OPT_* bits.
+ */
+static int lhp_get_options(lua_State* L, int idx) {
+    int options = 0;
 
-    lhttp_parser* lparser;
-    http_parser* parser;
-    luaL_checktype(L, 1, LUA_TTABLE);
-    lparser = (lhttp_parser*)lua_newuserdata(L, sizeof(lhttp_parser));
-    parser = &(lparser->parser);
-    assert(NULL != parser);
-    /* Stack: callbacks, userdata */
+    lua_getfield(L, idx, "lowercase_headers");
+    if ( lua_toboolean(L, -1) ) options |= OPT_LOWERCASE_HEADERS;
+    lua_pop(L, 1);
 
-    lparser->flags   = 0;
-    lparser->buf_len = 0;
+    lua_getfield(L, idx, "body_slices");
+    if ( lua_toboolean(L, -1) ) options |= OPT_BODY_SLICES;
+    lua_pop(L, 1);
 
-    /* Get the metatable: */
-    luaL_getmetatable(L, PARSER_MT);
-    assert(!lua_isnil(L, -1)/* PARSER_MT found? */);
-    /* Stack: callbacks, userdata, metatable */
+    lua_getfield(L, idx, "accumulate_body");
+    if ( lua_toboolean(L, -1) ) options |= OPT_ACCUMULATE_BODY;
+    lua_pop(L, 1);
 
-    /* Copy functions to new fenv table */
-    lua_createtable(L, FENV_LEN, 0);
-    /* Stack: callbacks, userdata, metatable, fenv */
-    for (cb_id = 1; cb_id <= CB_LEN; cb_id++ ) {
-        lua_getfield(L, 1, lhp_callback_names[cb_id-1]);
-        if ( lua_isfunction(L, -1) ) {
-            lua_rawseti(L, -2, cb_id); /* fenv[cb_id] = callback */
-            FLAG_SET_CB(lparser->flags, cb_id);
+    lua_getfield(L, idx, "split_url");
+    if ( lua_toboolean(L, -1) ) options |= OPT_SPLIT_URL;
+    lua_pop(L, 1);
+
+    lua_getfield(L, idx, "decode_url");
+    if ( lua_toboolean(L, -1) ) options |= OPT_DECODE_URL;
+    lua_pop(L, 1);
+
+    lua_getfield(L, idx, "lazy_headers");
+    if ( lua_toboolean(L, -1) ) options |= OPT_LAZY_HEADERS;
+    lua_pop(L, 1);
+
+    lua_getfield(L, idx, "hibernate");
+    if ( lua_toboolean(L, -1) ) options |= OPT_HIBERNATE;
+    lua_pop(L, 1);
+
+    lua_getfield(L, idx, "decode_body");
+    if ( lua_toboolean(L, -1) ) {
+#ifdef LHP_ZLIB
+        options |= OPT_DECODE_BODY;
+#else
+        luaL_error(L, "decode_body needs http.parser built with zlib");
+#endif
+    }
+    lua_pop(L, 1);
+
+    return options;
+}
+
+/* Returns the number field name of the table at idx as a limit:
+ * deflt if it is nil, 0 (no limit) if it is not positive and at most
+ * most, so math.huge can't overflow the cast.
+ */
+static uint64_t lhp_get_limit(lua_State* L, int idx, const char* name, uint64_t deflt, uint64_t most) {
+    lua_Number max;
+    int        none;
+
+    lua_getfield(L, idx, name);
+    none = lua_isnil(L, -1);
+    max  = lua_tonumber(L, -1);
+    lua_pop(L, 1);
+    if ( none ) return deflt;
+    if ( ! (max > 0) ) return 0;
+    return max >= (lua_Number)most ? most : (uint64_t)max;
+}
+
+/* Read the limits from the table at idx into limits.
+ */
+static void lhp_get_limits(lua_State* L, int idx, lhp_limits* limits) {
+    limits->max_url_size    = (size_t)lhp_get_limit(L, idx, "max_url_size", 0, (size_t)-1);
+    limits->max_header_size = (size_t)lhp_get_limit(L, idx, "max_header_size", 0, (size_t)-1);
+    limits->max_headers     = (size_t)lhp_get_limit(L, idx, "max_headers", 0, (size_t)-1);
+    limits->max_body_size   = lhp_get_limit(L, idx, "max_body_size", 0, (uint64_t)-1);
+    limits->max_decoded_size = lhp_get_limit(L, idx, "max_decoded_size",
+                                             LHP_MAX_DECODED_SIZE, (uint64_t)-1);
+}
+
+/* Returns the FILE* of the Lua file handle at idx, or NULL if it is
+ * closed.  Raises an error if idx is not a file handle.
+ */
+static FILE* lhp_tofile(lua_State* L, int idx) {
+    FILE* file = NULL;
+    int   is_file;
+
+    if ( ! lua_getmetatable(L, idx) ) lua_pushnil(L);
+    luaL_getmetatable(L, LUA_FILEHANDLE);
+    is_file = lua_istable(L, -1) && lua_rawequal(L, -1, -2);
+    lua_pop(L, 2);
+    if ( ! is_file ) luaL_argerror(L, idx, "file handle expected");
+
+#if LUA_VERSION_NUM >= 502
+    {
+        luaL_Stream* stream = (luaL_Stream*)lua_touserdata(L, idx);
+        if ( NULL != stream->closef ) file = stream->f;
+    }
+#else
+    file = *(FILE**)lua_touserdata(L, idx);
+#endif
+    return file;
+}
+
+/* Set the body_sink of lparser to the value at idx: nil, a Lua file
+ * handle or a file descriptor number.
+ */
+static void lhp_set_body_sink(lua_State* L, lhttp_parser* lparser, int idx) {
+    luaL_unref(L, LUA_REGISTRYINDEX, lparser->body_sink);
+    lparser->body_sink = LUA_NOREF;
+
+    switch ( lua_type(L, idx) ) {
+    case LUA_TNIL:
+    case LUA_TNONE:
+        return;
+    case LUA_TNUMBER:
+        if ( lua_tonumber(L, idx) < 0 ) luaL_argerror(L, idx, "invalid file descriptor");
+        break;
+    case LUA_TUSERDATA:
+        lhp_tofile(L, idx);
+        break;
+    default:
+        luaL_argerror(L, idx, "body_sink must be a file handle or descriptor");
+    }
+    lua_pushvalue(L, idx);
+    lparser->body_sink = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+/* Compile the headers option of the table at idx into the
+ * fenv[FENV_HEADERS_IDX] of the fenv at fenv_idx.  Returns the set, or
+ * NULL if there is no headers option.
+ */
+static lhp_header_set* lhp_set_headers(lua_State* L, int idx, int fenv_idx) {
+    const lhp_scanner* scanner = lhp_get_scanner(L);
+    lhp_header_set*  set;
+    lhp_header_slot* slots;
+    char*            names;
+    size_t           count = 0;
+    size_t           total = 0;
+    size_t           nslots = 4;
+    size_t           off = 0;
+    int              i;
+
+    lua_getfield(L, idx, "headers");
+    if ( lua_isnil(L, -1) ) {
+        lua_pop(L, 1);
+        lua_pushnil(L);
+        lua_rawseti(L, fenv_idx, FENV_HEADERS_IDX);
+        return NULL;
+    }
+    if ( ! lua_istable(L, -1) ) {
+        luaL_error(L, "headers must be a table of header field names");
+    }
+
+    for ( i = 1; ; i++ ) {
+        size_t len;
+        lua_rawgeti(L, -1, i);
+        if ( lua_isnil(L, -1) ) break;
+        if ( LUA_TSTRING != lua_type(L, -1) ) {
+            luaL_error(L, "headers[%d] must be a string", i);
+        }
+        lua_tolstring(L, -1, &len);
+        total += len;
+        count++;
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+    while ( nslots < 2 * count ) nslots *= 2;
+
+    set = (lhp_header_set*)lua_newuserdata(L, sizeof(lhp_header_set)
+        + nslots * sizeof(lhp_header_slot) + total);
+    set->nslots = nslots;
+    slots = LHP_HEADER_SET_SLOTS(set);
+    names = LHP_HEADER_SET_NAMES(set);
+    memset(slots, 0, nslots * sizeof(lhp_header_slot));
+    /* Stack: headers, set */
+
+    for ( i = 1; i <= (int)count; i++ ) {
+        size_t      len;
+        const char* str;
+        size_t      slot;
+
+        lua_rawgeti(L, -2, i);
+        str = lua_tolstring(L, -1, &len);
+        if ( len && ! lhp_header_set_has(set, str, len) ) {
+            memcpy(names + off, str, len);
+            lhp_lowercase(scanner, names + off, len);
+            slot = lhp_header_set_hash(str, len) & (nslots - 1);
+            while ( slots[slot].len ) slot = (slot + 1) & (nslots - 1);
+            slots[slot].off = off;
+            slots[slot].len = len;
+            off += len;
+        }
+        lua_pop(L, 1);
+    }
+
+    lua_rawseti(L, fenv_idx, FENV_HEADERS_IDX);
+    lua_pop(L, 1);
+    return set;
+}
+
+/* Push a new fenv table holding the callbacks found in the table at
+ * idx, and set their FLAG_*_CB() bits in flags.  Returns the compiled
+ * headers option.
+ */
+static lhp_header_set* lhp_push_prototype(lua_State* L, int idx, int* flags) {
+    int cb_id;
+
+    lua_createtable(L, FENV_LEN, 0);
+    for (cb_id = 1; cb_id <= CB_LEN; cb_id++ ) {
+        lua_getfield(L, idx, lhp_callback_names[cb_id-1]);
+        if ( lua_isfunction(L, -1) ) {
+            lua_rawseti(L, -2, cb_id); /* fenv[cb_id] = callback */
+            FLAG_SET_CB(*flags, cb_id);
+        } else {
+            lua_pop(L, 1); /* pop non-function value. */
+        }
+    }
+    return lhp_set_headers(L, idx, lua_gettop(L));
+}
+
+/* Push a new parser with the given flags and options.  The caller
+ * must set its fenv.
+ */
+static lhttp_parser* lhp_new_parser(lua_State* L, enum http_parser_type type, int flags, int options) {
+    lhttp_parser* lparser;
+
+    lparser = (lhttp_parser*)lua_newuserdata(L, sizeof(lhttp_parser));
+    assert(NULL != lparser);
+
+    lparser->flags      = flags;
+    lparser->options    = options;
+    lparser->scanner    = lhp_get_scanner(L);
+    lparser->mode       = LHP_MODE_CALLBACKS;
+    lparser->nevents    = 0;
+    lparser->shared     = 0;
+    lparser->headers    = NULL;
+    lparser->message    = LUA_NOREF;
+    lparser->body_sink  = LUA_NOREF;
+    lparser->error      = 0;
+    lparser->sink       = NULL;
+    lparser->hfield_len = 0;
+    lparser->input      = NULL;
+    lparser->buf.data   = NULL;
+    lparser->buf.len    = 0;
+    lparser->buf.cap    = 0;
+    lparser->body.data  = NULL;
+    lparser->body.len   = 0;
+    lparser->body.cap   = 0;
+    lparser->hspans.data = NULL;
+    lparser->hspans.len  = 0;
+    lparser->hspans.cap  = 0;
+    lparser->hbytes.data = NULL;
+    lparser->hbytes.len  = 0;
+    lparser->hbytes.cap  = 0;
+    lparser->body_read  = 0;
+    lparser->url_size   = 0;
+    lparser->header_size = 0;
+    lparser->nheaders   = 0;
+    lparser->in_value   = 0;
+    lparser->in_message = 0;
+    memset(&(lparser->limits), 0, sizeof(lparser->limits));
+#ifdef LHP_ZLIB
+    lparser->coding     = LHP_CODING_NONE;
+    lparser->ce_match   = -1;
+    lparser->ce_len     = 0;
+    lparser->inflate    = NULL;
+#endif
+#ifdef LHP_STATS
+    memset(&(lparser->stats), 0, sizeof(lparser->stats));
+    lua_getfield(L, LUA_REGISTRYINDEX, STATS_KEY);
+    lparser->global = (lhp_stats*)lua_touserdata(L, -1);
+    assert(NULL != lparser->global);
+    lua_pop(L, 1);
+#endif
+#ifdef LHP_STATS_TIMING
+    lparser->callbacks_start = 0;
+#endif
+
+    http_parser_init(&(lparser->parser), type);
+    lparser->parser.data = NULL;
+
+    /* Get the metatable: */
+    luaL_getmetatable(L, PARSER_MT);
+    assert(!lua_isnil(L, -1)/* PARSER_MT found? */);
+    lua_setmetatable(L, -2);
+
+    return lparser;
+}
+
+static int lhp_init(lua_State* L, enum http_parser_type type) {
+    lhttp_parser* lparser;
+    /* Stack: callbacks */
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_settop(L, 1);
+    lparser = lhp_new_parser(L, type, 0, lhp_get_options(L, 1));
+    lhp_get_limits(L, 1, &(lparser->limits));
+    /* Stack: callbacks, userdata */
+
+    /* Copy functions to new fenv table */
+    lparser->headers = lhp_push_prototype(L, 1, &(lparser->flags));
+    /* Stack: callbacks, userdata, fenv */
+    lua_setfenv(L, -2);
+
+    lua_getfield(L, 1, "body_sink");
+    lhp_set_body_sink(L, lparser, 3);
+    lua_pop(L, 1);
+
+    return 1;
+}
+
+static int lhp_request(lua_State* L) {
+    return lhp_init(L, HTTP_REQUEST);
+}
+
+static int lhp_response(lua_State* L) {
+    return lhp_init(L, HTTP_RESPONSE);
+}
+
+/* lhp.factory(callbacks) reads the callbacks and options once, so the
+ * parsers it makes cost one userdata each.
+ */
+static int lhp_factory_new(lua_State* L) {
+    lhp_factory* factory;
+    /* Stack: callbacks */
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_settop(L, 1);
+    lua_getfield(L, 1, "body_sink");
+    luaL_argcheck(L, lua_isnil(L, -1), 1,
+                  "body_sink is per parser, use parser:body_sink()");
+    lua_pop(L, 1);
+    factory = (lhp_factory*)lua_newuserdata(L, sizeof(lhp_factory));
+    factory->flags   = 0;
+    factory->headers = NULL;
+    factory->options = lhp_get_options(L, 1);
+    lhp_get_limits(L, 1, &(factory->limits));
+
+    luaL_getmetatable(L, FACTORY_MT);
+    assert(!lua_isnil(L, -1)/* FACTORY_MT found? */);
+    lua_setmetatable(L, -2);
+
+    factory->headers = lhp_push_prototype(L, 1, &(factory->flags));
+    /* Stack: callbacks, userdata, fenv */
+    lua_setfenv(L, -2);
+
+    return 1;
+}
+
+static int lhp_factory_init(lua_State* L, enum http_parser_type type) {
+    lhp_factory*  factory = check_factory(L, 1);
+    lhttp_parser* lparser;
+
+    lua_settop(L, 1);
+    lparser = lhp_new_parser(L, type, factory->flags, factory->options);
+    lparser->shared  = 1;
+    lparser->headers = factory->headers;
+    lparser->limits  = factory->limits;
+
+    lua_getfenv(L, 1);
+    lua_setfenv(L, -2);
+
+    return 1;
+}
+
+static int lhp_factory_request(lua_State* L) {
+    return lhp_factory_init(L, HTTP_REQUEST);
+}
+
+static int lhp_factory_response(lua_State* L) {
+    return lhp_factory_init(L, HTTP_RESPONSE);
+}
+
+static int lhp_factory__tostring(lua_State* L) {
+    lhp_factory* factory = check_factory(L, 1);
+    lua_pushfstring(L, FACTORY_MT" %p", factory);
+    return 1;
+}
+
+/* lhp.buffer([capacity]) returns a new empty buffer. */
+static int lhp_bytebuf_new(lua_State* L) {
+    lua_Number  capacity = luaL_optnumber(L, 1, 0);
+    lhp_bytebuf* buffer;
+
+    luaL_argcheck(L, capacity >= 0, 1, "capacity must be non-negative");
+
+    buffer = (lhp_bytebuf*)lua_newuserdata(L, sizeof(lhp_bytebuf));
+    memset(buffer, 0, sizeof(lhp_bytebuf));
+    luaL_getmetatable(L, BYTEBUF_MT);
+    lua_setmetatable(L, -2);
+
+    if ( 0 != lhp_buf_presize(L, &(buffer->buf), (size_t)capacity) ) {
+        return luaL_error(L, "out of memory");
+    }
+    return 1;
+}
+
+/* Make room for len more bytes at the end of buffer, reclaiming the
+ * consumed head first if that avoids growing it.  Returns where the
+ * bytes go, or NULL if out of memory.  The caller adds len to
+ * buffer->buf.len once they are written.
+ */
+static char* lhp_bytebuf_reserve(lua_State* L, lhp_bytebuf* buffer, size_t len) {
+    if ( buffer->head && buffer->buf.cap - buffer->buf.len < len ) {
+        buffer->buf.len -= buffer->head;
+        memmove(buffer->buf.data, buffer->buf.data + buffer->head, buffer->buf.len);
+        buffer->head = 0;
+    }
+    if ( 0 != lhp_buf_reserve(L, &(buffer->buf), len) ) return NULL;
+    return buffer->buf.data + buffer->buf.len;
+}
+
+/* buffer:append(string) adds string at the end. */
+static int lhp_bytebuf_append(lua_State* L) {
+    lhp_bytebuf* buffer = check_bytebuf(L, 1);
+    size_t      len;
+    const char* str = luaL_checklstring(L, 2, &len);
+    char*       dst = lhp_bytebuf_reserve(L, buffer, len);
+
+    if ( NULL == dst ) return luaL_error(L, "out of memory");
+    memcpy(dst, str, len);
+    buffer->buf.len += len;
+    lua_settop(L, 1);
+    return 1;
+}
+
+/* buffer:consume(n) drops the first n bytes, typically the bytes_read
+ * returned by parser:execute(buffer).
+ */
+static int lhp_bytebuf_consume(lua_State* L) {
+    lhp_bytebuf* buffer = check_bytebuf(L, 1);
+    lua_Number  n      = luaL_checknumber(L, 2);
+
+    luaL_argcheck(L, n >= 0 && n <= buffer->buf.len - buffer->head, 2,
+                  "more than the buffer length");
+
+    buffer->head += (size_t)n;
+    if ( buffer->head == buffer->buf.len ) {
+        buffer->head    = 0;
+        buffer->buf.len = 0;
+    }
+    return 0;
+}
+
+static int lhp_bytebuf_clear(lua_State* L) {
+    lhp_bytebuf* buffer = check_bytebuf(L, 1);
+    buffer->head    = 0;
+    buffer->buf.len = 0;
+    return 0;
+}
+
+/* buffer:string([i[, j]]) returns the bytes from i to j, with the
+ * same meaning of i and j as string.sub().
+ */
+static int lhp_bytebuf_string(lua_State* L) {
+    lhp_bytebuf* buffer = check_bytebuf(L, 1);
+    lua_Number  len    = (lua_Number)(buffer->buf.len - buffer->head);
+    lua_Number  i      = luaL_optnumber(L, 2, 1);
+    lua_Number  j      = luaL_optnumber(L, 3, -1);
+
+    if ( i < 0 ) i = len + i + 1;
+    if ( j < 0 ) j = len + j + 1;
+    if ( i < 1 ) i = 1;
+    if ( j > len ) j = len;
+
+    if ( i > j ) {
+        lua_pushliteral(L, "");
+    } else {
+        lua_pushlstring(L, buffer->buf.data + buffer->head + (size_t)i - 1, (size_t)(j - i + 1));
+    }
+    return 1;
+}
+
+static int lhp_bytebuf__len(lua_State* L) {
+    lhp_bytebuf* buffer = check_bytebuf(L, 1);
+    lhp_pushint64(L, buffer->buf.len - buffer->head);
+    return 1;
+}
+
+static int lhp_bytebuf__gc(lua_State* L) {
+    lhp_bytebuf* buffer = check_bytebuf(L, 1);
+    lhp_buf_free(L, &(buffer->buf));
+    buffer->head = 0;
+    return 0;
+}
+
+static int lhp_bytebuf__tostring(lua_State* L) {
+    lhp_bytebuf* buffer = check_bytebuf(L, 1);
+    lua_pushfstring(L, BYTEBUF_MT" %p", buffer);
+    return 1;
+}
+
+/* headers:get(name) returns the value of the header name, ignoring
+ * case, with the values of a repeated header joined with ", ", or nil.
+ */
+static int lhp_headers_get(lua_State* L) {
+    const lhp_headers*     h = check_headers(L, 1);
+    const lhp_header_span* spans = LHP_HEADERS_SPANS(h);
+    const unsigned*        index = LHP_HEADERS_INDEX(h);
+    const char*            bytes = LHP_HEADERS_BYTES(h);
+    size_t                 mask = h->nslots - 1;
+    size_t                 len;
+    const char*            name = luaL_checklstring(L, 2, &len);
+    size_t                 hash = lhp_header_set_hash(name, len);
+    size_t                 i;
+    int                    found = 0;
+    luaL_Buffer            b;
+
+    /* Spans with the same hash are probed in the order they came. */
+    for ( i = hash & mask; index[i]; i = (i + 1) & mask ) {
+        const lhp_header_span* span = &(spans[index[i] - 1]);
+
+        if ( span->hash != hash || span->field_len != len ||
+             ! lhp_header_name_eq(bytes + span->off, name, len) ) {
+            continue;
+        }
+        if ( 0 == found++ ) {
+            luaL_buffinit(L, &b);
+        } else {
+            luaL_addlstring(&b, ", ", 2);
+        }
+        luaL_addlstring(&b, bytes + span->off + len, span->value_len);
+    }
+    if ( found ) {
+        luaL_pushresult(&b);
+    } else {
+        lua_pushnil(L);
+    }
+    return 1;
+}
+
+/* The iterator of headers:iter(), its upvalues are the headers and the
+ * number of headers returned so far.
+ */
+static int lhp_headers_next(lua_State* L) {
+    const lhp_headers*     h = (const lhp_headers*)lua_touserdata(L, lua_upvalueindex(1));
+    size_t                 i = (size_t)lua_tointeger(L, lua_upvalueindex(2));
+    const lhp_header_span* span;
+    const char*            bytes = LHP_HEADERS_BYTES(h);
+
+    if ( i >= h->count ) return 0;
+    lua_pushinteger(L, (lua_Integer)i + 1);
+    lua_replace(L, lua_upvalueindex(2));
+
+    span = &(LHP_HEADERS_SPANS(h)[i]);
+    lua_pushlstring(L, bytes + span->off, span->field_len);
+    lua_pushlstring(L, bytes + span->off + span->field_len, span->value_len);
+    return 2;
+}
+
+/* for field, value in headers:iter() do ... end */
+static int lhp_headers_iter(lua_State* L) {
+    check_headers(L, 1);
+    lua_settop(L, 1);
+    lua_pushinteger(L, 0);
+    lua_pushcclosure(L, lhp_headers_next, 2);
+    return 1;
+}
+
+static int lhp_headers_count(lua_State* L) {
+    lhp_headers* h = check_headers(L, 1);
+    lua_pushinteger(L, (lua_Integer)h->count);
+    return 1;
+}
+
+static int lhp_headers__tostring(lua_State* L) {
+    lhp_headers* h = check_headers(L, 1);
+    lua_pushfstring(L, HEADERS_MT" %p", h);
+    return 1;
+}
+
+/* Get the input at idx, a string or an lhp.buffer(), narrowed by the
+ * optional init and len arguments at init_idx and init_idx + 1: parse
+ * len bytes (default all) from position init (default 1).  Returns
+ * the start of the whole input and sets *offset to the 0 based
+ * position of init.
+ */
+static const char* lhp_check_input(lua_State* L, int idx, int init_idx, size_t* offset, size_t* len) {
+    const char* str;
+    size_t      size;
+    lua_Number  init;
+    lua_Number  n;
+
+    if ( lua_type(L, idx) == LUA_TUSERDATA ) {
+        lhp_bytebuf* buffer = check_bytebuf(L, idx);
+        str  = buffer->buf.data + buffer->head;
+        size = buffer->buf.len - buffer->head;
+    } else {
+        str = luaL_checklstring(L, idx, &size);
+    }
+
+    init = luaL_optnumber(L, init_idx, 1);
+    luaL_argcheck(L, init >= 1 && init - 1 <= size, init_idx, "position out of range");
+    *offset = (size_t)init - 1;
+
+    n = luaL_optnumber(L, init_idx + 1, (lua_Number)(size - *offset));
+    luaL_argcheck(L, n >= 0 && n <= size - *offset, init_idx + 1, "length out of range");
+    *len = (size_t)n;
+
+    return str;
+}
+
+static const http_parser_settings lhp_settings = {
+    lhp_message_begin_cb,
+    lhp_url_cb,
+    lhp_status_cb,
+    lhp_header_field_cb,
+    lhp_header_value_cb,
+    lhp_headers_complete_cb,
+    lhp_body_cb,
+    lhp_message_complete_cb,
+    lhp_chunk_header_cb,
+    lhp_chunk_complete_cb
+};
+
+#ifdef LHP_STATS_TIMING
+/* Monotonic clock in nanoseconds. */
+static uint64_t lhp_now_ns(void) {
+#ifdef _WIN32
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (uint64_t)((double)now.QuadPart * 1e9 / (double)freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+#endif
+}
+#endif
+
+/* Release the memory an idle parser does not need: the token, body and
+ * lazy_headers buffers shrink to what they hold (usually nothing, so
+ * they are freed) and, between messages, the decode_body stream is
+ * freed.  All of them are allocated again when needed.  Returns the
+ * number of bytes released.
+ */
+static size_t lhp_hibernate(lua_State* L, lhttp_parser* lparser) {
+    size_t released = 0;
+
+    released += lhp_buf_shrink(L, &(lparser->buf));
+    released += lhp_buf_shrink(L, &(lparser->body));
+    released += lhp_buf_shrink(L, &(lparser->hspans));
+    released += lhp_buf_shrink(L, &(lparser->hbytes));
+#ifdef LHP_ZLIB
+    if ( ! lparser->in_message && NULL != lparser->inflate ) {
+        lhp_inflate_free(L, lparser);
+        released += sizeof(lhp_inflate);
+    }
+#endif
+    return released;
+}
+
+/* Run http_parser over len bytes of input starting at offset, with
+ * the Lua stack laid out as described by the ST_*_IDX macros.
+ */
+static size_t lhp_run(lua_State* L, lhttp_parser* lparser, const char* input, size_t offset, size_t len) {
+    http_parser*  parser = &(lparser->parser);
+    size_t        result = 0;
+    int           run = 1;
+    lhp_sink      sink;
+
+    /* A luaL_error() below must not leave a sink of an earlier run. */
+    lparser->sink = NULL;
+    if ( LUA_NOREF != lparser->body_sink ) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, lparser->body_sink);
+        if ( lua_isnumber(L, -1) ) {
+            sink.file = NULL;
+            sink.fd   = (int)lua_tointeger(L, -1);
+        } else {
+            sink.file = lhp_tofile(L, -1);
+            if ( NULL == sink.file ) luaL_error(L, "body_sink is a closed file");
+        }
+        lua_pop(L, 1);
+#ifndef _WIN32
+        sink.niov = 0;
+#endif
+        lparser->sink = &sink;
+    }
+
+    parser->data   = L;
+    lparser->input = input;
+
+#ifdef LHP_ZLIB
+    /* Finish the decoded body a pause stopped before going on.  The
+     * parser stays put if that pauses or fails again, and the empty
+     * rest of an input is not passed on as the end of the input. */
+    if ( LHP_MODE_CALLBACKS == lparser->mode && lhp_inflate_pending(lparser) ) {
+        if ( 0 != lhp_inflate_resume(lparser) && HPE_OK == HTTP_PARSER_ERRNO(parser) ) {
+            parser->http_errno = HPE_CB_body;
+        }
+        run = HPE_OK == HTTP_PARSER_ERRNO(parser) && len > 0;
+    }
+#endif
+
+    if ( run ) {
+#ifdef LHP_STATS_TIMING
+        uint64_t start = lhp_now_ns();
+        result = http_parser_execute(parser, &lhp_settings, input + offset, len);
+        LHP_STAT_ADD(lparser, parse_ns, lhp_now_ns() - start);
+#else
+        result = http_parser_execute(parser, &lhp_settings, input + offset, len);
+#endif
+        LHP_STAT_ADD(lparser, bytes, result);
+    }
+
+    if ( NULL != lparser->sink ) {
+        if ( 0 != lhp_sink_flush(lparser) && HPE_OK == HTTP_PARSER_ERRNO(parser) ) {
+            /* Stop the parser as if on_body had failed. */
+            parser->http_errno = HPE_CB_body;
+        }
+        lparser->sink = NULL;
+    }
+
+    parser->data   = NULL;
+    lparser->input = NULL;
+
+    /* The auto mode of parser:hibernate(). */
+    if ( (lparser->options & OPT_HIBERNATE) && ! lparser->in_message ) {
+        lhp_hibernate(L, lparser);
+    }
+
+    return result;
+}
+
+/* Called by the lua stub as c_execute(parser, input, init, len[, done])
+ * to parse the input range given by init and len (see lhp_check_input)
+ * after the done bytes parsed by previous calls.  Returns the number
+ * of bytes of the range parsed so far, whether the stub should call
+ * again from there after running the callbacks, and the callbacks
+ * with their arguments.
+ */
+static int lhp_execute(lua_State* L) {
+    lhttp_parser* lparser = check_parser(L, 1);
+    http_parser*  parser = &(lparser->parser);
+    size_t        start;
+    size_t        len;
+    size_t        done;
+    size_t        result;
+    int           more = 0;
+    const char*   str = lhp_check_input(L, 2, 3, &start, &len);
+
+    done = (size_t)luaL_optnumber(L, 5, 0);
+    luaL_argcheck(L, done <= len, 5, "offset out of range");
+
+    /* truncate stack to (userdata, string) */
+    lua_settop(L, 2);
+
+    lua_getfenv(L, 1);
+    assert(lua_istable(L, -1));
+    assert(lua_gettop(L) == ST_FENV_IDX);
+
+    assert(lua_gettop(L) == ST_LEN);
+    lua_pushnil(L);
+    lua_pushnil(L);
+
+    /* Stack: (userdata, string, fenv, nil, nil) */
+    lparser->mode = LHP_MODE_CALLBACKS;
+#ifdef LHP_ZLIB
+    if ( 0 == done ) lhp_inflate_drop(lparser);
+#endif
+
+#ifdef LHP_STATS_TIMING
+    /* The stub ran the callbacks since the last c_execute. */
+    if ( done && lparser->callbacks_start ) {
+        LHP_STAT_ADD(lparser, callback_ns, lhp_now_ns() - lparser->callbacks_start);
+    }
+#endif
+
+    result = done + lhp_run(L, lparser, str, start + done, len - done);
+
+#ifdef LHP_STATS_TIMING
+    lparser->callbacks_start = lhp_now_ns();
+#endif
+
+    /* Paused by lhp_emit() to unwind the stack, not by a callback. */
+    if ( HPE_PAUSED == HTTP_PARSER_ERRNO(parser) ) {
+        http_parser_pause(parser, 0);
+        more = result < len;
+#ifdef LHP_ZLIB
+        more = more || lhp_inflate_pending(lparser);
+#endif
+    }
+
+    /* replace nil place-holders with 'result' code and 'more' flag. */
+    lhp_pushint64(L, result);
+    lua_replace(L, ST_LEN+1);
+    lua_pushboolean(L, more);
+    lua_replace(L, ST_LEN+2);
+    /* Transform the stack into a table: */
+    len = lua_gettop(L) - ST_LEN;
+
+    return len;
+}
+
+/* Same as execute, but instead of calling callbacks every event is
+ * stored as an (event code, arg1, arg2) record in the events table,
+ * so records start at events[1], events[4], events[7]...  The table
+ * is overwritten from the start on every call and is not cleared, so
+ * only the first count records are valid.  Returns bytes_read, count.
+ */
+static int lhp_execute_into(lua_State* L) {
+    lhttp_parser* lparser = check_parser(L, 1);
+    size_t        start;
+    size_t        len;
+    size_t        result;
+    const char*   str = lhp_check_input(L, 2, 4, &start, &len);
+
+    luaL_checktype(L, 3, LUA_TTABLE);
+
+    /* truncate stack to (userdata, string, events) */
+    lua_settop(L, 3);
+
+    lua_getfenv(L, 1);
+    assert(lua_istable(L, -1));
+    lua_insert(L, ST_FENV_IDX);
+
+    assert(lua_gettop(L) == ST_EVENTS_IDX);
+
+    /* Stack: (userdata, string, fenv, events) */
+    lparser->mode    = LHP_MODE_EVENTS;
+    lparser->nevents = 0;
+
+    result = lhp_run(L, lparser, str, start, len);
+
+    lparser->mode    = LHP_MODE_CALLBACKS;
+
+    lhp_pushint64(L, result);
+    lua_pushinteger(L, lparser->nevents);
+    return 2;
+}
+
+/* Parse a buffer of (typically pipelined) messages without calling
+ * any callbacks.  Every message completed by this buffer is aggregated
+ * as described for on_message and appended to the msgs array, which
+ * is created if not given and otherwise overwritten from the start.
+ * Returns bytes_read, msgs.
+ */
+static int lhp_execute_all(lua_State* L) {
+    lhttp_parser* lparser = check_parser(L, 1);
+    size_t        start;
+    size_t        len;
+    size_t        result;
+    size_t        old_len = 0;
+    size_t        i;
+    const char*   str = lhp_check_input(L, 2, 4, &start, &len);
+
+    if ( lua_isnoneornil(L, 3) ) {
+        lua_settop(L, 2);
+        lua_newtable(L);
+    } else {
+        luaL_checktype(L, 3, LUA_TTABLE);
+        lua_settop(L, 3);
+        old_len = lua_objlen(L, 3);
+    }
+
+    lua_getfenv(L, 1);
+    assert(lua_istable(L, -1));
+    lua_insert(L, ST_FENV_IDX);
+
+    assert(lua_gettop(L) == ST_EVENTS_IDX);
+
+    /* Stack: (userdata, string, fenv, msgs) */
+    lparser->mode    = LHP_MODE_MESSAGES;
+    lparser->nevents = 0;
+
+    result = lhp_run(L, lparser, str, start, len);
+
+    lparser->mode    = LHP_MODE_CALLBACKS;
+
+    /* clear what is left of a longer array that is reused */
+    for ( i = lparser->nevents + 1; i <= old_len; i++ ) {
+        lua_pushnil(L);
+        lua_rawseti(L, ST_EVENTS_IDX, (int)i);
+    }
+
+    lhp_pushint64(L, result);
+    lua_pushvalue(L, ST_EVENTS_IDX);
+    return 2;
+}
+
+static int lhp_should_keep_alive(lua_State* L) {
+    lhttp_parser* lparser = check_parser(L, 1);
+    lua_pushboolean(L, http_should_keep_alive(&lparser->parser));
+    return 1;
+}
+
+static int lhp_is_upgrade(lua_State* L) {
+    lhttp_parser* lparser = check_parser(L, 1);
+    lua_pushboolean(L, lparser->parser.upgrade);
+    return 1;
+}
+
+static int lhp__gc(lua_State* L) {
+    lhttp_parser* lparser = check_parser(L, 1);
+    lhp_buf_free(L, &(lparser->buf));
+    lhp_buf_free(L, &(lparser->body));
+    lhp_buf_free(L, &(lparser->hspans));
+    lhp_buf_free(L, &(lparser->hbytes));
+#ifdef LHP_ZLIB
+    lhp_inflate_free(L, lparser);
+#endif
+    lhp_drop_message(L, lparser);
+    luaL_unref(L, LUA_REGISTRYINDEX, lparser->body_sink);
+    lparser->body_sink = LUA_NOREF;
+    return 0;
+}
+
+/* parser:hibernate() releases the buffers of an idle parser and
+ * returns the number of bytes released.
+ */
+static int lhp_parser_hibernate(lua_State* L) {
+    lhttp_parser* lparser = check_parser(L, 1);
+    lhp_pushint64(L, (int64_t)lhp_hibernate(L, lparser));
+    return 1;
+}
+
+/* parser:body_sink(sink) sets or, with nil, removes the body_sink. */
+static int lhp_body_sink(lua_State* L) {
+    lhttp_parser* lparser = check_parser(L, 1);
+    lhp_set_body_sink(L, lparser, 2);
+    return 0;
+}
+
+static int lhp__tostring(lua_State* L) {
+    lhttp_parser* lparser = check_parser(L, 1);
+    lua_pushfstring(L, PARSER_MT" %p", lparser);
+    return 1;
+}
+
+static int lhp_method(lua_State* L) {
+    lhttp_parser* lparser = check_parser(L, 1);
+    lhp_push_method(L, lparser->parser.method);
+    return 1;
+}
+
+static int lhp_version(lua_State* L) {
+    lhttp_parser* lparser = check_parser(L, 1);
+    lua_pushnumber(L, lparser->parser.http_major);
+    lua_pushnumber(L, lparser->parser.http_minor);
+    return 2;
+}
+
+static int lhp_status_code(lua_State* L) {
+    lhttp_parser* lparser = check_parser(L, 1);
+    lua_pushnumber(L, lparser->parser.status_code);
+    return 1;
+}
+
+static int lhp_error(lua_State* L) {
+    lhttp_parser* lparser = check_parser(L, 1);
+    enum http_errno http_errno = lparser->parser.http_errno;
+    if ( lparser->error ) {
+        lua_pushinteger(L, HPE_UNKNOWN + lparser->error);
+        lua_pushstring(L, lhp_errors[lparser->error - 1][0]);
+        lua_pushstring(L, lhp_errors[lparser->error - 1][1]);
+        return 3;
+    }
+    lua_pushinteger(L, http_errno);
+    lua_pushstring(L, http_errno_name(http_errno));
+    lua_pushstring(L, http_errno_description(http_errno));
+    return 3;
+}
+
+#ifdef LHP_STATS
+/* Push the stats as a table, with the event counts in an events table
+ * keyed by callback name.
+ */
+static void lhp_push_stats(lua_State* L, const lhp_stats* stats) {
+    int cb_id;
+
+    lua_createtable(L, 0, 10);
+#define SET_STAT(name) \
+    lhp_pushint64(L, (int64_t)stats->name); \
+    lua_setfield(L, -2, #name);
+
+    SET_STAT(bytes);
+    SET_STAT(messages);
+    SET_STAT(fragments);
+    SET_STAT(strings);
+    SET_STAT(buffered);
+    SET_STAT(peak_buffer);
+#undef SET_STAT
+
+#ifdef LHP_STATS_TIMING
+    lua_pushnumber(L, stats->parse_ns / 1e9);
+    lua_setfield(L, -2, "parse_time");
+    lua_pushnumber(L, stats->callback_ns / 1e9);
+    lua_setfield(L, -2, "callback_time");
+#endif
+
+    lua_createtable(L, 0, CB_LEN);
+    for (cb_id = 1; cb_id <= (int)CB_LEN; cb_id++ ) {
+        lhp_pushint64(L, (int64_t)stats->events[cb_id-1]);
+        lua_setfield(L, -2, lhp_callback_names[cb_id-1]);
+    }
+    lua_setfield(L, -2, "events");
+}
+
+/* parser:stats([reset]) */
+static int lhp_parser_stats(lua_State* L) {
+    lhttp_parser* lparser = check_parser(L, 1);
+    lhp_push_stats(L, &(lparser->stats));
+    if ( lua_toboolean(L, 2) ) memset(&(lparser->stats), 0, sizeof(lhp_stats));
+    return 1;
+}
+
+/* lhp.stats([reset]) */
+static int lhp_module_stats(lua_State* L) {
+    lhp_stats* stats;
+
+    lua_getfield(L, LUA_REGISTRYINDEX, STATS_KEY);
+    stats = (lhp_stats*)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    lhp_push_stats(L, stats);
+    if ( lua_toboolean(L, 1) ) memset(stats, 0, sizeof(lhp_stats));
+    return 1;
+}
+#endif
+
+#ifdef LHP_STATS_TIMING
+/* Called by the lua stub as c_done(parser) once the last callbacks of
+ * an execute ran.
+ */
+static int lhp_execute_done(lua_State* L) {
+    lhttp_parser* lparser = check_parser(L, 1);
+    if ( lparser->callbacks_start ) {
+        LHP_STAT_ADD(lparser, callback_ns, lhp_now_ns() - lparser->callbacks_start);
+        lparser->callbacks_start = 0;
+    }
+    return 0;
+}
+#endif
+
+/* lhp.parse_url(url[, is_connect[, t]]) returns the parts of url in
+ * the table t, which is created if not given.  Parts missing from url
+ * are set to nil in t, so it can be reused.
+ */
+static int lhp_parse_url(lua_State* L){
+
+#define SET_UF_FIELD(id, name) \
+    if(url.field_set & (1 << id)){ \
+      lua_pushlstring(L, u + url.field_data[id].off, url.field_data[id].len); \
+    } else { \
+      lua_pushnil(L); \
+    } \
+    lua_setfield(L, 3, name);
+
+    size_t len; const char *u = luaL_checklstring(L, 1, &len);
+    int is_connect = lua_toboolean(L, 2);
+    struct http_parser_url url;
+    int result;
+
+    if ( lua_isnoneornil(L, 3) ) {
+        lua_settop(L, 2);
+        lua_newtable(L);
+    } else {
+        luaL_checktype(L, 3, LUA_TTABLE);
+        lua_settop(L, 3);
+    }
+
+    memset(&url, 0, sizeof(url));
+    result = http_parser_parse_url(u, len, is_connect, &url);
+    if (result != 0) {
+      lua_pushnil(L);
+      lua_pushinteger(L, result);
+      return 2;
+    }
+
+    if(url.field_set & (1 << UF_PORT)){
+      lua_pushinteger(L, url.port);
+    } else {
+      lua_pushnil(L);
+    }
+    lua_setfield(L, 3, "port");
+
+    SET_UF_FIELD(UF_SCHEMA,   "schema"  );
+    SET_UF_FIELD(UF_HOST,     "host"    );
+    SET_UF_FIELD(UF_PATH,     "path"    );
+    SET_UF_FIELD(UF_QUERY,    "query"   );
+    SET_UF_FIELD(UF_FRAGMENT, "fragment");
+    SET_UF_FIELD(UF_USERINFO, "userinfo");
+
+    return 1;
+#undef SET_UF_FIELD
+}
+
+/* Push the len bytes at str with "+" and %XX decoded. */
+static void lhp_push_form_decoded(lua_State* L, const lhp_scanner* scanner, const char* str, size_t len) {
+    luaL_Buffer b;
+    size_t      i = lhp_scan(scanner, str, len, '%', '+');
+
+    if ( i == len ) {
+        lua_pushlstring(L, str, len);
+        return;
+    }
+
+    luaL_buffinit(L, &b);
+    while ( i < len ) {
+        int hi, lo;
+
+        luaL_addlstring(&b, str, i);
+        str += i;
+        len -= i;
+        if ( '+' == *str ) {
+            luaL_addchar(&b, ' ');
+            i = 1;
+        } else if ( len >= 3 &&
+                    (hi = lhp_hex_value(str[1])) >= 0 &&
+                    (lo = lhp_hex_value(str[2])) >= 0 ) {
+            luaL_addchar(&b, (char)((hi << 4) | lo));
+            i = 3;
+        } else {
+            luaL_addchar(&b, '%');
+            i = 1;
+        }
+        str += i;
+        len -= i;
+        i = lhp_scan(scanner, str, len, '%', '+');
+    }
+    luaL_addlstring(&b, str, len);
+    luaL_pushresult(&b);
+}
+
+/* Decode the key[=value] pair of len bytes at str into the table at t.
+ * The value of a repeated key becomes an array of all its values.
+ */
+static void lhp_query_pair(lua_State* L, const lhp_scanner* scanner, int t, const char* str, size_t len) {
+    size_t eq;
+
+    if ( 0 == len ) return;
+
+    eq = lhp_scan(scanner, str, len, '=', '=');
+    lhp_push_form_decoded(L, scanner, str, eq);
+    if ( eq < len ) {
+        lhp_push_form_decoded(L, scanner, str + eq + 1, len - eq - 1);
+    } else {
+        lua_pushliteral(L, "");
+    }
+    /* Stack: key, value */
+
+    lua_pushvalue(L, -2);
+    lua_rawget(L, t);
+    switch ( lua_type(L, -1) ) {
+    case LUA_TNIL:
+        lua_pop(L, 1);
+        lua_rawset(L, t);
+        return;
+    case LUA_TTABLE:
+        lua_insert(L, -2);
+        lua_rawseti(L, -2, (int)lua_objlen(L, -2) + 1);
+        lua_pop(L, 2);
+        return;
+    default:
+        /* Stack: key, value, first value */
+        lua_createtable(L, 2, 0);
+        lua_insert(L, -2);
+        lua_rawseti(L, -2, 1);
+        lua_insert(L, -2);
+        lua_rawseti(L, -2, 2);
+        lua_rawset(L, t);
+    }
+}
+
+/* Decode the pairs of the len bytes at str into the table at t.  If
+ * not final the bytes after the last "&" may be the start of a pair
+ * continued by the next chunk: they are left alone.  Returns the
+ * number of bytes decoded.
+ */
+static size_t lhp_query_pairs(lua_State* L, const lhp_scanner* scanner, int t,
+                              const char* str, size_t len, int final) {
+    size_t done = 0;
+
+    for (;;) {
+        size_t amp = lhp_scan(scanner, str + done, len - done, '&', '&');
+        if ( done + amp == len ) {
+            if ( ! final ) return done;
+            lhp_query_pair(L, scanner, t, str + done, amp);
+            return len;
+        }
+        lhp_query_pair(L, scanner, t, str + done, amp);
+        done += amp + 1;
+    }
+}
+
+/* lhp.parse_query(str[, t]) decodes a query string or an
+ * application/x-www-form-urlencoded body into the table t, which is
+ * created if not given.
+ */
+static int lhp_parse_query(lua_State* L) {
+    size_t      len;
+    const char* str = luaL_checklstring(L, 1, &len);
+
+    if ( lua_isnoneornil(L, 2) ) {
+        lua_settop(L, 1);
+        lua_newtable(L);
+    } else {
+        luaL_checktype(L, 2, LUA_TTABLE);
+        lua_settop(L, 2);
+    }
+    lhp_query_pairs(L, lhp_get_scanner(L), 2, str, len, 1);
+    return 1;
+}
+
+/* lhp.query_decoder([t]) returns a decoder that parse_query()s the
+ * chunks passed to decoder:feed() into t.  The userdata is the lhp_buf
+ * holding the unfinished last pair, its fenv is t.
+ */
+static int lhp_query_new(lua_State* L) {
+    lhp_buf* buf;
+
+    if ( lua_isnoneornil(L, 1) ) {
+        lua_settop(L, 0);
+        lua_newtable(L);
+    } else {
+        luaL_checktype(L, 1, LUA_TTABLE);
+        lua_settop(L, 1);
+    }
+
+    buf = (lhp_buf*)lua_newuserdata(L, sizeof(lhp_buf));
+    memset(buf, 0, sizeof(lhp_buf));
+    luaL_getmetatable(L, QUERY_MT);
+    lua_setmetatable(L, -2);
+    lua_pushvalue(L, 1);
+    lua_setfenv(L, -2);
+    return 1;
+}
+
+/* decoder:feed(chunk) decodes the pairs completed by chunk.  A nil
+ * chunk is the same as decoder:finish(), so feed works as on_body.
+ */
+static int lhp_query_feed(lua_State* L) {
+    lhp_buf*    buf = check_query(L, 1);
+    const lhp_scanner* scanner = lhp_get_scanner(L);
+    size_t      len;
+    size_t      done = 0;
+    const char* str;
+
+    if ( lua_isnoneornil(L, 2) ) {
+        lua_settop(L, 1);
+        lua_getfenv(L, 1);
+        lhp_query_pairs(L, scanner, 2, buf->data, buf->len, 1);
+        buf->len = 0;
+        lua_newtable(L);
+        lua_setfenv(L, 1);
+        return 1;
+    }
+
+    str = luaL_checklstring(L, 2, &len);
+    lua_settop(L, 2);
+    lua_getfenv(L, 1);
+
+    if ( buf->len ) {
+        /* Finish the pair started by previous chunks. */
+        size_t amp = lhp_scan(scanner, str, len, '&', '&');
+        if ( 0 != lhp_buf_append(L, buf, str, amp) ) {
+            return luaL_error(L, "out of memory");
+        }
+        if ( amp == len ) return 0;
+        lhp_query_pair(L, scanner, 3, buf->data, buf->len);
+        buf->len = 0;
+        done = amp + 1;
+    }
+
+    done += lhp_query_pairs(L, scanner, 3, str + done, len - done, 0);
+    if ( 0 != lhp_buf_append(L, buf, str + done, len - done) ) {
+        return luaL_error(L, "out of memory");
+    }
+    return 0;
+}
+
+/* decoder:finish() decodes the last pair and returns the table.  The
+ * decoder then starts over with a new table.
+ */
+static int lhp_query_finish(lua_State* L) {
+    check_query(L, 1);
+    lua_settop(L, 1);
+    return lhp_query_feed(L);
+}
+
+static int lhp_query__gc(lua_State* L) {
+    lhp_buf_free(L, check_query(L, 1));
+    return 0;
+}
+
+static int lhp_query__tostring(lua_State* L) {
+    lhp_buf* buf = check_query(L, 1);
+    lua_pushfstring(L, QUERY_MT" %p", buf);
+    return 1;
+}
+
+/* lhp.scanner([name]) returns the name of the byte scanner of the
+ * lua_State after switching it to the scanner called name, if given.
+ */
+static int lhp_pick_scanner(lua_State* L) {
+    const char* name = luaL_optstring(L, 1, NULL);
+    if ( NULL != name ) {
+        const lhp_scanner* scanner = lhp_scanner_find(name);
+        if ( NULL == scanner ) return luaL_argerror(L, 1, "scanner not supported");
+        lua_pushlightuserdata(L, (void*)scanner);
+        lua_setfield(L, LUA_REGISTRYINDEX, SCANNER_KEY);
+    }
+    lua_pushstring(L, lhp_scanner_name(lhp_get_scanner(L)));
+    return 1;
+}
+
+/* Method names known to http_parser, which serialize_request()
+ * accepts.
+ */
+static const char *lhp_method_names[] = {
+#define XX(num, name, string) #string,
+    HTTP_METHOD_MAP(XX)
+#undef XX
+};
+#define LHP_METHOD_NAMES_LEN (sizeof(lhp_method_names)/sizeof(*lhp_method_names))
+
+/* Returns the reason phrase of status, or "" if it is not known.
+ * http_parser only has a status table from version 2.8.
+ */
+static const char* lhp_status_text(int status) {
+    switch ( status ) {
+#ifdef HTTP_STATUS_MAP
+#define XX(num, name, string) case num: return #string;
+    HTTP_STATUS_MAP(XX)
+#undef XX
+#else
+    case 100: return "Continue";
+    case 101: return "Switching Protocols";
+    case 200: return "OK";
+    case 201: return "Created";
+    case 202: return "Accepted";
+    case 203: return "Non-Authoritative Information";
+    case 204: return "No Content";
+    case 205: return "Reset Content";
+    case 206: return "Partial Content";
+    case 300: return "Multiple Choices";
+    case 301: return "Moved Permanently";
+    case 302: return "Found";
+    case 303: return "See Other";
+    case 304: return "Not Modified";
+    case 307: return "Temporary Redirect";
+    case 308: return "Permanent Redirect";
+    case 400: return "Bad Request";
+    case 401: return "Unauthorized";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 406: return "Not Acceptable";
+    case 408: return "Request Timeout";
+    case 409: return "Conflict";
+    case 410: return "Gone";
+    case 411: return "Length Required";
+    case 412: return "Precondition Failed";
+    case 413: return "Payload Too Large";
+    case 414: return "URI Too Long";
+    case 415: return "Unsupported Media Type";
+    case 416: return "Range Not Satisfiable";
+    case 417: return "Expectation Failed";
+    case 426: return "Upgrade Required";
+    case 428: return "Precondition Required";
+    case 429: return "Too Many Requests";
+    case 431: return "Request Header Fields Too Large";
+    case 500: return "Internal Server Error";
+    case 501: return "Not Implemented";
+    case 502: return "Bad Gateway";
+    case 503: return "Service Unavailable";
+    case 504: return "Gateway Timeout";
+    case 505: return "HTTP Version Not Supported";
+#endif
+    }
+    return "";
+}
+
+/* Returns the length of the header field (is_field) or value at idx,
+ * raising an error if it can't be written as is: fields must be
+ * non-empty tokens and values must not contain CR or LF.
+ */
+static size_t lhp_header_text(lua_State* L, const lhp_scanner* scanner, int idx, int is_field) {
+    size_t      len, i;
+    const char* str;
+
+    if ( is_field ? LUA_TSTRING != lua_type(L, idx) : ! lua_isstring(L, idx) ) {
+        luaL_error(L, "header %s must be a string", is_field ? "field" : "value");
+    }
+    str = lua_tolstring(L, idx, &len);
+    if ( ! is_field ) {
+        if ( lhp_scan(scanner, str, len, '\r', '\n') < len ) {
+            luaL_error(L, "header value contains CR or LF");
+        }
+        return len;
+    }
+    for ( i = 0; i < len; i++ ) {
+        unsigned char c = (unsigned char)str[i];
+        if ( c <= ' ' || c >= 127 || ':' == c ) break;
+    }
+    if ( 0 == len || i < len ) luaL_error(L, "invalid header field");
+    return len;
+}
+
+/* Write the "field: value\r\n" line at out, or if out is NULL just
+ * check it.  The field is at -2 and the value at -1.  Returns the
+ * length of the line.
+ */
+static size_t lhp_header_line(lua_State* L, const lhp_scanner* scanner, char* out) {
+    size_t      flen = lhp_header_text(L, scanner, -2, 1);
+    size_t      vlen = lhp_header_text(L, scanner, -1, 0);
+
+    if ( NULL != out ) {
+        memcpy(out, lua_tostring(L, -2), flen);
+        out += flen;
+        *out++ = ':';
+        *out++ = ' ';
+        memcpy(out, lua_tostring(L, -1), vlen);
+        out += vlen;
+        *out++ = '\r';
+        *out   = '\n';
+    }
+    return flen + vlen + 4;
+}
+
+/* Write the lines of the headers table at t to out, or if out is NULL
+ * just check them.  A value that is an array is written as one line
+ * per element.  Returns the length of the lines.
+ */
+static size_t lhp_header_lines(lua_State* L, const lhp_scanner* scanner, int t, char* out) {
+    size_t size = 0;
+
+    lua_pushnil(L);
+    while ( lua_next(L, t) ) {
+        if ( lua_istable(L, -1) ) {
+            int i, n = (int)lua_objlen(L, -1);
+            for ( i = 1; i <= n; i++ ) {
+                lua_pushvalue(L, -2);
+                lua_rawgeti(L, -2, i);
+                size += lhp_header_line(L, scanner, out ? out + size : NULL);
+                lua_pop(L, 2);
+            }
         } else {
-            lua_pop(L, 1); /* pop non-function value. */
+            lua_pushvalue(L, -2);
+            lua_insert(L, -2);
+            size += lhp_header_line(L, scanner, out ? out + size : NULL);
+            lua_pop(L, 1);
         }
+        lua_pop(L, 1);
     }
-    /* Create buffer table and add it to the fenv table. */
-    lua_createtable(L, 1, 0);
-    lua_rawseti(L, -2, FENV_BUFFER_IDX);
-    /* Stack: callbacks, userdata, metatable, fenv */
-    lua_setfenv(L, -3);
-    /* Stack: callbacks, userdata, metatable */
-
-    http_parser_init(parser, type);
-    parser->data = NULL;
-
-    lua_setmetatable(L, -2);
-
-    return 1;
+    return size;
 }
 
-static int lhp_request(lua_State* L) {
-    return lhp_init(L, HTTP_REQUEST);
+/* Returns where to write size bytes of output: the end of the
+ * lhp.buffer() at out, or else a scratch userdata pushed for
+ * lhp_serialize_done().
+ */
+static char* lhp_serialize_reserve(lua_State* L, int out, size_t size) {
+    char* dst;
+
+    if ( lua_isnil(L, out) ) return (char*)lua_newuserdata(L, size);
+    dst = lhp_bytebuf_reserve(L, (lhp_bytebuf*)lua_touserdata(L, out), size);
+    if ( NULL == dst ) luaL_error(L, "out of memory");
+    return dst;
 }
 
-static int lhp_response(lua_State* L) {
-    return lhp_init(L, HTTP_RESPONSE);
+/* Push the result of writing size bytes at dst: the lhp.buffer() at
+ * out, now holding them, or else a string.
+ */
+static int lhp_serialize_done(lua_State* L, int out, const char* dst, size_t size) {
+    if ( lua_isnil(L, out) ) {
+        lua_pushlstring(L, dst, size);
+    } else {
+        ((lhp_bytebuf*)lua_touserdata(L, out))->buf.len += size;
+        lua_pushvalue(L, out);
+    }
+    return 1;
 }
 
-static int lhp_execute(lua_State* L) {
-    lhttp_parser* lparser = check_parser(L, 1);
-    http_parser*  parser = &(lparser->parser);
-    size_t        len;
-    size_t        result;
-    const char*   str = luaL_checklstring(L, 2, &len);
-
-    static const http_parser_settings settings = {
-        lhp_message_begin_cb,
-        lhp_url_cb,
-        lhp_status_cb,
-        lhp_header_field_cb,
-        lhp_header_value_cb,
-        lhp_headers_complete_cb,
-        lhp_body_cb,
-        lhp_message_complete_cb,
-        lhp_chunk_header_cb,
-        lhp_chunk_complete_cb
-    };
+/* Write the nstart pieces of the start line, the headers table at
+ * headers, the framing for the body at body and the empty line into
+ * one block sized up front.  The block is appended to the lhp.buffer()
+ * at out, which is returned, or else returned as a string.
+ */
+static int lhp_serialize(lua_State* L, const char** start, const size_t* start_len, int nstart,
+                         int headers, int body, int out) {
+    const lhp_scanner* scanner = lhp_get_scanner(L);
+    char        framing[64];
+    size_t      framing_len = 0;
+    size_t      size = 0;
+    char*       base;
+    char*       dst;
+    int         i;
+
+    if ( lua_isnumber(L, body) ) {
+        lua_Number len = lua_tonumber(L, body);
+        luaL_argcheck(L, len >= 0 && len < 9007199254740992.0 &&
+                      len == (lua_Number)(uint64_t)len, body,
+                      "body length must be a non-negative integer");
+        framing_len = sprintf(framing, "Content-Length: %llu\r\n",
+                              (unsigned long long)(uint64_t)len);
+    } else if ( lua_toboolean(L, body) ) {
+        luaL_argcheck(L, LUA_TBOOLEAN == lua_type(L, body), body,
+                      "body length or true for chunked expected");
+        framing_len = sizeof("Transfer-Encoding: chunked\r\n") - 1;
+        memcpy(framing, "Transfer-Encoding: chunked\r\n", framing_len);
+    }
 
-    /* truncate stack to (userdata, string) */
-    lua_settop(L, 2);
+    if ( ! lua_isnoneornil(L, out) ) check_bytebuf(L, out);
+    if ( ! lua_isnoneornil(L, headers) ) luaL_checktype(L, headers, LUA_TTABLE);
+    lua_settop(L, out);
 
-    lua_getfenv(L, 1);
-    assert(lua_istable(L, -1));
-    assert(lua_gettop(L) == ST_FENV_IDX);
+    for ( i = 0; i < nstart; i++ ) size += start_len[i];
+    if ( lua_istable(L, headers) ) size += lhp_header_lines(L, scanner, headers, NULL);
+    size += framing_len + 2;
 
-    lua_rawgeti(L, ST_FENV_IDX, FENV_BUFFER_IDX);
-    assert(lua_istable(L, -1));
-    assert(lua_gettop(L) == ST_BUFFER_IDX);
+    base = dst = lhp_serialize_reserve(L, out, size);
+    for ( i = 0; i < nstart; i++ ) {
+        memcpy(dst, start[i], start_len[i]);
+        dst += start_len[i];
+    }
+    if ( lua_istable(L, headers) ) dst += lhp_header_lines(L, scanner, headers, dst);
+    memcpy(dst, framing, framing_len);
+    dst += framing_len;
+    memcpy(dst, "\r\n", 2);
 
-    assert(lua_gettop(L) == ST_LEN);
-    lua_pushnil(L);
+    return lhp_serialize_done(L, out, base, size);
+}
 
-    /* Stack: (userdata, string, fenv, buffer, url, nil) */
-    parser->data = L;
+/* lhp.serialize_request(method, url, headers[, body[, buffer]]) */
+static int lhp_serialize_request(lua_State* L) {
+    const lhp_scanner* scanner = lhp_get_scanner(L);
+    const char* start[5];
+    size_t      start_len[5];
+    size_t      i;
+
+    start[0] = luaL_checklstring(L, 1, &start_len[0]);
+    start[2] = luaL_checklstring(L, 2, &start_len[2]);
+    for ( i = 0; i < LHP_METHOD_NAMES_LEN; i++ ) {
+        if ( start_len[0] == strlen(lhp_method_names[i]) &&
+             0 == memcmp(start[0], lhp_method_names[i], start_len[0]) ) break;
+    }
+    luaL_argcheck(L, i < LHP_METHOD_NAMES_LEN, 1, "unknown method");
+    luaL_argcheck(L, start_len[2] > 0 &&
+                  lhp_scan(scanner, start[2], start_len[2], ' ', '\r') == start_len[2] &&
+                  lhp_scan(scanner, start[2], start_len[2], '\n', '\t') == start_len[2],
+                  2, "invalid url");
+
+    start[1] = " ";
+    start_len[1] = 1;
+    start[3] = " HTTP/1.1\r\n";
+    start_len[3] = sizeof(" HTTP/1.1\r\n") - 1;
+    return lhp_serialize(L, start, start_len, 4, 3, 4, 5);
+}
 
-    result = http_parser_execute(parser, &settings, str, len);
+/* lhp.serialize_response(status, headers[, body[, buffer]]) */
+static int lhp_serialize_response(lua_State* L) {
+    lua_Number  status = luaL_checknumber(L, 1);
+    char        line[32];
+    const char* start[3];
+    size_t      start_len[3];
+
+    luaL_argcheck(L, status >= 100 && status <= 999 && status == (int)status,
+                  1, "invalid status code");
+
+    start_len[0] = sprintf(line, "HTTP/1.1 %d ", (int)status);
+    start[0] = line;
+    start[1] = lhp_status_text((int)status);
+    start_len[1] = strlen(start[1]);
+    start[2] = "\r\n";
+    start_len[2] = 2;
+    return lhp_serialize(L, start, start_len, 3, 2, 3, 4);
+}
 
-    parser->data = NULL;
+/* lhp.serialize_chunk(data[, buffer]) frames data as one chunk of a
+ * chunked body.  An empty or nil data is the last chunk.
+ */
+static int lhp_serialize_chunk(lua_State* L) {
+    size_t      len = 0;
+    const char* data = luaL_optlstring(L, 1, "", &len);
+    char        head[32];
+    size_t      head_len, size;
+    char*       dst;
+
+    if ( ! lua_isnoneornil(L, 2) ) check_bytebuf(L, 2);
+    lua_settop(L, 2);
 
-    /* replace nil place-holder with 'result' code. */
-    lhp_pushint64(L, result);
-    lua_replace(L, ST_LEN+1);
-    /* Transform the stack into a table: */
-    len = lua_gettop(L) - ST_LEN;
+    head_len = sprintf(head, "%llx\r\n", (unsigned long long)len);
+    size = head_len + len + 2;
 
-    return len;
+    dst = lhp_serialize_reserve(L, 2, size);
+    memcpy(dst, head, head_len);
+    memcpy(dst + head_len, data, len);
+    memcpy(dst + head_len + len, "\r\n", 2);
+    return lhp_serialize_done(L, 2, dst, size);
 }
 
-static int lhp_should_keep_alive(lua_State* L) {
-    lhttp_parser* lparser = check_parser(L, 1);
-    lua_pushboolean(L, http_should_keep_alive(&lparser->parser));
-    return 1;
+/* The records of a parse_batch() call, in a userdata so they are
+ * freed even if building the result raises an error.
+ */
+typedef struct lhp_batch {
+    size_t          nitems;
+    lhp_batch_item  items[1];
+} lhp_batch;
+
+static int lhp_batch__gc(lua_State* L) {
+    lhp_batch* batch = (lhp_batch*)luaL_checkudata(L, 1, BATCH_MT);
+    size_t     i;
+    for ( i = 0; i < batch->nitems; i++ ) lhp_batch_item_free(&(batch->items[i]));
+    batch->nitems = 0;
+    return 0;
 }
 
-static int lhp_is_upgrade(lua_State* L) {
-    lhttp_parser* lparser = check_parser(L, 1);
-    lua_pushboolean(L, lparser->parser.upgrade);
-    return 1;
+static int lhp_pool__gc(lua_State* L) {
+    lhp_batch_pool** pool = (lhp_batch_pool**)luaL_checkudata(L, 1, POOL_MT);
+    lhp_batch_pool_free(*pool);
+    *pool = NULL;
+    return 0;
 }
 
-static int lhp__tostring(lua_State* L) {
-    lhttp_parser* lparser = check_parser(L, 1);
-    lua_pushfstring(L, PARSER_MT" %p", lparser);
-    return 1;
-}
+/* Returns the thread pool of this lua_State, which is created on first
+ * use and stopped when the state is closed.  NULL if out of memory,
+ * the batch then runs on the calling thread.
+ */
+static lhp_batch_pool* lhp_get_pool(lua_State* L) {
+    lhp_batch_pool** pool;
 
-static int lhp_method(lua_State* L) {
-    lhttp_parser* lparser = check_parser(L, 1);
-    switch(lparser->parser.method) {
-    case HTTP_DELETE:    lua_pushliteral(L, "DELETE"); break;
-    case HTTP_GET:       lua_pushliteral(L, "GET"); break;
-    case HTTP_HEAD:      lua_pushliteral(L, "HEAD"); break;
-    case HTTP_POST:      lua_pushliteral(L, "POST"); break;
-    case HTTP_PUT:       lua_pushliteral(L, "PUT"); break;
-    case HTTP_CONNECT:   lua_pushliteral(L, "CONNECT"); break;
-    case HTTP_OPTIONS:   lua_pushliteral(L, "OPTIONS"); break;
-    case HTTP_TRACE:     lua_pushliteral(L, "TRACE"); break;
-    case HTTP_COPY:      lua_pushliteral(L, "COPY"); break;
-    case HTTP_LOCK:      lua_pushliteral(L, "LOCK"); break;
-    case HTTP_MKCOL:     lua_pushliteral(L, "MKCOL"); break;
-    case HTTP_MOVE:      lua_pushliteral(L, "MOVE"); break;
-    case HTTP_PROPFIND:  lua_pushliteral(L, "PROPFIND"); break;
-    case HTTP_PROPPATCH: lua_pushliteral(L, "PROPPATCH"); break;
-    case HTTP_UNLOCK:    lua_pushliteral(L, "UNLOCK"); break;
-    default:
-        lua_pushnumber(L, lparser->parser.method);
-    }
-    return 1;
-}
+    lua_getfield(L, LUA_REGISTRYINDEX, POOL_KEY);
+    pool = (lhp_batch_pool**)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    if ( NULL != pool ) return *pool;
 
-static int lhp_version(lua_State* L) {
-    lhttp_parser* lparser = check_parser(L, 1);
-    lua_pushnumber(L, lparser->parser.http_major);
-    lua_pushnumber(L, lparser->parser.http_minor);
-    return 2;
+    pool = (lhp_batch_pool**)lua_newuserdata(L, sizeof(lhp_batch_pool*));
+    *pool = NULL;
+    luaL_getmetatable(L, POOL_MT);
+    lua_setmetatable(L, -2);
+    *pool = lhp_batch_pool_new();
+    lua_setfield(L, LUA_REGISTRYINDEX, POOL_KEY);
+    return *pool;
 }
 
-static int lhp_status_code(lua_State* L) {
-    lhttp_parser* lparser = check_parser(L, 1);
-    lua_pushnumber(L, lparser->parser.status_code);
-    return 1;
-}
+/* Set the field header in the headers table at -1 to its nvalue
+ * HEADER_VALUE records from value, the lines of a folded value joined
+ * as they are.  The values of a repeated header are joined with ", "
+ * like aggregated messages do.
+ */
+static void lhp_batch_header(lua_State* L, const lhp_batch_item* item, const lhp_raw_event* field,
+                             const lhp_raw_event* value, size_t nvalue) {
+    int repeated;
 
-static int lhp_error(lua_State* L) {
-    lhttp_parser* lparser = check_parser(L, 1);
-    enum http_errno http_errno = lparser->parser.http_errno;
-    lua_pushinteger(L, http_errno);
-    lua_pushstring(L, http_errno_name(http_errno));
-    lua_pushstring(L, http_errno_description(http_errno));
-    return 3;
+    lua_pushlstring(L, item->data + field->offset, field->length);
+    lua_pushvalue(L, -1);
+    lua_rawget(L, -3);
+    repeated = ! lua_isnil(L, -1);
+    if ( repeated ) {
+        lua_pushliteral(L, ", ");
+    } else {
+        lua_pop(L, 1);
+    }
+    if ( 0 == nvalue ) {
+        lua_pushliteral(L, "");
+    } else if ( 1 == nvalue ) {
+        lua_pushlstring(L, item->data + value->offset, value->length);
+    } else {
+        luaL_Buffer b;
+        luaL_buffinit(L, &b);
+        for ( ; nvalue; value++, nvalue-- ) {
+            luaL_addlstring(&b, item->data + value->offset, value->length);
+        }
+        luaL_pushresult(&b);
+    }
+    if ( repeated ) lua_concat(L, 3);
+    lua_rawset(L, -3);
 }
 
-static int lhp_parse_url(lua_State* L){
-
-#define SET_UF_FIELD(id, name) \
-    if(url.field_set & (1 << id)){ \
-      lua_pushlstring(L, u + url.field_data[id].off, url.field_data[id].len); \
-      lua_setfield(L, -2, name); \
+/* Push the table of message m of item, like the ones on_message gets.
+ */
+static void lhp_push_batch_message(lua_State* L, const lhp_batch_item* item,
+                                   const lhp_batch_message* m, int response) {
+    const lhp_raw_event* ev = item->events + m->first_event;
+    const lhp_raw_event* end = ev + m->nevents;
+    const lhp_raw_event* field = NULL;
+    const lhp_raw_event* value = NULL;
+    const lhp_raw_event* body = NULL;
+    size_t               nvalue = 0;
+    size_t               nbody = 0;
+
+    lua_createtable(L, 0, 9);
+    if ( response ) {
+        lua_pushinteger(L, m->status_code);
+        lua_setfield(L, -2, "status_code");
+    } else {
+        lhp_push_method(L, m->method);
+        lua_setfield(L, -2, "method");
     }
+    lua_pushinteger(L, m->http_major);
+    lua_setfield(L, -2, "major");
+    lua_pushinteger(L, m->http_minor);
+    lua_setfield(L, -2, "minor");
+    lua_pushboolean(L, m->keep_alive);
+    lua_setfield(L, -2, "keep_alive");
+    lua_pushboolean(L, m->upgrade);
+    lua_setfield(L, -2, "upgrade");
 
-    size_t len; const char *u = luaL_checklstring(L, 1, &len);
-    int is_connect = lua_toboolean(L, 2);
-    struct http_parser_url url;
-    int result = http_parser_parse_url(u, len, is_connect, &url);
-    if (result != 0) {
-      lua_pushnil(L);
-      lua_pushinteger(L, result);
+    lua_newtable(L);
+    for ( ; ev < end; ev++ ) {
+        const char* str = item->data + ev->offset;
+        switch ( ev->type ) {
+        case LHP_RAW_URL:
+        case LHP_RAW_STATUS:
+            lua_pushlstring(L, str, ev->length);
+            lua_setfield(L, -3, LHP_RAW_URL == ev->type ? "url" : "status_text");
+            break;
+        case LHP_RAW_HEADER_FIELD:
+            if ( NULL != field ) lhp_batch_header(L, item, field, value, nvalue);
+            field  = ev;
+            nvalue = 0;
+            break;
+        case LHP_RAW_HEADER_VALUE:
+            if ( 0 == nvalue++ ) value = ev;
+            break;
+        case LHP_RAW_BODY:
+            if ( 0 == nbody++ ) body = ev;
+            break;
+        }
+    }
+    if ( NULL != field ) lhp_batch_header(L, item, field, value, nvalue);
+    lua_setfield(L, -2, "headers");
+
+    if ( 1 == nbody ) {
+        lua_pushlstring(L, item->data + body->offset, body->length);
+        lua_setfield(L, -2, "body");
+    } else if ( nbody > 1 ) {
+        luaL_Buffer b;
+        luaL_buffinit(L, &b);
+        for ( ev = body; ev < end; ev++ ) {
+            if ( LHP_RAW_BODY == ev->type ) {
+                luaL_addlstring(&b, item->data + ev->offset, ev->length);
+            }
+        }
+        luaL_pushresult(&b);
+        lua_setfield(L, -2, "body");
     }
+}
 
-    lua_newtable(L);
+/* lhp.parse_batch(buffers[, options]) parses each string or
+ * lhp.buffer() of the buffers array as the start of its own
+ * connection, on up to options.threads threads.
+ */
+static int lhp_parse_batch(lua_State* L) {
+    lhp_batch* batch;
+    size_t     nitems, i, j;
+    int        threads = lhp_batch_cpus();
+    int        response = 0;
 
-    if(url.field_set & (1 << UF_PORT)){
-      lua_pushinteger(L, url.port);
-      lua_setfield(L, -2, "port");
+    luaL_checktype(L, 1, LUA_TTABLE);
+    if ( ! lua_isnoneornil(L, 2) ) {
+        luaL_checktype(L, 2, LUA_TTABLE);
+        lua_getfield(L, 2, "threads");
+        if ( ! lua_isnil(L, -1) ) threads = (int)luaL_checknumber(L, -1);
+        lua_getfield(L, 2, "response");
+        response = lua_toboolean(L, -1);
+        lua_pop(L, 2);
+    }
+    luaL_argcheck(L, threads >= 1, 2, "threads must be at least 1");
+    lua_settop(L, 1);
+
+    nitems = lua_objlen(L, 1);
+    batch = (lhp_batch*)lua_newuserdata(L, sizeof(lhp_batch) +
+                                        (nitems ? nitems - 1 : 0) * sizeof(lhp_batch_item));
+    batch->nitems = 0;
+    luaL_getmetatable(L, BATCH_MT);
+    lua_setmetatable(L, -2);
+    /* Stack: buffers, batch */
+
+    for ( i = 0; i < nitems; i++ ) {
+        lhp_batch_item* item = &(batch->items[i]);
+        size_t          offset;
+
+        memset(item, 0, sizeof(lhp_batch_item));
+        lua_rawgeti(L, 1, (int)i + 1);
+        /* Only values the buffers table keeps alive, no converted
+         * numbers that could be collected while the threads parse. */
+        if ( LUA_TSTRING != lua_type(L, 3) && LUA_TUSERDATA != lua_type(L, 3) ) {
+            return luaL_error(L, "buffers[%d] is not a string or lhp.buffer()", (int)i + 1);
+        }
+        item->data = lhp_check_input(L, 3, 4, &offset, &(item->len));
+        lua_pop(L, 1);
     }
+    batch->nitems = nitems;
 
-    SET_UF_FIELD(UF_SCHEMA,   "schema"  );
-    SET_UF_FIELD(UF_HOST,     "host"    );
-    SET_UF_FIELD(UF_PATH,     "path"    );
-    SET_UF_FIELD(UF_QUERY,    "query"   );
-    SET_UF_FIELD(UF_FRAGMENT, "fragment");
-    SET_UF_FIELD(UF_USERINFO, "userinfo");
+    lhp_batch_run(lhp_get_pool(L), batch->items, nitems, response, threads);
+
+    lua_createtable(L, (int)nitems, 0);
+    for ( i = 0; i < nitems; i++ ) {
+        lhp_batch_item* item = &(batch->items[i]);
 
+        lua_createtable(L, (int)item->nmessages, 2);
+        for ( j = 0; j < item->nmessages; j++ ) {
+            lhp_push_batch_message(L, item, &(item->messages[j]), response);
+            lua_rawseti(L, -2, (int)j + 1);
+        }
+        lhp_pushint64(L, item->bytes_read);
+        lua_setfield(L, -2, "bytes_read");
+        if ( HPE_OK != item->http_errno ) {
+            lua_pushstring(L, http_errno_name((enum http_errno)item->http_errno));
+            lua_setfield(L, -2, "error");
+        }
+        lua_rawseti(L, -2, (int)i + 1);
+        lhp_batch_item_free(item);
+    }
     return 1;
-#undef SET_UF_FIELD
 }
 
 static int lhp_reset(lua_State* L) {
@@ -576,12 +3663,27 @@ static int lhp_reset(lua_State* L) {
 
     /* re-initialize http-parser. */
     http_parser_init(parser, parser->type);
+    lparser->in_message = 0;
+#ifdef LHP_ZLIB
+    lhp_inflate_drop(lparser);
+#endif
 
     /* truncate stack to (userdata) calbacks fenv */
     lua_getfenv(L, 1);
 
-    /* reset callbacks */
-    if(lua_istable(L, 2)){
+    /* reset callbacks, into a fenv of its own if the fenv is shared */
+    if(lua_istable(L, 2) && lparser->shared){
+        int cb_id;
+        for (cb_id = 1; cb_id <= CB_LEN; cb_id++ ) {
+            FLAG_RM_CB(lparser->flags, cb_id);
+        }
+        lua_pop(L, 1);
+        lparser->headers = lhp_push_prototype(L, 2, &(lparser->flags));
+        lua_setfenv(L, 1);
+        lparser->shared = 0;
+        lparser->options = lhp_get_options(L, 2);
+        lhp_get_limits(L, 2, &(lparser->limits));
+    } else if(lua_istable(L, 2)){
         int cb_id;
         for (cb_id = 1; cb_id <= CB_LEN; cb_id++ ) {
             lua_getfield(L, 2, lhp_callback_names[cb_id-1]);
@@ -594,16 +3696,30 @@ static int lhp_reset(lua_State* L) {
             }
             lua_rawseti(L, -2, cb_id); /* fenv[cb_id] = callback */
         }
+        lparser->headers = lhp_set_headers(L, 2, 3);
+        lparser->options = lhp_get_options(L, 2);
+        lhp_get_limits(L, 2, &(lparser->limits));
+    }
+    if(lua_istable(L, 2)){
+        lua_getfield(L, 2, "body_sink");
+        lhp_set_body_sink(L, lparser, lua_gettop(L));
+        lua_pop(L, 1);
     }
 
-    /* clear buffer */
-    lua_rawgeti(L, 2, FENV_BUFFER_IDX);
-    lhp_table_clear(L, 3, 1, lparser->buf_len);
+    /* drop any partially aggregated message */
+    lhp_drop_message(L, lparser);
+    lparser->error = 0;
 
-    /* reset buffer length and flags. */
-    lparser->buf_len = 0;
+    /* reset buffer length and flags, the buffer memory is kept. */
+    lparser->buf.len    = 0;
+    lparser->body.len   = 0;
+    lparser->hfield_len = 0;
+#ifdef LHP_ZLIB
+    lparser->coding     = LHP_CODING_NONE;
+#endif
     FLAG_RM_BUF(lparser->flags);
     FLAG_RM_HFIELD(lparser->flags);
+    FLAG_RM_SKIP(lparser->flags);
     return 0;
 }
 
@@ -613,24 +3729,44 @@ static int lhp_is_function(lua_State* L) {
 }
 
 /* The execute method has a "lua based stub" so that callbacks
- * can yield without having to apply the CoCo patch to Lua. */
+ * can yield without having to apply the CoCo patch to Lua.  When
+ * c_execute had to pause to keep the stack small, the stub runs the
+ * callbacks collected so far and resumes parsing where it stopped.
+ */
+#ifdef LHP_STATS_TIMING
+#define LHP_EXECUTE_DONE_LUA "    c_done(self)\n"
+#else
+#define LHP_EXECUTE_DONE_LUA ""
+#endif
 static const char* lhp_execute_lua =
-    "local c_execute, is_function = ...\n"
-    "local function execute(result, cb, arg1, arg2, ...)\n"
+    "local c_execute, is_function, c_done = ...\n"
+    "local function dispatch(cb, arg1, arg2, arg3, ...)\n"
     "    if ( not cb ) then\n"
-    "        return result\n"
+    "        return\n"
     "    end\n"
     "    if ( is_function(arg2) ) then\n"
     "        cb(arg1)\n"
-    "        return execute(result, arg2, ...)"
+    "        return dispatch(arg2, arg3, ...)"
+    "    end\n"
+    "    if ( is_function(arg3) ) then\n"
+    "        cb(arg1, arg2)\n"
+    "        return dispatch(arg3, ...)"
+    "    end\n"
+    "    cb(arg1, arg2, arg3)\n"
+    "    return dispatch(...)\n"
+    "end\n"
+    "local function execute(self, input, init, len, result, more, ...)\n"
+    "    dispatch(...)\n"
+    "    if ( more ) then\n"
+    "        return execute(self, input, init, len, c_execute(self, input, init, len, result))\n"
     "    end\n"
-    "    cb(arg1, arg2)\n"
-    "    return execute(result, ...)\n"
+    LHP_EXECUTE_DONE_LUA
+    "    return result\n"
     "end\n"
-    "return function(...)\n"
-    "    return execute(c_execute(...))\n"
+    "return function(self, input, init, len)\n"
+    "    return execute(self, input, init, len, c_execute(self, input, init, len))\n"
     "end";
-static void lhp_push_execute_fn(lua_State* L) {
+static void lhp_push_execute_fn(lua_State* L, int names) {
 #ifndef NDEBUG
     int top = lua_gettop(L);
 #endif
@@ -638,16 +3774,77 @@ static void lhp_push_execute_fn(lua_State* L) {
 
     if ( err ) lua_error(L);
 
-    lua_pushcfunction(L, lhp_execute);
+    lua_pushvalue(L, names);
+    lua_pushcclosure(L, lhp_execute, 1);
     lua_pushcfunction(L, lhp_is_function);
-    lua_call(L, 2, 1);
+#ifdef LHP_STATS_TIMING
+    lua_pushcfunction(L, lhp_execute_done);
+#else
+    lua_pushnil(L);
+#endif
+    lua_call(L, 3, 1);
 
     /* Compiled lua function should be at the top of the stack now. */
     assert(lua_gettop(L) == top + 1);
     assert(lua_isfunction(L, -1));
 }
 
+/* Push the table mapping execute_into() event codes to callback names
+ * and callback names to event codes.
+ */
+static void lhp_push_events(lua_State* L) {
+    int cb_id;
+
+    lua_createtable(L, CB_LEN, CB_LEN);
+    for (cb_id = 1; cb_id <= (int)CB_LEN; cb_id++ ) {
+        lua_pushstring(L, lhp_callback_names[cb_id-1]);
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, -3, cb_id);
+        lua_pushinteger(L, cb_id);
+        lua_rawset(L, -3);
+    }
+}
+
+/* Push the header names table, see lhp_header_names.
+ */
+static void lhp_push_header_names(lua_State* L) {
+    char lower[32];
+    int  idx;
+
+    lua_createtable(L, 2 * LHP_HEADER_NAMES_LEN, 0);
+    for ( idx = 1; idx <= (int)LHP_HEADER_NAMES_LEN; idx++ ) {
+        const char* name = lhp_header_names[idx-1];
+        size_t      len  = strlen(name);
+
+        assert(len <= sizeof(lower));
+        assert(lhp_header_name_idx(name, len, 0) == idx);
+
+        lua_pushlstring(L, name, len);
+        lua_rawseti(L, -2, idx);
+
+        memcpy(lower, name, len);
+        lhp_lowercase(lhp_get_scanner(L), lower, len);
+        lua_pushlstring(L, lower, len);
+        lua_rawseti(L, -2, (int)LHP_HEADER_NAMES_LEN + idx);
+    }
+}
+
 LUALIB_API int luaopen_http_parser(lua_State* L) {
+    int names;
+
+#ifdef LHP_STATS
+    /* module wide stats, shared by every parser of this lua_State. */
+    lua_getfield(L, LUA_REGISTRYINDEX, STATS_KEY);
+    if ( lua_isnil(L, -1) ) {
+        memset(lua_newuserdata(L, sizeof(lhp_stats)), 0, sizeof(lhp_stats));
+        lua_setfield(L, LUA_REGISTRYINDEX, STATS_KEY);
+    }
+    lua_pop(L, 1);
+#endif
+
+    lhp_push_header_names(L);
+    names = lua_gettop(L);
+
     /* parser metatable init */
     luaL_newmetatable(L, PARSER_MT);
 
@@ -660,6 +3857,9 @@ LUALIB_API int luaopen_http_parser(lua_State* L) {
     lua_pushcfunction(L, lhp__tostring);
     lua_setfield(L, -2, "__tostring");
 
+    lua_pushcfunction(L, lhp__gc);
+    lua_setfield(L, -2, "__gc");
+
     lua_pushcfunction(L, lhp_method);
     lua_setfield(L, -2, "method");
 
@@ -675,12 +3875,134 @@ LUALIB_API int luaopen_http_parser(lua_State* L) {
     lua_pushcfunction(L, lhp_should_keep_alive);
     lua_setfield(L, -2, "should_keep_alive");
 
-    lhp_push_execute_fn(L);
+    lhp_push_execute_fn(L, names);
     lua_setfield(L, -2, "execute");
 
+    lua_pushvalue(L, names);
+    lua_pushcclosure(L, lhp_execute_into, 1);
+    lua_setfield(L, -2, "execute_into");
+
+    lua_pushvalue(L, names);
+    lua_pushcclosure(L, lhp_execute_all, 1);
+    lua_setfield(L, -2, "execute_all");
+
     lua_pushcfunction(L, lhp_reset);
     lua_setfield(L, -2, "reset");
 
+    lua_pushcfunction(L, lhp_body_sink);
+    lua_setfield(L, -2, "body_sink");
+
+    lua_pushcfunction(L, lhp_parser_hibernate);
+    lua_setfield(L, -2, "hibernate");
+
+#ifdef LHP_STATS
+    lua_pushcfunction(L, lhp_parser_stats);
+    lua_setfield(L, -2, "stats");
+#endif
+
+    lua_pop(L, 1);
+
+    /* factory metatable init */
+    luaL_newmetatable(L, FACTORY_MT);
+
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+
+    lua_pushcfunction(L, lhp_factory__tostring);
+    lua_setfield(L, -2, "__tostring");
+
+    lua_pushcfunction(L, lhp_factory_request);
+    lua_setfield(L, -2, "request");
+
+    lua_pushcfunction(L, lhp_factory_response);
+    lua_setfield(L, -2, "response");
+
+    lua_pop(L, 1);
+
+    /* buffer metatable init */
+    luaL_newmetatable(L, BYTEBUF_MT);
+
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+
+    lua_pushcfunction(L, lhp_bytebuf__tostring);
+    lua_setfield(L, -2, "__tostring");
+
+    lua_pushcfunction(L, lhp_bytebuf__gc);
+    lua_setfield(L, -2, "__gc");
+
+    lua_pushcfunction(L, lhp_bytebuf__len);
+    lua_setfield(L, -2, "__len");
+
+    lua_pushcfunction(L, lhp_bytebuf__len);
+    lua_setfield(L, -2, "len");
+
+    lua_pushcfunction(L, lhp_bytebuf_append);
+    lua_setfield(L, -2, "append");
+
+    lua_pushcfunction(L, lhp_bytebuf_consume);
+    lua_setfield(L, -2, "consume");
+
+    lua_pushcfunction(L, lhp_bytebuf_clear);
+    lua_setfield(L, -2, "clear");
+
+    lua_pushcfunction(L, lhp_bytebuf_string);
+    lua_setfield(L, -2, "string");
+
+    lua_pop(L, 1);
+
+    /* query decoder metatable init */
+    luaL_newmetatable(L, QUERY_MT);
+
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+
+    lua_pushcfunction(L, lhp_query__tostring);
+    lua_setfield(L, -2, "__tostring");
+
+    lua_pushcfunction(L, lhp_query__gc);
+    lua_setfield(L, -2, "__gc");
+
+    lua_pushcfunction(L, lhp_query_feed);
+    lua_setfield(L, -2, "feed");
+
+    lua_pushcfunction(L, lhp_query_finish);
+    lua_setfield(L, -2, "finish");
+
+    lua_pop(L, 1);
+
+    /* lazy_headers metatable init */
+    luaL_newmetatable(L, HEADERS_MT);
+
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+
+    lua_pushcfunction(L, lhp_headers__tostring);
+    lua_setfield(L, -2, "__tostring");
+
+    lua_pushcfunction(L, lhp_headers_count);
+    lua_setfield(L, -2, "__len");
+
+    lua_pushcfunction(L, lhp_headers_count);
+    lua_setfield(L, -2, "count");
+
+    lua_pushcfunction(L, lhp_headers_get);
+    lua_setfield(L, -2, "get");
+
+    lua_pushcfunction(L, lhp_headers_iter);
+    lua_setfield(L, -2, "iter");
+
+    lua_pop(L, 1);
+
+    /* parse_batch records and thread pool metatables init */
+    luaL_newmetatable(L, BATCH_MT);
+    lua_pushcfunction(L, lhp_batch__gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, POOL_MT);
+    lua_pushcfunction(L, lhp_pool__gc);
+    lua_setfield(L, -2, "__gc");
     lua_pop(L, 1);
 
     /* export http.parser */
@@ -692,8 +4014,43 @@ LUALIB_API int luaopen_http_parser(lua_State* L) {
     lua_pushcfunction(L, lhp_response);
     lua_setfield(L, -2, "response");
 
+    lua_pushcfunction(L, lhp_factory_new);
+    lua_setfield(L, -2, "factory");
+
+    lua_pushcfunction(L, lhp_bytebuf_new);
+    lua_setfield(L, -2, "buffer");
+
     lua_pushcfunction(L, lhp_parse_url);
     lua_setfield(L, -2, "parse_url");
-    
+
+    lua_pushcfunction(L, lhp_parse_query);
+    lua_setfield(L, -2, "parse_query");
+
+    lua_pushcfunction(L, lhp_query_new);
+    lua_setfield(L, -2, "query_decoder");
+
+    lua_pushcfunction(L, lhp_pick_scanner);
+    lua_setfield(L, -2, "scanner");
+
+    lua_pushcfunction(L, lhp_serialize_request);
+    lua_setfield(L, -2, "serialize_request");
+
+    lua_pushcfunction(L, lhp_serialize_response);
+    lua_setfield(L, -2, "serialize_response");
+
+    lua_pushcfunction(L, lhp_serialize_chunk);
+    lua_setfield(L, -2, "serialize_chunk");
+
+    lua_pushcfunction(L, lhp_parse_batch);
+    lua_setfield(L, -2, "parse_batch");
+
+    lhp_push_events(L);
+    lua_setfield(L, -2, "events");
+
+#ifdef LHP_STATS
+    lua_pushcfunction(L, lhp_module_stats);
+    lua_setfield(L, -2, "stats");
+#endif
+
     return 1;
 }
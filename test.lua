@@ -88,6 +88,278 @@ function parse_url_test()
         local result = lhp.parse_url(url, is_connect)
         is_deeply(result, expect, 'Url: ' .. url)
     end
+
+    -- Reuse of the table clears the missing parts.
+    local t = {}
+    ok(lhp.parse_url("http://hello.com:8080/a?b#c", false, t) == t, "parse_url fills t")
+    lhp.parse_url("/x", false, t)
+    ok(t.path == "/x" and t.schema == nil and t.host == nil and t.port == nil and
+       t.query == nil and t.fragment == nil, "parse_url reuses t")
+    ok(lhp.parse_url("http://", false, t) == nil, "parse_url of an invalid url")
+end
+
+function split_url_test()
+    local got
+    local parser = lhp.request{
+        split_url = true,
+        on_url = function(...) got = { n = select("#", ...), ... } end,
+    }
+    parser:execute("GET /a%20b?x=%26#f HTTP/1.1\r\n\r\n")
+    is_deeply(got, { n = 3, "/a%20b", "x=%26", "f" }, "split_url")
+
+    parser = lhp.request{
+        decode_url = true,
+        on_url = function(...) got = { n = select("#", ...), ... } end,
+    }
+    parser:execute("GET /a%20b%2")
+    parser:execute("F%zz?x=%26 HTTP/1.1\r\n\r\n")
+    is_deeply(got, { n = 3, "/a b/%zz", "x=%26" }, "decode_url")
+
+    local _, msgs = lhp.request{ split_url = true }:execute_all("GET /p?q HTTP/1.1\r\n\r\n")
+    ok(msgs[1].path == "/p" and msgs[1].query == "q" and msgs[1].url == nil,
+       "split_url in aggregated messages")
+end
+
+function parse_query_test()
+    local t = lhp.parse_query("a=1&b=x+y%21&a=2&&c&%3D=%zz&a=3")
+    is_deeply(t, { a = { "1", "2", "3" }, b = "x y!", c = "", ["="] = "%zz" }, "parse_query")
+
+    local reuse = {}
+    ok(lhp.parse_query("k=v", reuse) == reuse and reuse.k == "v", "parse_query fills t")
+
+    local long = string.rep("x", 100)
+    ok(lhp.parse_query("v=" .. long .. "%41" .. long).v == long .. "A" .. long,
+       "parse_query of long values")
+
+    -- Byte at a time through the decoder.
+    local input = "name=J%C3%B6rg+M&tag=a&tag=b&empty="
+    local decoder = lhp.query_decoder()
+    for i = 1, #input do
+        decoder:feed(input:sub(i, i))
+    end
+    t = decoder:finish()
+    is_deeply(t, { name = "J\195\182rg M", tag = { "a", "b" }, empty = "" }, "query_decoder")
+    ok(decoder:feed(nil).name == nil, "query_decoder starts over")
+
+    decoder = lhp.query_decoder()
+    local form
+    local parser = lhp.request{
+        on_body = function(chunk) form = decoder:feed(chunk) end,
+    }
+    parser:execute("POST / HTTP/1.1\r\nContent-Length: 8\r\n\r\nx=1")
+    parser:execute("&y=22")
+    ok(form and form.x == "1" and form.y == "22", "query_decoder as on_body")
+end
+
+function scanner_test()
+    local best = lhp.scanner()
+    local input = "a=" .. string.rep("x", 40) .. "%41+b&" .. string.rep("K", 33) .. "=1&a=2"
+    local field = "X-" .. string.rep("Mixed-Case", 5)
+    local results = {}
+    for _, name in ipairs{ "scalar", "sse2", "avx2" } do
+        if pcall(lhp.scanner, name) then
+            local got
+            lhp.request{
+                lowercase_headers = true,
+                on_header = function(k) got = k end,
+            }:execute("GET / HTTP/1.1\r\n" .. field .. ": 1\r\n\r\n")
+            local t = lhp.parse_query(input)
+            results[#results + 1] = table.concat({ got, t.a[1], t.a[2], t[string.rep("K", 33)] }, "|")
+            ok(results[#results] == results[1], "scanner " .. name .. " gives the same results")
+        end
+    end
+    ok(results[1] == field:lower() .. "|" .. string.rep("x", 40) .. "A b|2|1", "scanner results")
+
+    -- A parser keeps the scanner it was made with.
+    lhp.scanner("scalar")
+    local got
+    local parser = lhp.request{ lowercase_headers = true, on_header = function(k) got = k end }
+    lhp.scanner(best)
+    parser:execute("GET / HTTP/1.1\r\n" .. field .. ": 1\r\n\r\n")
+    ok(got == field:lower() and lhp.scanner() == best, "scanner switched after a parser was made")
+    ok(not pcall(lhp.scanner, "no-such-scanner"), "unknown scanner")
+end
+
+function serialize_test()
+    ok(lhp.serialize_response(404, { ["Content-Type"] = "text/plain" }, 9) ==
+       "HTTP/1.1 404 Not Found\r\nContent-Type: text/plain\r\nContent-Length: 9\r\n\r\n",
+       "serialize_response")
+    ok(lhp.serialize_response(299, nil, true) ==
+       "HTTP/1.1 299 \r\nTransfer-Encoding: chunked\r\n\r\n", "unknown status, chunked")
+    ok(lhp.serialize_request("GET", "/", { Host = "localhost" }) ==
+       "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n", "serialize_request")
+
+    -- What is serialized parses back to the same message.
+    local message
+    local parser = lhp.request{ on_message = function(m) message = m end }
+    local buffer = lhp.buffer()
+    lhp.serialize_request("POST", "/upload?x=1", {
+        Host = "example.com",
+        ["X-Count"] = 42,
+        ["X-Tag"] = { "a", "b" },
+    }, true, buffer)
+    lhp.serialize_chunk("hello ", buffer)
+    lhp.serialize_chunk("world", buffer)
+    lhp.serialize_chunk(nil, buffer)
+    ok(parser:execute(buffer) == buffer:len(), "parse serialized request")
+    is_deeply(message, {
+        method = "POST",
+        url = "/upload?x=1",
+        body = "hello world",
+        headers = {
+            ["Host"] = "example.com",
+            ["X-Count"] = "42",
+            ["X-Tag"] = "a, b",
+            ["Transfer-Encoding"] = "chunked",
+        },
+    }, "serialized request round trip")
+
+    ok(not pcall(lhp.serialize_request, "FETCH", "/", {}), "unknown method")
+    ok(not pcall(lhp.serialize_request, "GET\0X", "/", {}), "method with a NUL")
+    ok(not pcall(lhp.serialize_request, "GET", "/ HTTP/1.0", {}), "url with a space")
+    ok(not pcall(lhp.serialize_response, 200, { ["X"] = "a\r\nInjected: 1" }),
+       "header value with CRLF")
+    ok(not pcall(lhp.serialize_response, 200, { ["Bad Field"] = "1" }), "invalid header field")
+end
+
+function parse_batch_test()
+    local get = "GET /a HTTP/1.1\r\nHost: x\r\nX-Tag: 1\r\nX-Tag: 2\r\n\r\n"
+    local post = "POST /b HTTP/1.1\r\nContent-Length: 5\r\n\r\nhello"
+    local partial = "GET /c HTTP/1.1\r\nHo"
+    local buffer = lhp.buffer()
+    buffer:append(post)
+
+    local results = lhp.parse_batch({ get .. post, get .. partial, "BREW / HTTP/1.1\r\n\r\n", buffer },
+                                    { threads = 2 })
+    ok(#results == 4, "a result per buffer")
+
+    local r = results[1]
+    ok(#r == 2 and r.bytes_read == #get + #post and r.error == nil, "pipelined requests")
+    is_deeply(r[1], {
+        method = "GET", url = "/a", major = 1, minor = 1,
+        keep_alive = true, upgrade = false,
+        headers = { Host = "x", ["X-Tag"] = "1, 2" },
+    }, "batch request")
+    ok(r[2].method == "POST" and r[2].body == "hello", "batch request body")
+
+    r = results[2]
+    ok(#r == 1 and r.bytes_read == #get and r.error == nil, "partial message left out")
+    ok(#results[3] == 0 and results[3].error == "HPE_INVALID_METHOD", "batch error")
+    ok(#results[4] == 1 and results[4][1].body == "hello", "lhp.buffer input")
+
+    -- Many responses give the same results on one or more threads.
+    local response = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n" ..
+        "3\r\nabc\r\n2\r\nde\r\n0\r\n\r\n"
+    local buffers = {}
+    for i = 1, 64 do
+        buffers[i] = string.rep(response, i % 4 + 1)
+    end
+    local one = lhp.parse_batch(buffers, { threads = 1, response = true })
+    local four = lhp.parse_batch(buffers, { threads = 4, response = true })
+    is_deeply(four, one, "threads = 1 and 4 agree")
+    ok(#one[3] == 4 and one[3][4].status_code == 200 and one[3][4].status_text == "OK" and
+       one[3][4].body == "abcde", "batch response")
+
+    -- A folded value keeps its tail, as execute_all() gives it.
+    local folded = "GET / HTTP/1.1\r\nX-Fold: a\r\n b\r\n\tc\r\nX-Empty:\r\n\r\n"
+    local _, msgs = lhp.request{}:execute_all(folded)
+    r = lhp.parse_batch({ folded })[1]
+    ok(#r == 1 and r[1].headers["X-Fold"] == msgs[1].headers["X-Fold"] and
+       r[1].headers["X-Fold"]:sub(1, 1) == "a" and r[1].headers["X-Fold"]:sub(-1) == "c",
+       "batch folded header value")
+    ok(r[1].headers["X-Empty"] == "", "batch empty header value")
+
+    ok(not pcall(lhp.parse_batch, { get }, { threads = 0 }), "threads must be positive")
+    ok(not pcall(lhp.parse_batch, { get, 42 }), "numbers are not buffers")
+    ok(#lhp.parse_batch({}) == 0, "empty batch")
+end
+
+function multipart_test()
+    local ok_load, multipart = pcall(require, 'http.multipart')
+    ok(ok_load, "load http.multipart")
+    if not ok_load then
+        return
+    end
+
+    local boundary = multipart.boundary('multipart/form-data; boundary="--xyz"')
+    ok(boundary == "--xyz", "quoted boundary")
+    ok(multipart.boundary("multipart/form-data;Boundary=abc; charset=utf-8") == "abc", "boundary")
+    ok(multipart.boundary("text/plain") == nil, "no boundary")
+
+    local body = table.concat({
+        "preamble",
+        "----xyz",
+        "Content-Disposition: form-data; name=\"a\"",
+        "",
+        "one\r\n--xy",
+        "----xyz  ",
+        "Content-Disposition: form-data; name=\"f\"; filename=\"f.txt\"",
+        "Content-Type: text/plain",
+        "",
+        "two",
+        "----xyz--",
+        "epilogue",
+    }, "\r\n")
+
+    local current
+    local function parse(chunk_size, callbacks)
+        local events = {}
+        local cbs = {
+            on_part_begin = function() events[#events+1] = "begin" end,
+            on_header = function(k, v) events[#events+1] = k .. "=" .. v end,
+            on_headers_complete = function() events[#events+1] = "headers" end,
+            on_data = function(chunk)
+                if type(events[#events]) == "table" then
+                    table.insert(events[#events], chunk)
+                else
+                    events[#events+1] = { chunk }
+                end
+            end,
+            on_part_complete = function() events[#events+1] = "end" end,
+            on_complete = function() events[#events+1] = "complete" end,
+        }
+        for k, v in pairs(callbacks or {}) do cbs[k] = v end
+        current = multipart.new(boundary, cbs)
+        local fed = true
+        for pos = 1, #body, chunk_size do
+            fed = current:feed(body:sub(pos, pos + chunk_size - 1)) and fed
+        end
+        ok(fed and current:finish(), "feed and finish")
+        for i, ev in ipairs(events) do
+            if type(ev) == "table" then events[i] = table.concat(ev) end
+        end
+        return events
+    end
+
+    local expect = {
+        "begin", "Content-Disposition=form-data; name=\"a\"", "headers",
+        "one\r\n--xy", "end",
+        "begin", "Content-Disposition=form-data; name=\"f\"; filename=\"f.txt\"",
+        "Content-Type=text/plain", "headers", "two", "end", "complete",
+    }
+    is_deeply(parse(#body), expect, "multipart body in one chunk")
+    is_deeply(parse(1), expect, "multipart body byte by byte")
+    is_deeply(parse(7), expect, "multipart body in 7 byte chunks")
+
+    -- The second part is written to a file.
+    local file = io.tmpfile()
+    parse(5, {
+        on_header = function(k)
+            if k == "Content-Type" then current:sink(file) end
+        end,
+    })
+    file:seek("set")
+    ok(file:read("*a") == "two", "part data written to the sink")
+    file:close()
+
+    local mp = multipart.new("b", { max_header_size = 16 })
+    local res, err = mp:feed("--b\r\nContent-Disposition: form-data\r\n")
+    ok(res == nil and err == mp:error(), "max_header_size: " .. tostring(err))
+
+    mp = multipart.new("b", {})
+    ok(mp:feed("--b\r\n\r\ndata"), "feed")
+    ok(not mp:finish(), "body without the close delimiter")
+    ok(not multipart.new("b", {}):feed("--bx"), "invalid boundary line")
 end
 
 function status_code_test()
@@ -270,15 +542,14 @@ function nil_body_test()
 end
 
 function max_events_test(N)
-    N = N or 3000
+    N = N or 10000
 
-    -- The goal of this test is to generate the most possible events
+    -- The goal of this test is to generate the most possible events,
+    -- far more than fit on the Lua stack at once.
     local input_tbl = {
         "GET / HTTP/1.1\r\n",
     }
-    -- Generate enough events to trigger a "stack overflow"
-    local header_cnt = N
-    for i=1, header_cnt do
+    for i=1, N do
         input_tbl[#input_tbl+1] = "a:\r\n"
     end
     input_tbl[#input_tbl+1] = "\r\n"
@@ -293,22 +564,691 @@ function max_events_test(N)
     local input = table.concat(input_tbl)
     local result = parser:execute(input)
 
-    N = N * 2
-    if (#input == result) and ( N < 100000 ) then
-        return max_events_test(N)
+    ok(#input == result, "Expect to read " .. #input .. " bytes, got " .. result)
+    ok(field_cnt == N, "Expect " .. N .. " field events, got " .. field_cnt)
+    ok(parser:error() == 0, "Parser can continue after many events")
+end
+
+function max_events_yield_test(N)
+    N = N or 5000
+
+    -- Many chunks in one execute, with callbacks that yield.
+    local input_tbl = {
+        "HTTP/1.1 200 OK\r\n",
+        "Transfer-Encoding: chunked\r\n",
+        "\r\n",
+    }
+    for i=1, N do
+        input_tbl[#input_tbl+1] = "1\r\nx\r\n"
+    end
+    input_tbl[#input_tbl+1] = "0\r\n\r\n"
+    local input = table.concat(input_tbl)
+
+    local body_cnt, complete = 0, false
+    local parser = lhp.response{
+        on_body = function(chunk)
+            if chunk then body_cnt = body_cnt + 1 end
+            coroutine.yield()
+        end,
+        on_message_complete = function() complete = true end,
+    }
+
+    local co = coroutine.wrap(function() return parser:execute(input) end)
+    local result, yields = nil, 0
+    repeat
+        result = co()
+        yields = yields + 1
+    until result
+
+    ok(result == #input, "Expect to read " .. #input .. " bytes, got " .. result)
+    ok(body_cnt == N and complete, "Expect " .. N .. " body events, got " .. body_cnt)
+    ok(yields == N + 2, "callbacks yielded across resumed parses")
+end
+
+function execute_into_test()
+    local ev = lhp.events
+    local input = "GET /path?q HTTP/1.1\r\n" ..
+        "Host: localhost\r\n" ..
+        "Content-Length: 4\r\n" ..
+        "\r\n" ..
+        "body"
+
+    local events = {}
+    local parser = lhp.request{}
+    local bytes_read, count = parser:execute_into(input, events)
+
+    ok(bytes_read == #input, "execute_into read all bytes")
+
+    local got = {}
+    for i=1, count * 3, 3 do
+        got[#got+1] = { ev[events[i]], events[i+1], events[i+2] }
     end
+    is_deeply(got, {
+        { "on_message_begin" },
+        { "on_url", "/path?q" },
+        { "on_header", "Host", "localhost" },
+        { "on_header", "Content-Length", "4" },
+        { "on_headers_complete" },
+        { "on_body", "body" },
+        { "on_body" },
+        { "on_message_complete" },
+    }, "execute_into records")
+    ok(count == 8, "execute_into record count " .. count)
+
+    -- Reuse of the table with tokens split across calls.
+    bytes_read, count = parser:execute_into("GET /sp", events)
+    ok(count == 1 and ev[events[1]] == "on_message_begin", "split url is buffered")
+    bytes_read, count = parser:execute_into("lit HTTP/1.1\r\n\r\n", events)
+    ok(count == 4 and events[1] == ev.on_url and events[2] == "/split",
+       "split url is flushed into reused table")
+end
 
-    input = input:sub(result + 1)
+function input_slices_test()
+    local urls, bodies = {}, {}
+    local parser = lhp.request{
+        on_url  = function(url) urls[#urls+1] = url end,
+        on_body = function(body) if body then bodies[#bodies+1] = body end end,
+    }
+    local input = "garbageGET /a HTTP/1.1\r\nContent-Length: 2\r\n\r\nhigarbage"
+    local n = parser:execute(input, 8, #input - 14)
+    ok(n == #input - 14, "execute with init and len read " .. n)
+    ok(urls[1] == "/a" and bodies[1] == "hi", "execute with init and len")
+
+    -- Upgrade leftovers are parsed without :sub()
+    local events = {}
+    parser = lhp.request{}
+    input = "GET /b HTTP/1.1\r\n\r\nGET /c HTTP/1.1\r\n\r\n"
+    n = parser:execute_into(input, events, 1, 19)
+    ok(n == 19, "execute_into with len")
+    parser:execute_into(input, events, n + 1)
+    ok(events[4] == lhp.events.on_url and events[5] == "/c", "execute_into with init")
+    ok(not pcall(parser.execute, parser, input, #input + 2), "init out of range")
+    ok(not pcall(parser.execute, parser, input, 1, #input + 1), "len out of range")
+
+    local buffer = lhp.buffer(16)
+    urls = {}
+    parser = lhp.request{ on_url = function(url) urls[#urls+1] = url end }
+    buffer:append("GET /x HTTP/1.1\r\n\r\nGET /y")
+    n = parser:execute(buffer)
+    ok(n == buffer:len(), "parse all of the buffer")
+    buffer:consume(n)
+    buffer:append(" HTTP/1.1\r\n\r\n")
+    buffer:consume(parser:execute(buffer))
+    ok(buffer:len() == 0, "buffer consumed")
+    is_deeply(urls, { "/x", "/y" }, "parse from buffer")
+
+    buffer:append("0123456789")
+    buffer:consume(4)
+    ok(buffer:string(1, 2) == "45" and buffer:string(-2) == "89", "buffer:string")
+    buffer:append(string.rep("z", 100))
+    ok(buffer:len() == 106 and buffer:string(1, 6) == "456789", "append compacts")
+    local _, msgs = lhp.request{}:execute_all(buffer)
+    ok(#msgs == 0, "execute_all from buffer")
+    buffer:clear()
+    ok(buffer:len() == 0, "buffer:clear")
+end
 
-    -- We should have generated a stack overflow event that should be
-    -- handled gracefully... note that
-    ok(#input < result,
-       "Expect " .. header_cnt .. " field events, got " .. field_cnt)
+function on_message_test()
+    local msgs = {}
+    local complete_count = 0
+    local parser = lhp.request{
+        on_message = function(msg) msgs[#msgs+1] = msg end,
+        on_message_complete = function() complete_count = complete_count + 1 end,
+    }
 
-    result = parser:execute(input)
+    local input = {
+        "POST /up", "load HTTP/1.1\r\n",
+        "Host: localhost\r\n",
+        "Transfer-Encoding: chunked\r\n",
+        "X-A: 1\r\nX-", "A: 2\r\n",
+        "\r\n",
+        "5\r\nhello\r\n",
+        "6\r\n world\r\n",
+        "0\r\n\r\n",
+    }
+    for _, chunk in ipairs(input) do
+        ok(parser:execute(chunk) == #chunk, "on_message parser read " .. chunk)
+    end
+    ok(parser:execute(pipeline) == #pipeline, "on_message parser read pipeline")
+
+    ok(#msgs == 3 and complete_count == 3, "on_message called per message")
+    is_deeply(msgs[1], {
+        method = "POST",
+        url = "/upload",
+        major = 1,
+        minor = 1,
+        headers = {
+            Host = "localhost",
+            ["X-A"] = "1, 2",
+        },
+        body = "hello world",
+        keep_alive = true,
+        upgrade = false,
+    }, "aggregated chunked request")
+    is_deeply(msgs[3], {
+        method = "GET",
+        url = "/header.jpg",
+        headers = { Connection = "keep-alive" },
+    }, "aggregated pipelined request")
+    ok(msgs[3].body == nil, "aggregated empty body is nil")
+
+    local res
+    parser = lhp.response{
+        on_message = function(msg) res = msg end,
+    }
+    parser:execute(please_continue)
+    parser:execute('')
+    is_deeply(res, {
+        status_code = 200,
+        status_text = "OK",
+        headers = { ["Content-Length"] = "10" },
+        body = "0123456789",
+        keep_alive = false,
+    }, "aggregated response")
+end
+
+function lowercase_headers_test()
+    local input = "GET / HTTP/1.1\r\n" ..
+        "Host: localhost\r\n" ..
+        "content-length: 0\r\n" ..
+        "X-Custom-Header: a\r\n" ..
+        "ETAG: b\r\n" ..
+        "\r\n"
+
+    local function collect(options)
+        local headers = {}
+        options.on_header = function(k, v) headers[#headers+1] = k end
+        lhp.request(options):execute(input)
+        return headers
+    end
+
+    is_deeply(collect{},
+              { "Host", "content-length", "X-Custom-Header", "ETAG" },
+              "header keys keep their case by default")
+    is_deeply(collect{ lowercase_headers = true },
+              { "host", "content-length", "x-custom-header", "etag" },
+              "lowercase_headers lowercases header keys")
+end
+
+function body_slices_test()
+    local head = "POST / HTTP/1.1\r\nContent-Length: 10\r\n\r\n"
+    local slices = {}
+    local parser = lhp.request{
+        body_slices = true,
+        on_body = function(buf, offset, length)
+            if buf then
+                slices[#slices+1] = buf:sub(offset, offset + length - 1)
+            else
+                slices[#slices+1] = "<eof>"
+            end
+        end,
+    }
+    parser:execute(head .. "01234")
+    parser:execute("56789")
+    is_deeply(slices, { "01234", "56789", "<eof>" }, "body slices")
+
+    local events = {}
+    parser = lhp.request{ body_slices = true }
+    local input = head .. "0123456789"
+    local _, count = parser:execute_into(input, events)
+    local found
+    for i=1, count * 3, 3 do
+        if events[i] == lhp.events.on_body and events[i+1] then
+            found = input:sub(events[i+1], events[i+1] + events[i+2] - 1)
+        end
+    end
+    ok(found == "0123456789", "execute_into body slices")
+end
+
+function execute_all_test()
+    local parser = lhp.request{
+        on_message_begin = function() error("no callbacks in execute_all") end,
+    }
+    local bytes_read, msgs = parser:execute_all(pipeline)
+    ok(bytes_read == #pipeline, "execute_all read the pipeline")
+    ok(#msgs == 2, "execute_all returns both pipelined requests")
+    is_deeply(msgs, {
+        { method = "GET", url = "/", headers = { Host = "localhost" } },
+        { method = "GET", url = "/header.jpg", keep_alive = true },
+    }, "execute_all messages")
+
+    -- Reuse the array, with a message split across calls.
+    local reused = msgs
+    bytes_read, msgs = parser:execute_all(pipeline:sub(1, 40), reused)
+    ok(msgs == reused and #msgs == 0, "no complete message in first 40 bytes")
+    bytes_read, msgs = parser:execute_all(pipeline:sub(41), reused)
+    ok(#msgs == 2 and msgs[2].url == "/header.jpg", "split messages completed")
+end
+
+function factory_test()
+    local urls = {}
+    local msgs = {}
+    local factory = lhp.factory{
+        on_url = function(url) urls[#urls+1] = url end,
+        lowercase_headers = true,
+    }
+    local p1, p2 = factory:request(), factory:request()
+    p1:execute("GET /one HT")
+    p2:execute("GET /two HTTP/1.1\r\n\r\n")
+    p1:execute("TP/1.1\r\n\r\n")
+    is_deeply(urls, { "/two", "/one" }, "factory parsers share callbacks")
+
+    local res = lhp.factory{}:response()
+    ok(res:execute(please_continue) == #please_continue, "factory response parser")
+    ok(res:status_code() == 200)
+
+    -- Aggregated messages are kept per parser.
+    factory = lhp.factory{
+        on_message = function(msg) msgs[#msgs+1] = msg end,
+        lowercase_headers = true,
+    }
+    p1, p2 = factory:request(), factory:request()
+    p1:execute("GET /one HTTP/1.1\r\nX-P: 1\r\n")
+    p2:execute("GET /two HTTP/1.1\r\nX-P: 2\r\n\r\n")
+    p1:execute("\r\n")
+    is_deeply(msgs, {
+        { url = "/two", headers = { ["x-p"] = "2" } },
+        { url = "/one", headers = { ["x-p"] = "1" } },
+    }, "factory parsers aggregate separately")
+
+    -- reset with callbacks does not touch the other parsers.
+    local other = {}
+    p1:reset{ on_url = function(url) other[#other+1] = url end }
+    p1:execute("GET /mine HTTP/1.1\r\n\r\n")
+    p2:execute("GET /shared HTTP/1.1\r\n\r\n")
+    ok(other[1] == "/mine" and #other == 1, "reset gives own callbacks")
+    ok(#msgs == 3 and msgs[3].url == "/shared", "shared callbacks unchanged")
+end
+
+function headers_allowlist_test()
+    local input = "GET / HTTP/1.1\r\n" ..
+        "Host: localhost\r\n" ..
+        "Cookie: " .. string.rep("x", 1000) .. "\r\n" ..
+        "content-LENGTH: 0\r\n" ..
+        "X-Tracking: abc\r\n" ..
+        "\r\n"
+
+    local headers = {}
+    local parser = lhp.request{
+        headers = { "host", "Content-Length" },
+        on_header = function(k, v) headers[#headers+1] = k .. "=" .. v end,
+    }
+    ok(parser:execute(input:sub(1, 30)) == 30)
+    ok(parser:execute(input:sub(31)) == #input - 30)
+    is_deeply(headers, { "Host=localhost", "content-LENGTH=0" }, "headers allowlist")
+    ok(#headers == 2, "other headers dropped")
+
+    local msg
+    parser = lhp.request{
+        headers = { "x-tracking" },
+        on_message = function(m) msg = m end,
+    }
+    parser:execute(input)
+    ok(msg.headers["X-Tracking"] == "abc" and msg.headers.Host == nil,
+       "headers allowlist in aggregated messages")
+end
+
+function lazy_headers_test()
+    local input = "GET / HTTP/1.1\r\n" ..
+        "Host: localhost\r\n" ..
+        "Accept: text/html\r\n" ..
+        "X-Empty:\r\n" ..
+        "Cookie: " .. string.rep("x", 1000) .. "\r\n" ..
+        "accept: */*\r\n" ..
+        "\r\n"
+
+    local headers, header_cnt
+    local parser = lhp.request{
+        lazy_headers = true,
+        on_header = function() header_cnt = (header_cnt or 0) + 1 end,
+        on_headers_complete = function(h) headers = h end,
+    }
+    -- Split inside a field and a value.
+    ok(parser:execute(input:sub(1, 20)) == 20)
+    ok(parser:execute(input:sub(21, 60)) == 40)
+    ok(parser:execute(input:sub(61)) == #input - 60)
+    ok(header_cnt == nil, "on_header is not called with lazy_headers")
+    ok(headers:count() == 5 and #headers == 5, "headers:count()")
+    ok(headers:get("HOST") == "localhost", "headers:get() ignores case")
+    ok(headers:get("Accept") == "text/html, */*", "repeated headers are joined")
+    ok(headers:get("x-empty") == "", "empty header value")
+    ok(headers:get("Content-Length") == nil, "missing header")
+
+    local got = {}
+    for field, value in headers:iter() do
+        got[#got+1] = field .. "=" .. value:sub(1, 4)
+    end
+    is_deeply(got, { "Host=loca", "Accept=text", "X-Empty=", "Cookie=xxxx", "accept=*/*" },
+              "headers:iter()")
+
+    -- Each message gets its own object, which may be kept.
+    local first = headers
+    parser:execute("GET / HTTP/1.1\r\nHost: other\r\n\r\n")
+    ok(headers:get("host") == "other" and first:get("host") == "localhost",
+       "headers of the next message")
+
+    local msg
+    parser = lhp.request{
+        lazy_headers = true,
+        lowercase_headers = true,
+        headers = { "host", "accept" },
+        on_message = function(m) msg = m end,
+    }
+    parser:execute(input)
+    got = {}
+    for field in msg.headers:iter() do got[#got+1] = field end
+    is_deeply(got, { "host", "accept", "accept" }, "lazy_headers with headers and lowercase_headers")
+    ok(#got == 3 and msg.headers:get("Cookie") == nil, "headers allowlist with lazy_headers")
+
+    local events = {}
+    local found
+    parser = lhp.request{ lazy_headers = true }
+    parser:execute_into("GET / HTTP/1.1\r\nHost: x\r\n\r\n", events)
+    for i = 1, #events, 3 do
+        if events[i] == lhp.events.on_headers_complete then found = events[i+1] end
+    end
+    ok(found and found:get("host") == "x", "headers object in execute_into()")
+end
+
+function hibernate_test()
+    local msgs = {}
+    local parser = lhp.request{ on_message = function(m) msgs[#msgs+1] = m end }
+    local cookie = string.rep("c", 300)
+    parser:execute("POST / HTTP/1.1\r\nCookie: " .. cookie .. "\r\nContent-Length: 5\r\n\r\nhello")
+    ok(parser:hibernate() > 0, "hibernate releases the buffers")
+    ok(parser:hibernate() == 0, "nothing left to release")
+
+    -- A partially buffered token is kept.
+    parser:execute("GET /a")
+    parser:hibernate()
+    parser:execute("bc HTTP/1.1\r\nHost: x\r\n\r\n")
+    ok(#msgs == 2 and msgs[1].body == "hello" and msgs[1].headers.Cookie == cookie and
+       msgs[2].url == "/abc", "parsing goes on after hibernate")
+
+    local bodies = {}
+    parser = lhp.request{
+        hibernate = true,
+        accumulate_body = true,
+        on_message_complete = function(body) bodies[#bodies+1] = body end,
+    }
+    parser:execute("POST / HTTP/1.1\r\nContent-Length: 4\r\n\r\nab")
+    parser:execute("cd")
+    ok(bodies[1] == "abcd", "body across executes with the hibernate option")
+    ok(parser:hibernate() == 0, "hibernate option at message boundaries")
+
+    -- A headers object owns its bytes, the parser's buffers may go.
+    local headers = {}
+    parser = lhp.request{
+        lazy_headers = true,
+        on_headers_complete = function(h) headers[#headers+1] = h end,
+    }
+    parser:execute("GET / HTTP/1.1\r\nHost: first\r\n\r\nGET / HTTP/1.1\r\nHo")
+    parser:hibernate()
+    ok(headers[1]:get("host") == "first", "headers:get() after hibernate")
+    parser:execute("st: second\r\n\r\n")
+    parser:reset()
+    ok(headers[1]:get("host") == "first" and headers[2]:get("host") == "second",
+       "headers:get() after reset")
+    parser:execute("GET / HTTP/1.1\r\nHost: third\r\n\r\n")
+    ok(headers[3]:get("host") == "third", "lazy_headers after reset")
+end
+
+function body_sink_test()
+    local file = io.tmpfile()
+    local events = {}
+    local parser = lhp.request{
+        body_sink = file,
+        on_body = function(chunk) events[#events+1] = tostring(chunk) end,
+        on_message_complete = function() events[#events+1] = "complete" end,
+    }
+    local input = "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n" ..
+        "5\r\nhello\r\n6\r\n world\r\n0\r\n\r\n"
+    ok(parser:execute(input:sub(1, 60)) == 60)
+    ok(parser:execute(input:sub(61)) == #input - 60)
+    is_deeply(events, { "nil", "complete" }, "body_sink only sends on_body(nil)")
+    file:seek("set")
+    ok(file:read("*a") == "hello world", "body written to body_sink")
+    file:close()
+
+    -- A sink that can't be written stops the parser.
+    file = io.open(arg[0], "r")
+    parser = lhp.factory{}:request()
+    parser:body_sink(file)
+    parser:execute("POST / HTTP/1.1\r\nContent-Length: 4\r\n\r\nbody")
+    local _, name = parser:error()
+    ok(name == "LHP_BODY_SINK", "body_sink write error: " .. name)
+    file:close()
+end
+
+function accumulate_body_test()
+    local bodies = {}
+    local body_cnt = 0
+    local parser = lhp.request{
+        accumulate_body = true,
+        on_body = function() body_cnt = body_cnt + 1 end,
+        on_message_complete = function(body) bodies[#bodies+1] = tostring(body) end,
+    }
+    parser:execute("POST / HTTP/1.1\r\nContent-Length: 10\r\n\r\n0123")
+    parser:execute("456789")
+    parser:execute("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n" ..
+                   "5\r\nhello\r\n6\r\n world\r\n0\r\n\r\n")
+    parser:execute("GET / HTTP/1.1\r\n\r\n")
+    is_deeply(bodies, { "0123456789", "hello world", "nil" }, "accumulated bodies")
+    ok(body_cnt == 0, "on_body is not called with accumulate_body")
+
+    parser = lhp.request{ accumulate_body = true, max_body_size = 8 }
+    parser:execute("POST / HTTP/1.1\r\nContent-Length: 10\r\n\r\n")
+    local _, name = parser:error()
+    ok(name == "LHP_BODY_TOO_LARGE", "Content-Length over max_body_size: " .. name)
+
+    parser = lhp.request{ max_body_size = 8, on_body = function() end }
+    parser:execute("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n" ..
+                   "5\r\nhello\r\n6\r\n world\r\n")
+    _, name = parser:error()
+    ok(name == "LHP_BODY_TOO_LARGE", "chunked body over max_body_size: " .. name)
+end
+
+function limits_test()
+    local function error_name(limits, input)
+        local parser = lhp.factory(limits):request()
+        parser:execute(input)
+        local _, name = parser:error()
+        return name
+    end
+    local function headers(n)
+        return "GET / HTTP/1.1\r\n" .. string.rep("A: b\r\n", n) .. "\r\n"
+    end
+
+    ok(error_name({ max_url_size = 8 }, "GET /12345678 HTTP/1.1\r\n\r\n")
+       == "LHP_URL_TOO_LARGE", "max_url_size")
+    ok(error_name({ max_url_size = 9 }, "GET /12345678 HTTP/1.1\r\n\r\n")
+       == "HPE_OK", "url within max_url_size")
+    ok(error_name({ max_headers = 3 }, headers(4))
+       == "LHP_TOO_MANY_HEADERS", "max_headers")
+    ok(error_name({ max_headers = 4 }, headers(4))
+       == "HPE_OK", "headers within max_headers")
+    ok(error_name({ max_header_size = 100 }, headers(60))
+       == "LHP_HEADER_TOO_LARGE", "max_header_size")
+    ok(error_name({ max_body_size = math.huge, max_url_size = 2^70 },
+                  "POST / HTTP/1.1\r\nContent-Length: 3\r\n\r\nabc")
+       == "HPE_OK", "huge limits are no limit")
+
+    -- Split across executes, without any callbacks.
+    local parser = lhp.request{ max_url_size = 8 }
+    parser:execute("GET /1234")
+    ok(parser:error() == 0, "url below max_url_size")
+    parser:execute("5678 HTTP/1.1\r\n\r\n")
+    local _, name = parser:error()
+    ok(name == "LHP_URL_TOO_LARGE", "split url over max_url_size")
+    parser:reset()
+    ok(parser:error() == 0, "reset clears the error")
+end
+
+function decode_body_test()
+    if not pcall(lhp.request, { decode_body = true }) then
+        return
+    end
+    local body = string.rep("hello gzip world\n", 64)
+    local gzip = "\031\139\008\000\000\000\000\000\002\003\203H\205\201\201WH\175\202,P(\207/\202I\225\202\024\021\024\021\024\021\024\021 N\000\0008\188xS@\004\000\000"
+    local deflate = "\203H\205\201\201WH\175\202,P(\207/\202I\225\202\024\021\024\021\024\021\024\021 N\000\000"
+
+    local function decode(coding, data, chunk_size, options)
+        local chunks = {}
+        options = options or {}
+        options.decode_body = true
+        options.on_body = function(chunk) chunks[#chunks+1] = chunk end
+        local parser = lhp.response(options)
+        local input = "HTTP/1.1 200 OK\r\nContent-Encoding: " .. coding ..
+            "\r\nContent-Length: " .. #data .. "\r\n\r\n" .. data
+        for pos = 1, #input, chunk_size do
+            parser:execute(input:sub(pos, pos + chunk_size - 1))
+        end
+        local _, name = parser:error()
+        return table.concat(chunks), name
+    end
+
+    ok(decode("gzip", gzip, 1000) == body, "gzip body decoded")
+    ok(decode("GZIP", gzip, 3) == body, "gzip body decoded in 3 byte chunks")
+    ok(decode("deflate", deflate, 1000) == body, "raw deflate body decoded")
+
+    -- The first byte of the body alone can't tell zlib from raw deflate.
+    local function adler32(str)
+        local a, b = 1, 0
+        for i = 1, #str do
+            a = (a + str:byte(i)) % 65521
+            b = (b + a) % 65521
+        end
+        return string.char(math.floor(b / 256), b % 256, math.floor(a / 256), a % 256)
+    end
+    local zlib = "\120\156" .. deflate .. adler32(body)
+    for _, data in ipairs{ deflate, zlib } do
+        local chunks = {}
+        local parser = lhp.response{
+            decode_body = true,
+            on_body = function(chunk) chunks[#chunks+1] = chunk end,
+        }
+        parser:execute("HTTP/1.1 200 OK\r\nContent-Encoding: deflate\r\nContent-Length: " ..
+                       #data .. "\r\n\r\n" .. data:sub(1, 1))
+        parser:execute(data:sub(2))
+        ok(parser:error() == 0 and table.concat(chunks) == body,
+           (data == zlib and "zlib" or "raw") .. " deflate body split after its first byte")
+    end
+    ok(decode("br", gzip, 1000) == gzip, "unknown coding passed on")
+
+    local _, name = decode("gzip", gzip, 1000, { max_decoded_size = 100 })
+    ok(name == "LHP_DECODED_TOO_LARGE", "max_decoded_size: " .. name)
+    ok(decode("gzip", gzip, 1000, { max_decoded_size = 0 }) == body, "max_decoded_size 0 is no limit")
+    _, name = decode("gzip", gzip:sub(1, 20) .. string.rep("x", 28), 1000)
+    ok(name == "LHP_DECODE", "corrupt gzip: " .. name)
+
+    local message
+    lhp.response{
+        decode_body = true,
+        on_message = function(m) message = m end,
+    }:execute("HTTP/1.1 200 OK\r\nContent-Encoding: gzip\r\nContent-Length: " ..
+              #gzip .. "\r\n\r\n" .. gzip)
+    ok(message and message.body == body, "aggregated body decoded")
+end
+
+function stats_test()
+    if not lhp.stats then
+        return
+    end
+    lhp.stats(true)
+    local parser = lhp.request{ on_url = function() end, on_header = function() end }
+    parser:execute("GET /sp")
+    parser:execute("lit HTTP/1.1\r\nHost: localhost\r\nX-Custom: 1\r\n\r\n")
+
+    local stats = parser:stats(true)
+    ok(stats.messages == 1, "stats messages")
+    ok(stats.bytes == 53, "stats bytes " .. stats.bytes)
+    ok(stats.events.on_url == 1 and stats.events.on_header == 2, "stats events")
+    ok(stats.fragments == 1, "stats fragments " .. stats.fragments)
+    -- "/split", "localhost", "X-Custom" and "1"; "Host" is interned.
+    ok(stats.strings == 4, "stats strings " .. stats.strings)
+    ok(parser:stats().messages == 0, "stats reset")
+    ok(lhp.stats().messages == 1, "module stats")
+end
+
+function ffi_test()
+    if not pcall(require, 'ffi') then
+        return
+    end
+    local ok_load, ffi_parser = pcall(require, 'http.parser.ffi')
+    ok(ok_load, "load http.parser.ffi")
+    if not ok_load then
+        return
+    end
+    local E = ffi_parser
+    local has_data = { [E.URL] = true, [E.STATUS] = true, [E.HEADER_FIELD] = true,
+                       [E.HEADER_VALUE] = true, [E.BODY] = true }
+
+    local function collect(parser, chunks, out)
+        for _, input in ipairs(chunks) do
+            local pos = 0
+            repeat
+                local n, count = parser:execute(input:sub(pos + 1))
+                for i = 0, count - 1 do
+                    local ev = parser.events[i]
+                    out[#out + 1] = { ev.type, has_data[ev.type] and parser:string(i) or nil }
+                end
+                pos = pos + n
+            until pos >= #input or parser:error() ~= 0
+        end
+        return out
+    end
 
-    ok(0 == result, "Parser can not continue after stack overflow ["
-       .. tostring(result) .. "]")
+    -- A tiny events array forces several returns, the url and the
+    -- header value are split across calls.
+    local parser = ffi_parser.request(2)
+    local got = collect(parser, {
+        "GET /sp",
+        "lit HTTP/1.1\r\nHost: local",
+        "host\r\nContent-Length: 3\r\n\r\nabc",
+    }, {})
+    is_deeply(got, {
+        { E.MESSAGE_BEGIN },
+        { E.URL, "/split" },
+        { E.HEADER_FIELD, "Host" },
+        { E.HEADER_VALUE, "localhost" },
+        { E.HEADER_FIELD, "Content-Length" },
+        { E.HEADER_VALUE, "3" },
+        { E.HEADERS_COMPLETE },
+        { E.BODY, "abc" },
+        { E.MESSAGE_COMPLETE },
+    }, "ffi events")
+    ok(parser:error() == 0, "ffi no error")
+    ok(parser:method() == "GET", "ffi method")
+    ok(parser:should_keep_alive(), "ffi keep alive")
+
+    -- The lines of a folded value do not touch, each is a record
+    -- starting with its whitespace.
+    parser = ffi_parser.request()
+    got = collect(parser, { "GET / HTTP/1.1\r\nX: a\r\n bc\r\n\r\n" }, {})
+    is_deeply(got, {
+        { E.MESSAGE_BEGIN },
+        { E.URL, "/" },
+        { E.HEADER_FIELD, "X" },
+        { E.HEADER_VALUE, "a" },
+        { E.HEADER_VALUE, " bc" },
+        { E.HEADERS_COMPLETE },
+        { E.MESSAGE_COMPLETE },
+    }, "ffi folded header value")
+
+    parser = ffi_parser.request(2)
+    got = collect(parser, { "GET / HTTP/1.1\r\nX: a", "\r\n bc\r\n\r\n" }, {})
+    ok(got[4][2] == "a" and got[5][1] == E.HEADER_VALUE and got[5][2] == " bc",
+       "ffi folded header value split after the first line")
+
+    parser = ffi_parser.response()
+    got = collect(parser, { "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n3\r\nabc\r\n0\r\n\r\n" }, {})
+    ok(parser:status_code() == 200, "ffi status code")
+    ok(got[#got][1] == E.MESSAGE_COMPLETE, "ffi chunked response complete")
+
+    parser = ffi_parser.request()
+    parser:execute("GET / HTTP/1.1\r\nBad Header\r\n\r\n")
+    local errno, name = parser:error()
+    ok(errno ~= 0 and name == "HPE_INVALID_HEADER_TOKEN", "ffi error " .. name)
 end
 
 function regression_no_body_cb_test()
@@ -514,14 +1454,37 @@ end
 buffer_tests()
 basic_tests()
 max_events_test()
+max_events_yield_test()
 nil_body_test()
 pipeline_test()
 please_continue_test()
 connection_close_test()
 regression_no_body_cb_test()
+execute_into_test()
+input_slices_test()
+on_message_test()
+lowercase_headers_test()
+body_slices_test()
+execute_all_test()
+factory_test()
+headers_allowlist_test()
+lazy_headers_test()
+hibernate_test()
+body_sink_test()
+accumulate_body_test()
+limits_test()
+decode_body_test()
+stats_test()
+ffi_test()
 status_code_test()
 chunk_header_test()
 parse_url_test()
+split_url_test()
+parse_query_test()
+scanner_test()
+serialize_test()
+parse_batch_test()
+multipart_test()
 reset_test()
 reset_callback_test()
 